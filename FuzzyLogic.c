@@ -7,11 +7,53 @@
    https://www.mathworks.com/help/fuzzy/foundations-of-fuzzy-logic.html#bp78l70-2
    for more information and modified rule_evaluation function,
    users may also change program as needed to work with more antecedents and consequences */
+#ifndef _POSIX_C_SOURCE                                // FuzzyLogicBenchmark.c defines these before its own includes
+#define _POSIX_C_SOURCE             200809L            // stat() st_mtim for live_reload(), also with -std=c11
+#endif
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE                                // syscall() for the perf counters, also with -std=c11
+#endif
+#if defined(__APPLE__) && !defined(_DARWIN_C_SOURCE)
+#define _DARWIN_C_SOURCE                               // st_mtimespec, which _POSIX_C_SOURCE alone hides
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__unix__) || defined(__APPLE__)
+#define FUZZY_HOSTED                                   // host-only tools (timers, benchmarks) are built
+#include <time.h>
+#endif
+#if defined(FUZZY_HOSTED) && defined(__linux__)
+#define FUZZY_PERF_COUNTERS                            // cycles/instructions through perf_event_open()
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(FUZZY_HOSTED) && !defined(FUZZY_NO_THREADS)
+#define FUZZY_THREADS                                  // worker pool for evaluate_batch_parallel(), link with -pthread
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#define st_mtim                     st_mtimespec       // same struct timespec under its BSD name
+#endif
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FUZZY_X86_SIMD                                 // SSE2/AVX2 batch kernels, picked at runtime
+#include <immintrin.h>
+#endif
 
 #define UPPER_LIMIT                 255
+/* Dimensions and tables of the controller. Another controller (any number
+   of inputs and outputs, a rule concludes one mf of every output) is
+   built in with -DFUZZY_MODEL_FILE=\"model.h\", a header with every
+   define and table from here to "END MODEL" */
+#ifdef FUZZY_MODEL_FILE
+#include FUZZY_MODEL_FILE
+#else
 #define NUMBER_OF_INPUT_OUTPUT      3                  // total system input/output
 #define TOTAL_NUMBER_OF_MF          21                 // total of membership functions
 #define NUMBER_OF_RULE              15                 // number of rules in ruleBase
@@ -22,41 +64,487 @@
 #define NUMBER_OF_THEN_SIDE         1                  // number of thenSides for each rule
 #define TOTAL_NUMBER_OF_IF_SIDE     30                 // total number of ifSides for all rules
 #define TOTAL_NUMBER_OF_THEN_SIDE   15                 // total number of thenSide for all rules
+#endif
+#if NUMBER_OF_IF_SIDE != NUMBER_OF_INPUT || NUMBER_OF_THEN_SIDE != NUMBER_OF_OUTPUT
+#error "a rule has one antecedent per input and one consequent per output"
+#endif
+#if TOTAL_NUMBER_OF_MF != NUMBER_OF_INPUT_OUTPUT*NUMBER_OF_MF || NUMBER_OF_INPUT_OUTPUT != NUMBER_OF_INPUT + NUMBER_OF_OUTPUT
+#error "TOTAL_NUMBER_OF_MF and NUMBER_OF_INPUT_OUTPUT do not match the other dimensions"
+#endif
+#define FIRST_OUTPUT_MF             (NUMBER_OF_INPUT*NUMBER_OF_MF) // output mfs follow the input mfs in mf[]
+#if NUMBER_OF_INPUT == 2 && NUMBER_OF_OUTPUT == 1
+#define FUZZY_SURFACE                                  // two-input tools: surface table, specialized engine
+#endif
+#define BATCH_BLOCK                 64                 // samples per stage pass in evaluate_batch()
+#define SURFACE_SIZE                (UPPER_LIMIT + 1)  // table entries per input in surfaceTable
+#define SPARSE_RULE_THRESHOLD       32                 // rule bases larger than this use rule_evaluation_sparse()
+#define MAX_THREADS                 64                 // workers in a pool_type
+#define PARALLEL_CHUNK              (16*BATCH_BLOCK)   // samples per unit of work in evaluate_batch_parallel()
+#define MEMO_SIZE                   8                  // recent input vectors remembered by evaluate_incremental()
+#define STREAM_BLOCK                (16*PARALLEL_CHUNK) // samples read, evaluated and written per pass of run_stream()
+#define STREAM_BUFFER               (1 << 16)          // bytes held by a reader_type or writer_type
+#define STATS_BINS                  8                  // strength histogram bins per rule, FUZZY_STATS builds
+#define STATS_TIMING_PERIOD         64                 // one call of a stage in this many is timed, FUZZY_STATS builds
+#define STATS_SAMPLE_PERIOD         16                 // one batch sample in this many is walked for the rule histograms
+#define LIVE_READERS                (2*MAX_THREADS)    // threads evaluating through one live_model_type at once
+#define MODEL_LINE                  1024               // longest line of a model file
+#define MODEL_WORD                  64                 // longest name or TSK consequent in a model file
+#define PIPELINE_BATCH              BATCH_BLOCK        // samples a batch carries from stage to stage
+#define PIPELINE_DEPTH              8                  // batches a ring between two stages holds, a power of two
+#define PIPELINE_BATCHES            (4*PIPELINE_DEPTH) // what the four rings hold, so they can never all be full and stuck
+#define LATENCY_SUB_BITS            3                  // 8 buckets per power of two of a latency_type, 6% apart
+#define LATENCY_BUCKETS             (64 << LATENCY_SUB_BITS)
+#define APPROX_WEIGHT_BITS          15                 // fraction bits of the interpolation weights
+#define APPROX_MAX_TABLE            (1 << 22)          // values an approx_type table may hold
+#define APPROX_EXHAUSTIVE           (1 << 24)          // domains with up to this many outputs are checked whole
+#define APPROX_SAMPLES              (1 << 18)          // random inputs checking a larger domain
+#define APPROX_ROUNDS               12                 // refinement passes of build_approx()
+#define TUNE_CHUNK                  (16*BATCH_BLOCK)   // dataset samples per evaluate_batch() of a candidate
+#define TUNE_STEP                   16                 // first point move of a search, halved when nothing improves
+#define TUNE_INVALID                1e300              // cost of a candidate with points out of order
+#if NUMBER_OF_INPUT <= 4 && NUMBER_OF_MF <= 8        // grid cells hold the consequents as an 8-bit mask
+#define FUZZY_RULE_GRID                                // RULE_ENGINE_GRID is available
+#if NUMBER_OF_INPUT == 1                               // cells of the dense rule grid, NUMBER_OF_MF^NUMBER_OF_INPUT
+#define GRID_CELLS                  NUMBER_OF_MF
+#elif NUMBER_OF_INPUT == 2
+#define GRID_CELLS                  (NUMBER_OF_MF*NUMBER_OF_MF)
+#elif NUMBER_OF_INPUT == 3
+#define GRID_CELLS                  (NUMBER_OF_MF*NUMBER_OF_MF*NUMBER_OF_MF)
+#else
+#define GRID_CELLS                  (NUMBER_OF_MF*NUMBER_OF_MF*NUMBER_OF_MF*NUMBER_OF_MF)
+#endif
+#define GRID_NO_RULE                0                  // grid cell without any rule
+#define GRID_STRIDE                 ((GRID_CELLS + 15) & ~15) // grid rows padded for 16-byte vectors
+#endif
+#if NUMBER_OF_MF <= 8                                  // bytes per degree table row, a power of two
+#define MF_ROW                      8                  // so a row never straddles a cache line
+#elif NUMBER_OF_MF <= 16
+#define MF_ROW                      16
+#elif NUMBER_OF_MF <= 32
+#define MF_ROW                      32
+#else
+#define MF_ROW                      64
+#endif
 
 typedef struct io_type{
   char *name;
-  int value;
-  struct mf_type *membership_functions;
-  struct io_type *next;
+  int first_mf;                        /* index of its first membership function in mf[] */
 }io_type;
 
 typedef struct mf_type{
   char *name;
-  int value;
   int point1;
   int point2;
   int slope1;
   int slope2;
-  struct mf_type *next;
+  int point[4];                        /* the four points it was set from, as point[][] */
 }mf_type;
 
+/* antecedents and consequents are plain indices into model_type.mf[],
+   resolved once by initialize_system() */
 typedef struct rule_type{
-  struct rule_element_type *if_side;
-  struct rule_element_type *then_side;
-  struct rule_type *next;
+  int if_side[NUMBER_OF_IF_SIDE];
+  int then_side[NUMBER_OF_THEN_SIDE];
 }rule_type;
 
-typedef struct rule_element_type{
-  int *value;
-  struct rule_element_type *next;
-}rule_element_type;
+/* degrees of every input mf for every input value, built by build_degree_table():
+   row [i][x] holds the NUMBER_OF_MF degrees of input i at value x */
+typedef struct degree_table_type{
+  _Alignas(64) unsigned char degree[NUMBER_OF_INPUT][SURFACE_SIZE][MF_ROW];
+}degree_table_type;
+
+#define ENGINE_ARITHMETIC           0                  // slope arithmetic per sample
+#define ENGINE_TABLE                1                  // rows of a degree_table_type
+#define NUMBER_OF_ENGINE            2
+
+/* compiled model: built once, read-only afterwards */
+typedef struct model_type{
+  io_type inputOutput[NUMBER_OF_INPUT_OUTPUT];
+  mf_type mf[TOTAL_NUMBER_OF_MF];
+  rule_type ruleBase[NUMBER_OF_RULE];
+  int kernel;                          /* batch kernel picked by select_kernel() */
+  int rule_engine;                     /* how rule_evaluation() walks the rule base */
+  /* inverted index: rules using input mf m as antecedent are
+     ruleIndex[ruleIndexStart[m]] .. ruleIndex[ruleIndexStart[m+1]-1] */
+  int ruleIndexStart[NUMBER_OF_INPUT*NUMBER_OF_MF + 1];
+  int ruleIndex[TOTAL_NUMBER_OF_IF_SIDE];
+#ifdef FUZZY_RULE_GRID
+  /* dense rule grid over one mf per input, input 0 varies slowest; bit k of
+     ruleGrid[o][cell] is set when some rule with those antecedents concludes mf k of output o */
+  unsigned char ruleGrid[NUMBER_OF_OUTPUT][GRID_CELLS];
+  _Alignas(16) unsigned char ruleGridMask[NUMBER_OF_OUTPUT*NUMBER_OF_MF][GRID_STRIDE]; /* one bit of every cell spread to 0x00/0xff */
+#endif
+  int engine;                          /* fuzzification engine */
+  const degree_table_type *degree_table; /* used by ENGINE_TABLE */
+  int defuzzifier[NUMBER_OF_OUTPUT];   /* method of each output, see select_defuzzifier() */
+  int inference;                       /* INFERENCE_, from the consequents of the rule table */
+  /* INFERENCE_TSK: rule i gives output o the constant tskCoefficient[i][o][0]
+     plus tskCoefficient[i][o][1+j] times input j, TSK_FRACTION_BITS fraction */
+  int tskCoefficient[NUMBER_OF_RULE][NUMBER_OF_OUTPUT][NUMBER_OF_INPUT + 1];
+}model_type;
+
+#define RULE_ENGINE_LIST            0                  // walk every rule
+#define RULE_ENGINE_SPARSE          1                  // rules reached from active mfs only
+#define RULE_ENGINE_GRID            2                  // outer-product min over the rule grid
+#define NUMBER_OF_RULE_ENGINE       3
+
+#define DEFUZZIFIER_AREA            0                  // per-mf trapezoid areas summed, overlaps count twice
+#define DEFUZZIFIER_CENTROID        1                  // exact centroid of the max-aggregated clipped set
+#define DEFUZZIFIER_BISECTOR        2                  // splits the aggregated set in two equal areas
+#define DEFUZZIFIER_MEAN_OF_MAXIMA  3                  // middle of the highest part of the aggregated set
+#define DEFUZZIFIER_HEIGHT          4                  // mf centres weighted by their degree
+#define NUMBER_OF_DEFUZZIFIER       5
+#define INFERENCE_MAMDANI           0                  // consequents are output mfs, defuzzified
+#define INFERENCE_TSK               1                  // Takagi-Sugeno: strength-weighted average of linear consequents
+#define TSK_MARK                    '='                // rule table: "=c0+c1*Angle-c2*Velocity" is a TSK consequent
+#define TSK_FRACTION_BITS           16
+#define TSK_COEFFICIENT_LIMIT       32767              // largest magnitude a coefficient can have
+/* support ends of every output mf plus crossings of any two of their
+   rising, flat and falling edges */
+#define MAX_BREAKPOINTS             (2*NUMBER_OF_MF + 3*NUMBER_OF_MF*(3*NUMBER_OF_MF - 1)/2)
+
+#define FIXED_Q_MIN                 1                  // fractional bits accepted by compile_fixed_model()
+#define FIXED_Q_MAX                 15
+#define FIXED_Q_DEFAULT             8
+#define FIXED_PRODUCT_BITS          22                 // slope fraction bits + q, keeps delta*slope in 31 bits
+#define FIXED_NARROW_LIMIT          2147483647.0       // largest defuzzification term kept in an int
+#define FIXED_WIDE_LIMIT            4.0e18             // and in a long long, past it the model is refused
+
+/* membership function for the fixed-point engine, degrees are Q format:
+   1.0 == 1 << q. Slopes carry (FIXED_PRODUCT_BITS - q) extra fraction bits */
+typedef struct fixed_mf_type{
+  int point1;
+  int point2;
+  int slope1;
+  int slope2;
+  int width1;                          /* point[1] - point[0] */
+  int width2;                          /* point[3] - point[2] */
+}fixed_mf_type;
+
+/* integer-only engine: no float anywhere between input and output */
+typedef struct fixed_model_type{
+  int q;                               /* fractional bits of a degree */
+  int shift;                           /* fraction bits of the slopes */
+  int wide;                            /* areas or sums need 64-bit arithmetic */
+  fixed_mf_type mf[TOTAL_NUMBER_OF_MF];
+  rule_type ruleBase[NUMBER_OF_RULE];
+}fixed_model_type;
+
+#if NUMBER_OF_MF <= 16 && UPPER_LIMIT <= 255 && NUMBER_OF_RULE <= 65535
+#define FUZZY_PACKED                                   // packed_model_type: byte points, 4-bit rule indices
+#endif
+#define PACKED_RULE_BYTES           ((NUMBER_OF_INPUT_OUTPUT + 1)/2)  // two mf indices per byte
+#if NUMBER_OF_RULE > SPARSE_RULE_THRESHOLD && NUMBER_OF_INPUT >= 2
+#define PACKED_INDEX_CELLS          (NUMBER_OF_MF*NUMBER_OF_MF)  // rules grouped by the mfs of inputs 0 and 1
+#elif NUMBER_OF_RULE > SPARSE_RULE_THRESHOLD
+#define PACKED_INDEX_CELLS          NUMBER_OF_MF
+#endif
+
+/* Trapezoid in four bytes, as in mf_type. Slopes are UPPER_LIMIT over an
+   edge of at least 1 so they fit too */
+typedef struct packed_mf_type{
+  unsigned char point1;
+  unsigned char point2;
+  unsigned char slope1;
+  unsigned char slope2;
+}packed_mf_type;
+
+/* Smallest layout of a Mamdani model with DEFUZZIFIER_AREA outputs, for
+   microcontrollers: no pointers or padding, so a const one can sit in ROM.
+   Nibble n of rule[i] (low nibble first) is the mf, 0 to NUMBER_OF_MF-1, of
+   input/output n in rule i. Rule bases over SPARSE_RULE_THRESHOLD are kept
+   sorted by the mfs of their first two inputs, the rules of cell
+   mf0*NUMBER_OF_MF + mf1 are rule[ruleStart[cell]] .. rule[ruleStart[cell+1]-1].
+   Names are only kept with -DFUZZY_PACKED_NAMES */
+typedef struct packed_model_type{
+  packed_mf_type mf[TOTAL_NUMBER_OF_MF];
+  unsigned char rule[NUMBER_OF_RULE][PACKED_RULE_BYTES];
+#ifdef PACKED_INDEX_CELLS
+  unsigned short ruleStart[PACKED_INDEX_CELLS + 1];
+#endif
+#ifdef FUZZY_PACKED_NAMES
+  const char *ioName[NUMBER_OF_INPUT_OUTPUT];
+  const char *mfName[NUMBER_OF_MF];    /* the same for every input/output */
+#endif
+}packed_model_type;
+
+/* per-call state of the packed engine, degrees in a byte each */
+typedef struct packed_context_type{
+  int value[NUMBER_OF_INPUT_OUTPUT];
+  unsigned char mf_value[TOTAL_NUMBER_OF_MF];
+  unsigned char status;
+}packed_context_type;
+
+#define KERNEL_SCALAR               0
+#define KERNEL_SSE2                 1
+#define KERNEL_AVX2                 2
+#define NUMBER_OF_KERNEL            3
+
+/* fuzzification and rule evaluation for samples [from, n) of one block,
+   degrees are written to mf_value[mf][sample] */
+typedef void (*kernel_type)(const model_type *model, const int *const input[NUMBER_OF_INPUT],
+                            int from, int n, short mf_value[][BATCH_BLOCK]);
+
+#define STATUS_NO_MATCH             1                  // no rule fired in rule_evaluation()
+#define STATUS_ZERO_AREA            2                  // sum of areas was 0 in defuzzification()
+
+/* per-call evaluation state, everything the inference stages write */
+typedef struct context_type{
+  int value[NUMBER_OF_INPUT_OUTPUT];   /* system input/output values */
+  int mf_value[TOTAL_NUMBER_OF_MF];    /* degree of membership of each mf */
+  int status;
+  long long sum_of_products[NUMBER_OF_OUTPUT];
+  int sum_of_strengths[NUMBER_OF_OUTPUT];      /* INFERENCE_TSK only */
+}context_type;
+
+/* One controller of many sharing a model: its inputs/outputs and degrees,
+   nothing else. Degrees fit a byte (UPPER_LIMIT 255) and the struct is
+   padded to whole cache lines, one line for the 2-input controller, so
+   stepping an array of instances never shares a line between two of them */
+typedef struct instance_type{
+  _Alignas(64) int value[NUMBER_OF_INPUT_OUTPUT];  /* set inputs, read outputs */
+  unsigned char mf_value[TOTAL_NUMBER_OF_MF];
+  unsigned char status;                            /* STATUS_ bits of the last step */
+}instance_type;
+
+/* what evaluate_incremental() saved, summed over its calls */
+typedef struct incremental_stats_type{
+  long long calls;
+  long long memo_hits;                 /* exact repeat of a remembered input vector */
+  long long unchanged;                 /* inputs moved but no degree did, nothing past fuzzification */
+  long long rebuilds;                  /* full evaluations */
+  long long degrees_changed;           /* input mf degrees that changed */
+  long long rules_evaluated;           /* rule strengths recomputed */
+}incremental_stats_type;
+
+/* One controller evaluated by evaluate_incremental(): the last evaluation
+   and everything derived from it, so the next call only redoes what its
+   changed inputs reach. Tied to one model, incremental_reset() it before
+   using another */
+typedef struct incremental_type{
+  context_type context;                /* inputs, degrees and outputs of the last evaluation */
+  int strength[NUMBER_OF_RULE];
+  int live[NUMBER_OF_RULE];            /* rules with strength > 0, fired of them */
+  int area[NUMBER_OF_OUTPUT*NUMBER_OF_MF];   /* of each output mf at its degree */
+  long long sum_of_products[NUMBER_OF_OUTPUT];
+  long long sum_of_areas[NUMBER_OF_OUTPUT];
+  int fired;
+  int valid;                           /* 0: the next call rebuilds everything */
+  unsigned int stamp;                  /* this call's mark in visited[] */
+  unsigned int visited[NUMBER_OF_RULE];
+  int memo_input[MEMO_SIZE][NUMBER_OF_INPUT];
+  int memo_output[MEMO_SIZE][NUMBER_OF_OUTPUT];
+  int memo_status[MEMO_SIZE];
+  int memo_used;
+  int memo_next;                       /* oldest entry, replaced next */
+  incremental_stats_type stats;
+}incremental_type;
+
+#define STATS_FUZZIFICATION         0
+#define STATS_RULE_EVALUATION       1
+#define STATS_DEFUZZIFICATION       2
+#define STATS_BATCH                 3                  // evaluate_batch_kernel() calls
+#define NUMBER_OF_STATS_STAGE       4
+
+/* Instrumentation counters of one thread, built in with -DFUZZY_STATS.
+   Every thread evaluating gets a block of its own, no atomics on the hot
+   path, stats_snapshot() sums them. A rule's firing count is the sum of its
+   histogram. Per-rule counts come from the per-sample engines, the batch
+   kernels add samples, time and zero-area samples only */
+typedef struct stats_type{
+  long long calls[NUMBER_OF_STATS_STAGE];
+  long long timed[NUMBER_OF_STATS_STAGE];      /* calls timed, one in STATS_TIMING_PERIOD */
+  long long cycles[NUMBER_OF_STATS_STAGE];     /* time stamp counter ticks of the timed calls */
+  long long batch_samples;
+  long long no_match;                  /* samples where no rule fired */
+  long long zero_area;                 /* samples with an output of zero area */
+  unsigned int histogram[NUMBER_OF_RULE][STATS_BINS];  /* firings by strength*STATS_BINS/(UPPER_LIMIT+1) */
+}stats_type;
+
+#ifdef FUZZY_STATS
+#define STATS_START(stage)          long long statsStart = stats_start(stage)
+#define STATS_STOP(stage,status)    stats_stop(stage,statsStart,status)
+#define STATS_RULE(rule,strength)   (stats_local()->histogram[rule][(strength)*STATS_BINS/(UPPER_LIMIT + 1)]++)
+#else
+#define STATS_START(stage)
+#define STATS_STOP(stage,status)    ((void)0)
+#define STATS_RULE(rule,strength)   ((void)0)
+#endif
+
+/* Multilinear approximation of evaluate() over 0-UPPER_LIMIT on every
+   input: exact outputs at a grid of knots, interpolated in between.
+   cell/weight turn an input value into its knot interval and the weight
+   of the interval's upper knot, so a lookup costs NUMBER_OF_INPUT row
+   reads and 2^NUMBER_OF_INPUT corners however many knots there are.
+   Knots and cells are bytes, UPPER_LIMIT is 255 */
+typedef struct approx_type{
+  int numberOfKnot[NUMBER_OF_INPUT];
+  unsigned char knot[NUMBER_OF_INPUT][SURFACE_SIZE];       /* ascending, 0 and UPPER_LIMIT always */
+  unsigned char cell[NUMBER_OF_INPUT][SURFACE_SIZE];
+  unsigned short weight[NUMBER_OF_INPUT][SURFACE_SIZE];    /* APPROX_WEIGHT_BITS fraction */
+  int stride[NUMBER_OF_INPUT];         /* in grid points, input 0 varies slowest */
+  int size;                            /* grid points */
+  int *value;                          /* NUMBER_OF_OUTPUT outputs of evaluate() per grid point */
+  int max_error;                       /* largest |output - evaluate()| over the checked inputs */
+  long long checked;
+  int exhaustive;                      /* checked is every input of the domain */
+}approx_type;
+
+/* inputs an approx_type is measured on with their exact outputs: the
+   whole domain in order (input 0 slowest) or random samples */
+typedef struct approx_check_type{
+  long long count;
+  int exhaustive;
+  int (*input)[NUMBER_OF_INPUT];       /* NULL when exhaustive */
+  int *exact;                          /* NUMBER_OF_OUTPUT per input */
+}approx_check_type;
+
+#ifdef FUZZY_THREADS
+/* one unit of a job run by pool_run() */
+typedef void (*task_type)(void *job, int unit);
+
+/* Units of the current job still owned by a worker, packed as
+   first << 32 | end so a take and a steal are both one compare-and-swap:
+   the owner takes from the front, a thief takes the upper half */
+typedef struct worker_type{
+  _Alignas(64) _Atomic unsigned long long range;
+  pthread_t thread;
+  struct pool_type *pool;
+  int id;
+}worker_type;
+
+/* Worker pool, started once and reused by every job. The thread calling
+   pool_run() is worker 0, the others sleep on wake between jobs */
+typedef struct pool_type{
+  int threads;
+  worker_type worker[MAX_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  int generation;                      /* bumped for every job */
+  int busy;                            /* workers still running the job */
+  int stop;
+  task_type task;
+  void *job;
+}pool_type;
+
+/* evaluate_batch_parallel() job, units are PARALLEL_CHUNK samples */
+typedef struct batch_job_type{
+  const model_type *model;
+  const int *const *input;
+  int *output;
+  int count;
+}batch_job_type;
 
+/* step_instances_parallel() job, units are PARALLEL_CHUNK instances */
+typedef struct instance_job_type{
+  const model_type *model;
+  instance_type *instance;
+  int count;
+}instance_job_type;
 
-io_type inputOutput[NUMBER_OF_INPUT_OUTPUT];
-mf_type mf[TOTAL_NUMBER_OF_MF];
-rule_type ruleBase[NUMBER_OF_RULE];
-rule_element_type ifSide[TOTAL_NUMBER_OF_IF_SIDE];
-rule_element_type thenSide[TOTAL_NUMBER_OF_THEN_SIDE];
+/* A compiled model that never changes once published, with the degree
+   rows of its ENGINE_TABLE so nothing it uses is shared with another version */
+typedef struct model_version_type{
+  model_type model;
+  degree_table_type table;
+  long long version;                   /* 1 for the first, +1 per live_publish() */
+  long long retired_epoch;             /* epoch that replaced it */
+  struct model_version_type *next_retired;
+}model_version_type;
+
+/* epoch a reader entered in, 0 while it holds no version. One line each,
+   readers never write a line another reader uses */
+typedef struct live_reader_type{
+  _Alignas(64) atomic_llong epoch;
+  atomic_int in_use;
+}live_reader_type;
+
+/* Model swapped while threads evaluate. Readers announce the epoch, then
+   load current, and evaluate on that version without locks. A publisher
+   swaps current, then moves to the next epoch; the old version is freed
+   once no reader is in an epoch before that, i.e. every reader that could
+   have loaded it has left. Publishers take the mutex, readers never do */
+typedef struct live_model_type{
+  model_version_type *_Atomic current;
+  atomic_llong epoch;
+  live_reader_type reader[LIVE_READERS];
+  pthread_mutex_t publish;
+  model_version_type *retired;         /* replaced, not yet freed, under publish */
+  int numberOfRetired;
+}live_model_type;
+
+/* reader thread of benchmark_reload() */
+typedef struct reload_job_type{
+  live_model_type *live;
+  const int (*sample)[NUMBER_OF_INPUT];
+  const int *expected[2];              /* outputs of the even and odd versions */
+  atomic_int *stop;
+  long long evaluations;
+  long long mismatches;
+}reload_job_type;
+
+#define NUMBER_OF_PIPELINE_STAGE    3                  // STATS_FUZZIFICATION to STATS_DEFUZZIFICATION, one thread each
+
+/* counts of nanosecond latencies, bucket b >= 8 covers ((b & 7) | 8) << (b/8 - 1) and up */
+typedef struct latency_type{
+  long long count;
+  long long bucket[LATENCY_BUCKETS];
+}latency_type;
+
+/* PIPELINE_BATCH samples going through the stages in place: each stage
+   runs its step on context[], so what the rings hand on are the inputs,
+   then the membership vectors, then the firing strengths, then the outputs */
+typedef struct pipeline_batch_type{
+  int count;                           /* 0 marks the end of the stream */
+  long long submitted;                 /* ns, at pipeline_submit() */
+  long long queued;                    /* ns, pushed to the ring it is in */
+  int input[NUMBER_OF_INPUT][PIPELINE_BATCH];
+  context_type context[PIPELINE_BATCH];
+}pipeline_batch_type;
+
+/* Bounded single-producer single-consumer queue of batches, lock-free:
+   only the producer writes tail, only the consumer head, each on its own line */
+typedef struct ring_type{
+  _Alignas(64) atomic_uint head;
+  _Alignas(64) atomic_uint tail;
+  _Alignas(64) pipeline_batch_type *slot[PIPELINE_DEPTH];
+}ring_type;
+
+/* one stage thread, everything below pipeline is written by it alone */
+typedef struct stage_type{
+  pthread_t thread;
+  struct pipeline_type *pipeline;
+  int id;                              /* STATS_ stage */
+  latency_type service;                /* time a batch spends in the stage */
+  latency_type wait;                   /* time a batch waits in the ring before it */
+  long long stalls;                    /* pushes that found the next ring full */
+  long long stalled;                   /* ns spent waiting for room */
+  long long batches;
+}stage_type;
+
+/* Fuzzification, rule evaluation and defuzzification on a thread each.
+   ring[s] feeds stage s, ring[NUMBER_OF_PIPELINE_STAGE] goes back to the
+   caller. A full ring blocks its producer, so a slow stage holds back
+   the ones before it down to pipeline_submit() */
+typedef struct pipeline_type{
+  const model_type *model;
+  ring_type ring[NUMBER_OF_PIPELINE_STAGE + 1];
+  stage_type stage[NUMBER_OF_PIPELINE_STAGE];
+  latency_type total;                  /* pipeline_submit() to pipeline_collect() */
+  long long stalls;                    /* submits that found ring[0] full */
+  long long stalled;
+  pipeline_batch_type *batch;          /* PIPELINE_BATCHES of them */
+  pipeline_batch_type *free_batch[PIPELINE_BATCHES];
+  int numberOfFree;
+  int started;                         /* stage threads running */
+  atomic_int stop;                     /* stages return once their ring is empty, set when not all started */
+}pipeline_type;
+#endif
+
+#ifndef FUZZY_MODEL_FILE
+/* name of each system input/output, inputs first */
+char *ioName[NUMBER_OF_INPUT_OUTPUT] = {"Angle", "Velocity", "Force"};
 /* rules for fuzzy system declared here
    outer array matches with numberOfRule, innter array matches with numberOfInputOutput */
 char *rule[NUMBER_OF_RULE][NUMBER_OF_INPUT_OUTPUT] = {{"NL", "ZE", "PL"},
@@ -91,216 +579,4810 @@ int point[NUMBER_OF_MF][4] = { {0,    31,   31,   63},
                                {127,  159,  159,  191},
                                {159,  191,  191,  223},
                                {191,  223,  223,  255}};
-float max(float a, float b);
-float min(float a, float b);
+#endif                                                 // END MODEL
+/* Whole Angle x Velocity -> Force control surface, one byte per input pair.
+   Filled at startup by build_surface(), or compiled in as a const ROM table
+   generated offline with "FuzzyLogic surface-emit > surface.h" and
+   -DFUZZY_SURFACE_FILE=\"surface.h\" */
+#if defined(FUZZY_SURFACE_FILE)
+#include FUZZY_SURFACE_FILE
+#elif defined(FUZZY_SURFACE)
+unsigned char surfaceTable[SURFACE_SIZE][SURFACE_SIZE];
+#endif
+/* Rule base compiled to straight-line C by "FuzzyLogic specialize-emit >
+   specialized.h": every slope, point and rule index is a constant in the
+   code, nothing to initialize and no model in RAM. Built in with
+   -DFUZZY_SPECIALIZED_FILE=\"specialized.h\", the generated function and
+   the generic stages are then placed in their own sections so
+   "bench-specialized" can report their code size */
+#if defined(FUZZY_SPECIALIZED_FILE) && defined(__GNUC__) && defined(__ELF__)
+#define SPECIALIZED_CODE __attribute__((section("fuzzy_specialized")))
+#define GENERIC_CODE __attribute__((section("fuzzy_generic")))
+#define FUZZY_CODE_SECTIONS
+extern const char __start_fuzzy_specialized[], __stop_fuzzy_specialized[];
+extern const char __start_fuzzy_generic[], __stop_fuzzy_generic[];
+#else
+#define SPECIALIZED_CODE
+#define GENERIC_CODE
+#endif
+#if defined(FUZZY_SPECIALIZED_FILE) && defined(FUZZY_SURFACE)
+#include FUZZY_SPECIALIZED_FILE
+#endif
+char *kernelName[NUMBER_OF_KERNEL] = {"scalar", "sse2", "avx2"};
+char *engineName[NUMBER_OF_ENGINE] = {"arithmetic", "table"};
+char *ruleEngineName[NUMBER_OF_RULE_ENGINE] = {"list", "sparse", "grid"};
+char *defuzzifierName[NUMBER_OF_DEFUZZIFIER] = {"area", "centroid", "bisector", "mean-of-maxima", "height"};
+int max(int a, int b);
+int min(int a, int b);
 /* all needed functions are declared here */
-void initialize_system();
-void fuzzification();
-void rule_evaluation();
-void defuzzification();
-void compute_degree_of_membership(mf_type *mf,int input);
-int compute_area_of_trapezoid(mf_type *mf);
-void initialize_system();
-void put_system_outputs();
-void get_system_inputs(int input1,int input2);
-void compute_degree_of_membership(mf_type *mf,int input);
-
-
-int main(){
+void initialize_system(model_type *model);
+int set_mf_points(mf_type *mf, const int p[4]);
+int compile_rules(model_type *model, char *table[][NUMBER_OF_INPUT_OUTPUT], FILE *err);
+void fuzzification(const model_type *model, context_type *context);
+void rule_evaluation(const model_type *model, context_type *context);
+void rule_evaluation_sparse(const model_type *model, context_type *context);
+void rule_evaluation_grid(const model_type *model, context_type *context);
+void tsk_rule_evaluation(const model_type *model, context_type *context);
+int tsk_fire(const model_type *model, context_type *context, int i);
+void tsk_defuzzification(const model_type *model, context_type *context);
+int parse_tsk_consequent(const model_type *model, const char *text, int coefficient[NUMBER_OF_INPUT + 1]);
+void compile_tsk_model(model_type *tsk, const model_type *model);
+void build_rule_index(model_type *model);
+#ifdef FUZZY_RULE_GRID
+void build_rule_grid(model_type *model);
+#endif
+void defuzzification(const model_type *model, context_type *context);
+int compute_degree_of_membership(const mf_type *mf, int input);
+int compute_area_of_trapezoid(const mf_type *mf, int value);
+int find_mf(const model_type *model, int io, const char *mfName);
+void build_degree_table(const model_type *model, degree_table_type *table);
+void select_engine(model_type *model, int engine, const degree_table_type *table);
+void select_defuzzifier(model_type *model, int output, int method);
+int defuzzify_output(const model_type *model, int method, int output, const int degree[NUMBER_OF_MF]);
+double aggregated_degree(const mf_type *mf, const int degree[NUMBER_OF_MF], double x);
+int aggregate_breakpoints(const model_type *model, int output, const int degree[NUMBER_OF_MF],
+                          double x[MAX_BREAKPOINTS], double y[MAX_BREAKPOINTS]);
+double exact_centroid(const model_type *model, int output, const int degree[NUMBER_OF_MF]);
+double bisector(const model_type *model, int output, const int degree[NUMBER_OF_MF]);
+double mean_of_maxima(const model_type *model, int output, const int degree[NUMBER_OF_MF]);
+int height_defuzzification(const model_type *model, int output, const int degree[NUMBER_OF_MF]);
+double square_root(double value);
+int round_to_int(double value);
+void put_system_outputs(const model_type *model, const context_type *context);
+void get_system_inputs(context_type *context, const int input[NUMBER_OF_INPUT]);
+void evaluate_batch(const model_type *model, const int *const input[NUMBER_OF_INPUT],
+                    int *output, int count);
+void evaluate_batch_kernel(const model_type *model, int kernel, const int *const input[NUMBER_OF_INPUT],
+                           int *output, int count);
+kernel_type kernel_function(int kernel);
+void defuzzification_block(const model_type *model, short mf_value[][BATCH_BLOCK], int n, int *output);
+void step_instances(const model_type *model, instance_type *instance, int count);
+int select_kernel();
+int kernel_supported(int kernel);
+void kernel_scalar(const model_type *model, const int *const input[NUMBER_OF_INPUT],
+                   int from, int n, short mf_value[][BATCH_BLOCK]);
+#ifdef FUZZY_X86_SIMD
+void kernel_sse2(const model_type *model, const int *const input[NUMBER_OF_INPUT],
+                 int from, int n, short mf_value[][BATCH_BLOCK]);
+void kernel_avx2(const model_type *model, const int *const input[NUMBER_OF_INPUT],
+                 int from, int n, short mf_value[][BATCH_BLOCK]);
+#endif
+void evaluate(const model_type *model, const int input[NUMBER_OF_INPUT], int output[NUMBER_OF_OUTPUT]);
+void incremental_reset(incremental_type *state);
+int evaluate_incremental(const model_type *model, incremental_type *state, const int input[NUMBER_OF_INPUT],
+                         int output[NUMBER_OF_OUTPUT]);
+void incremental_rebuild(const model_type *model, incremental_type *state, const int input[NUMBER_OF_INPUT]);
+#ifdef FUZZY_STATS
+stats_type *stats_local();
+stats_type *stats_claim();
+void stats_release(void *slot);
+void stats_key_create();
+long long stats_clock();
+long long stats_start(int stage);
+void stats_stop(int stage, long long start, int status);
+void stats_rule_walk(const model_type *model, const int *mf_value, int weight);
+void stats_rule_block(const model_type *model, short mf_value[][BATCH_BLOCK], int n);
+void stats_snapshot(stats_type *snapshot);
+void stats_reset();
+void put_stats(FILE *fp, const model_type *model, const stats_type *stats);
+#endif
+int build_approx(const model_type *model, approx_type *approx, int budget);
+int build_approx_checked(const model_type *model, const approx_check_type *check, approx_type *approx, int budget);
+void free_approx(approx_type *approx);
+void approx_evaluate(const model_type *model, const approx_type *approx, const int input[NUMBER_OF_INPUT],
+                     int output[NUMBER_OF_OUTPUT]);
+void approx_lookup(const approx_type *approx, const int input[NUMBER_OF_INPUT], int output[NUMBER_OF_OUTPUT]);
+int approx_fill(const model_type *model, approx_type *approx);
+int approx_scan(const approx_type *approx, const approx_check_type *check, int axis, int from, int to,
+                int worst[NUMBER_OF_INPUT][SURFACE_SIZE], unsigned char where[NUMBER_OF_INPUT][SURFACE_SIZE]);
+int approx_check_start(const model_type *model, approx_check_type *check, unsigned int seed);
+void approx_check_free(approx_check_type *check);
+#ifdef FUZZY_SURFACE
+int evaluate_pair(const model_type *model, int input1, int input2);
+void build_surface(const model_type *model, unsigned char table[SURFACE_SIZE][SURFACE_SIZE]);
+int verify_surface(const model_type *model, const unsigned char table[SURFACE_SIZE][SURFACE_SIZE]);
+/* inference by a single load, inputs must be in 0-UPPER_LIMIT */
+#define surface_lookup(table, input1, input2) ((table)[(input1)][(input2)])
+#endif
+int compile_fixed_model(fixed_model_type *fixed, const model_type *model, int q);
+#ifdef FUZZY_THREADS
+int pool_start(pool_type *pool, int threads);
+void pool_stop(pool_type *pool);
+void pool_run(pool_type *pool, task_type task, void *job, int units);
+void *worker_main(void *argument);
+void worker_drain(pool_type *pool, int id);
+int worker_steal(pool_type *pool, int id);
+void batch_task(void *job, int unit);
+void instance_task(void *job, int unit);
+void step_instances_parallel(pool_type *pool, const model_type *model, instance_type *instance, int count);
+void evaluate_batch_parallel(pool_type *pool, const model_type *model, const int *const input[NUMBER_OF_INPUT],
+                             int *output, int count);
+model_version_type *new_model_version(const model_type *model);
+void finish_model_version(model_version_type *version);
+model_version_type *load_model_version(const model_type *base, const char *filename);
+int live_start(live_model_type *live, const model_type *model);
+void live_stop(live_model_type *live);
+int live_register(live_model_type *live);
+void live_unregister(live_model_type *live, int slot);
+const model_version_type *live_enter(live_model_type *live, int slot);
+void live_exit(live_model_type *live, int slot);
+long long live_publish(live_model_type *live, model_version_type *next);
+int live_reclaim(live_model_type *live);
+int live_reclaim_locked(live_model_type *live);
+long long live_reload(live_model_type *live, const model_type *base, const char *filename, struct stat *seen);
+void latency_add(latency_type *latency, long long ns);
+long long latency_percentile(const latency_type *latency, double fraction);
+int ring_push(ring_type *ring, pipeline_batch_type *batch);
+pipeline_batch_type *ring_pop(ring_type *ring);
+void ring_push_wait(ring_type *ring, pipeline_batch_type *batch, long long *stalls, long long *stalled);
+int pipeline_start(pipeline_type *pipeline, const model_type *model);
+void pipeline_stop(pipeline_type *pipeline);
+void *stage_main(void *argument);
+pipeline_batch_type *pipeline_batch(pipeline_type *pipeline);
+void pipeline_submit(pipeline_type *pipeline, pipeline_batch_type *batch);
+pipeline_batch_type *pipeline_collect(pipeline_type *pipeline, int wait);
+void pipeline_release(pipeline_type *pipeline, pipeline_batch_type *batch);
+#endif
+void fixed_fuzzification(const fixed_model_type *fixed, context_type *context);
+void fixed_rule_evaluation(const fixed_model_type *fixed, context_type *context);
+void fixed_defuzzification(const fixed_model_type *fixed, context_type *context);
+#ifdef FUZZY_PACKED
+int compile_packed_model(packed_model_type *packed, const model_type *model);
+void packed_fuzzification(const packed_model_type *packed, packed_context_type *context);
+#ifdef PACKED_INDEX_CELLS
+int packed_cell(const int if_side[NUMBER_OF_IF_SIDE]);
+#endif
+int packed_fire(const packed_model_type *packed, packed_context_type *context, int first, int end);
+void packed_rule_evaluation(const packed_model_type *packed, packed_context_type *context);
+void packed_defuzzification(const packed_model_type *packed, packed_context_type *context);
+void packed_evaluate(const packed_model_type *packed, const int input[NUMBER_OF_INPUT], int output[NUMBER_OF_OUTPUT]);
+#endif
+#ifdef FUZZY_HOSTED
+/* hardware counters around a stretch of code, cycles fall back to the TSC
+   (x86) or nanoseconds, instructions and cache misses to -1 when perf is
+   not available */
+#define NUMBER_OF_COUNTER           3
+typedef struct counter_type{
+  int fd[NUMBER_OF_COUNTER];           /* cycles, instructions, cache misses; -1 if unavailable */
+  long long start;                     /* fallback clock at counter_start() */
+}counter_type;
+void counter_open(counter_type *counter);
+void counter_close(counter_type *counter);
+void counter_start(counter_type *counter);
+void counter_stop(counter_type *counter, long long *cycles, long long *instructions, long long *misses);
+
+#define FORMAT_CSV                  0                  // one sample per line, values split by commas or blanks
+#define FORMAT_RAW                  1                  // 32-bit little-endian values, inputs (outputs) of a sample in order
+#define TRACE_NONE                  0                  // run_stream() writes the outputs only
+#define TRACE_STATUS                1                  // adds the STATUS_ bits after each sample's outputs
+#define TRACE_DUMP                  2                  // and put_system_outputs() of every sample
+
+/* buffered input of run_stream(), bytes [next, end) are not consumed yet */
+typedef struct reader_type{
+  FILE *fp;
+  int next;
+  int end;
+  int eof;
+  int error;                           /* bad input was reported, stop after the samples before it */
+  long long line;                      /* of the next csv line, for errors */
+  unsigned char buffer[STREAM_BUFFER];
+}reader_type;
+
+/* buffered output of run_stream(), goes out with one fwrite() per STREAM_BUFFER */
+typedef struct writer_type{
+  FILE *fp;
+  int used;
+  int format;
+  char buffer[STREAM_BUFFER];
+}writer_type;
+
+#define COST_MSE                    0                  // mean squared output error
+#define COST_MAE                    1                  // mean absolute output error
+#define COST_MAX                    2                  // largest absolute output error
+#define NUMBER_OF_COST              3
+#define SEARCH_GRID                 0                  // every point and consequent one step either way, best move kept
+#define SEARCH_RANDOM               1                  // random mutations of the best so far
+#define SEARCH_EVOLVE               2                  // tournament, uniform crossover and mutation, elitist
+#define NUMBER_OF_SEARCH            3
+
+/* recorded samples with their wanted outputs, resident for every candidate */
+typedef struct dataset_type{
+  int count;
+  int *column[NUMBER_OF_INPUT_OUTPUT]; /* inputs then target outputs, one array each */
+}dataset_type;
+
+/* parameters a tuning run changes: the four points of every mf, as
+   point[][], and the consequent mf of every rule and output */
+typedef struct candidate_type{
+  int point[TOTAL_NUMBER_OF_MF][4];
+  unsigned char consequent[NUMBER_OF_RULE][NUMBER_OF_OUTPUT];
+  double cost;
+}candidate_type;
+
+/* Candidates of one generation are scored together, one pool unit per
+   worker. A unit claims candidates one at a time and sets its own scratch
+   copy of the model to each, re-deriving only the slopes of the mfs that
+   differ from the candidate it scored before */
+typedef struct tuner_type{
+  const model_type *model;             /* antecedents, engines and names */
+  candidate_type base;                 /* parameters model was compiled with */
+  const dataset_type *data;
+  int cost;                            /* COST_ */
+  int numberOfMf;                      /* mfs tuned, TSK outputs have none */
+  int numberOfConsequent;              /* rules*outputs tuned, 0 for TSK */
+  model_type *scratch;                 /* one copy of model per pool unit, kept across generations */
+#ifdef FUZZY_THREADS
+  pool_type *pool;                     /* NULL: score on the calling thread */
+  atomic_int next;                     /* next candidate to claim */
+#else
+  int next;
+#endif
+  candidate_type *candidate;           /* the generation being scored */
+  int count;                           /* candidates in it */
+  long long evaluations;
+}tuner_type;
+int reader_fill(reader_type *reader);
+int read_block(reader_type *reader, int format, int *column[], int columns, int max);
+int read_csv_line(reader_type *reader, const unsigned char *p, const unsigned char *end, int sample[], int columns);
+void writer_flush(writer_type *writer);
+void write_value(writer_type *writer, int value, int last);
+int run_stream(const model_type *model, int argc, char *argv[]);
+int read_model_file(model_type *model, const char *filename);
+long long read_cycles();
+double now_seconds();
+long long now_nanoseconds();
+void random_inputs(unsigned int *seed, int input[NUMBER_OF_INPUT]);
+int benchmark_batch(const model_type *model);
+int benchmark_engines(const model_type *model);
+#ifdef FUZZY_PACKED
+int benchmark_packed(const model_type *model);
+#endif
+int benchmark_rules(const model_type *model);
+int benchmark_instances(const model_type *model);
+int benchmark_defuzzifiers(const model_type *model);
+int benchmark_tsk(const model_type *model);
+int benchmark_incremental(const model_type *model, const char *filename);
+int run_approx(const model_type *model, int argc, char *argv[]);
+int read_dataset(dataset_type *data, const char *filename);
+void free_dataset(dataset_type *data);
+void tune_start(tuner_type *tuner, const model_type *model, const dataset_type *data, int cost);
+int apply_candidate(const tuner_type *tuner, const candidate_type *candidate, model_type *model);
+double candidate_cost(const tuner_type *tuner, const model_type *model);
+void tune_task(void *job, int unit);
+void score_candidates(tuner_type *tuner, candidate_type *candidate, int count);
+int move_point(int p[4], int which, int delta);
+void mutate_candidate(const tuner_type *tuner, candidate_type *candidate, unsigned int *seed, int step);
+int neighbour_candidates(const tuner_type *tuner, const candidate_type *from, candidate_type *out, int step);
+int tune(tuner_type *tuner, int search, int generations, int population, candidate_type *best);
+void put_model_file(FILE *fp, const model_type *model, const candidate_type *candidate);
+int run_tune(const model_type *model, int argc, char *argv[]);
+#ifdef FUZZY_THREADS
+int benchmark_parallel(const model_type *model, int max_threads);
+int benchmark_reload(const model_type *model, int readers);
+void *reload_reader(void *argument);
+long long stream_pipeline(const model_type *model, reader_type *reader, int format, writer_type *writer);
+void put_pipeline(FILE *fp, const pipeline_type *pipeline);
+int benchmark_pipeline(const model_type *model);
+#endif
+#ifdef FUZZY_SURFACE
+double reference_evaluate(const model_type *model, int input1, int input2);
+int benchmark_fixed(const model_type *model);
+int run_surface(const model_type *model);
+void emit_specialized(const model_type *model);
+int benchmark_specialized(const model_type *model);
+void emit_surface(const model_type *model);
+#endif
+#endif
+
+
+int main(int argc, char *argv[]){
+  static model_type model;
+  context_type context;
   int angle[2] = {60, 125};
   int velocity[2] = {125, 230};
+  int input[NUMBER_OF_INPUT];
+  initialize_system(&model);             // compile rule base once, reused by every sample
+#ifdef FUZZY_HOSTED
+  if(argc > 1 && strcmp(argv[1],"run")==0)return run_stream(&model,argc - 2,argv + 2);
+  if(argc > 1 && strcmp(argv[1],"bench")==0)return benchmark_batch(&model);
+  if(argc > 1 && strcmp(argv[1],"bench-engine")==0)return benchmark_engines(&model);
+#ifdef FUZZY_PACKED
+  if(argc > 1 && strcmp(argv[1],"bench-packed")==0)return benchmark_packed(&model);
+#endif
+  if(argc > 1 && strcmp(argv[1],"bench-rules")==0)return benchmark_rules(&model);
+  if(argc > 1 && strcmp(argv[1],"bench-instances")==0)return benchmark_instances(&model);
+  if(argc > 1 && strcmp(argv[1],"bench-defuzz")==0)return benchmark_defuzzifiers(&model);
+  if(argc > 1 && strcmp(argv[1],"bench-tsk")==0)return benchmark_tsk(&model);
+  if(argc > 1 && strcmp(argv[1],"bench-incremental")==0)return benchmark_incremental(&model,argc > 2 ? argv[2] : NULL);
+  if(argc > 1 && strcmp(argv[1],"approx")==0)return run_approx(&model,argc - 2,argv + 2);
+  if(argc > 1 && strcmp(argv[1],"tune")==0)return run_tune(&model,argc - 2,argv + 2);
+#ifdef FUZZY_THREADS
+  if(argc > 1 && strcmp(argv[1],"bench-parallel")==0)return benchmark_parallel(&model,argc > 2 ? atoi(argv[2]) : 0);
+  if(argc > 1 && strcmp(argv[1],"bench-reload")==0)return benchmark_reload(&model,argc > 2 ? atoi(argv[2]) : 2);
+  if(argc > 1 && strcmp(argv[1],"bench-pipeline")==0)return benchmark_pipeline(&model);
+#endif
+#ifdef FUZZY_SURFACE
+  if(model.inference == INFERENCE_TSK && argc > 1 && (strcmp(argv[1],"bench-fixed")==0 ||
+     strcmp(argv[1],"specialize-emit")==0 || strcmp(argv[1],"bench-specialized")==0)){
+    printf("ERROR- %s needs mf consequents, not TSK ones.\n",argv[1]);
+    return 1;
+  }
+  if(argc > 1 && strcmp(argv[1],"surface")==0)return run_surface(&model);
+  if(argc > 1 && strcmp(argv[1],"bench-fixed")==0)return benchmark_fixed(&model);
+  if(argc > 1 && strcmp(argv[1],"surface-emit")==0){
+    emit_surface(&model);
+    return 0;
+  }
+  if(argc > 1 && strcmp(argv[1],"specialize-emit")==0){
+    emit_specialized(&model);
+    return 0;
+  }
+  if(argc > 1 && strcmp(argv[1],"bench-specialized")==0)return benchmark_specialized(&model);
+#endif
+#endif
   for(int i = 0; i < 2; i++){
-    initialize_system();
-    get_system_inputs(angle[i],velocity[i]);// this function is used for reading input for fuzzy logic, should be normalized to 0-255 range
-    fuzzification();
-    rule_evaluation();
-    defuzzification();
-    put_system_outputs();
+    for(int j = 0; j < NUMBER_OF_INPUT; j++)input[j] = j % 2 ? velocity[i] : angle[i];
+    get_system_inputs(&context,input);// this function is used for reading input for fuzzy logic, should be normalized to 0-255 range
+    fuzzification(&model,&context);
+    rule_evaluation(&model,&context);
+    defuzzification(&model,&context);
+    put_system_outputs(&model,&context);
   }
+  return 0;
 }
 
-void fuzzification(){
+GENERIC_CODE
+void fuzzification(const model_type *model, context_type *context){
   int k = 0;
+  STATS_START(STATS_FUZZIFICATION);
   for(int i = 0; i < NUMBER_OF_INPUT; i++)
   {
+    int input = context->value[i];
+    if(model->engine == ENGINE_TABLE && input >= 0 && input <= UPPER_LIMIT)
+    {
+      const unsigned char *row = model->degree_table->degree[i][input];
+      for(int j = 0; j < NUMBER_OF_MF; j++)
+        context->mf_value[k++]=row[j];
+      continue;
+    }
     for(int j = 0; j < NUMBER_OF_MF; j++)
     {
-      compute_degree_of_membership(&mf[k],inputOutput[i].value);
+      context->mf_value[k]=compute_degree_of_membership(&model->mf[k],input);
       k++;
     }
   }
+  STATS_STOP(STATS_FUZZIFICATION,0);
 }
 
-void rule_evaluation(){
-  int a = 0;
-  int b = 0;
+GENERIC_CODE
+void rule_evaluation(const model_type *model, context_type *context){
+  int forOutputMf = FIRST_OUTPUT_MF;
   int strength;
   int nomatch=0;                   /* NEW, test some rules */
+  STATS_START(STATS_RULE_EVALUATION);
+  if(model->inference == INFERENCE_TSK){
+    tsk_rule_evaluation(model,context);
+    STATS_STOP(STATS_RULE_EVALUATION,context->status);
+    return;
+  }
+  if(model->rule_engine == RULE_ENGINE_SPARSE){
+    rule_evaluation_sparse(model,context);
+    STATS_STOP(STATS_RULE_EVALUATION,context->status);
+    return;
+  }
+#ifdef FUZZY_RULE_GRID
+  if(model->rule_engine == RULE_ENGINE_GRID){
+    rule_evaluation_grid(model,context);
+#ifdef FUZZY_STATS
+    stats_rule_walk(model,context->mf_value,1);            /* the grid keeps no per-rule strength */
+#endif
+    STATS_STOP(STATS_RULE_EVALUATION,context->status);
+    return;
+  }
+#endif
+  for(int i = forOutputMf; i < TOTAL_NUMBER_OF_MF; i++)
+    context->mf_value[i]=0;        /* consequents aggregate per call */
   for(int i = 0; i < NUMBER_OF_RULE; i++)
   {
+    const rule_type *rule = &model->ruleBase[i];
     strength=UPPER_LIMIT;
     for(int j = 0; j < NUMBER_OF_IF_SIDE; j++)
     {
-      strength=min(strength,*(ifSide[a].value));
-      a++;
+      strength=min(strength,context->mf_value[rule->if_side[j]]);
     }
     for(int k = 0; k < NUMBER_OF_THEN_SIDE; k++)
     {
-        *(thenSide[b].value)=max(strength,*(thenSide[b].value));      /* NEW */
+        int *then = &context->mf_value[rule->then_side[k]];
+        *then=max(strength,*then);                   /* NEW */
         if(strength>0)nomatch=1;                      /* NEW */
-        b++;
     }
+    if(strength>0)STATS_RULE(i,strength);
   }
-  if(nomatch==0)printf("NO MATCHING RULES FOUND!\n"); /* NEW */
+  context->status = (nomatch==0) ? STATUS_NO_MATCH : 0;
+  STATS_STOP(STATS_RULE_EVALUATION,context->status);
 }
 
-void defuzzification(){
-  int forOutputMf = TOTAL_NUMBER_OF_MF - NUMBER_OF_MF;
+/* every output is defuzzified over its own NUMBER_OF_MF consequents,
+   with the method select_defuzzifier() picked for it */
+GENERIC_CODE
+void defuzzification(const model_type *model, context_type *context){
+  int forOutputMf = FIRST_OUTPUT_MF;
   int sum_of_products;
   int sum_of_areas;
   int area, centroid;
+  STATS_START(STATS_DEFUZZIFICATION);
+  if(model->inference == INFERENCE_TSK){
+    tsk_defuzzification(model,context);
+    STATS_STOP(STATS_DEFUZZIFICATION,context->status);
+    return;
+  }
+  for(int o = 0; o < NUMBER_OF_OUTPUT; o++){
+    if(model->defuzzifier[o] != DEFUZZIFIER_AREA){
+      const int *degree = &context->mf_value[forOutputMf + o*NUMBER_OF_MF];
+      int fired = 0;
+      for(int k = 0; k < NUMBER_OF_MF; k++)fired |= degree[k];
+      context->sum_of_products[o]=0;
+      if(!fired){                                           /* empty set, no area either */
+        context->status|=STATUS_ZERO_AREA;
+        context->value[NUMBER_OF_INPUT + o]=0;
+        continue;
+      }
+      context->value[NUMBER_OF_INPUT + o]=defuzzify_output(model,model->defuzzifier[o],o,degree);
+      continue;
+    }
     sum_of_products=0;
     sum_of_areas=0;
-    for(int i = forOutputMf; i < TOTAL_NUMBER_OF_MF; i++){
-      area=compute_area_of_trapezoid(&mf[i]);
-      centroid=mf[i].point1+(mf[i].point2-mf[i].point1)/2;
+    for(int i = forOutputMf + o*NUMBER_OF_MF; i < forOutputMf + (o+1)*NUMBER_OF_MF; i++){
+      const mf_type *mf = &model->mf[i];
+      area=compute_area_of_trapezoid(mf,context->mf_value[i]);
+      centroid=mf->point1+(mf->point2-mf->point1)/2;
       sum_of_products+=area*centroid;
       sum_of_areas+=area;
     }
-    if(sum_of_areas==0){                                    /* NEW */
-      printf("Sum of Areas = 0, will cause div error\n"); /* NEW */
-      printf("Sum of Products= %d\n",sum_of_products);    /* NEW */
-      inputOutput[2].value=0;                                        /* NEW */
-      return;                                             /* NEW */
-    }                                                      /* NEW */
-    inputOutput[2].value=sum_of_products/sum_of_areas;
+    context->sum_of_products[o]=sum_of_products;
+    if(sum_of_areas==0){                                    /* NEW, reported by put_system_outputs() */
+      context->status|=STATUS_ZERO_AREA;
+      context->value[NUMBER_OF_INPUT + o]=0;
+      continue;
+    }
+    context->value[NUMBER_OF_INPUT + o]=sum_of_products/sum_of_areas;
+  }
+  STATS_STOP(STATS_DEFUZZIFICATION,context->status);
 }
 
-void compute_degree_of_membership(mf_type *mf, int input){
-  int delta_1, delta_2;
+GENERIC_CODE
+int compute_degree_of_membership(const mf_type *mf, int input){
+  int delta_1, delta_2, value;
   delta_1=input - mf->point1;
   delta_2=mf->point2 - input;
-  if((delta_1<=0)||(delta_2<=0))mf->value=0;
-  else{
-    mf->value=min((mf->slope1*delta_1),(mf->slope2*delta_2));
-    mf->value=min(mf->value,UPPER_LIMIT);
-    //printf("testing = %d\n", mf->value);
-  }
+  if((delta_1<=0)||(delta_2<=0))return 0;
+  value=min((mf->slope1*delta_1),(mf->slope2*delta_2));
+  value=min(value,UPPER_LIMIT);
+  return value;
 }
 
-int compute_area_of_trapezoid(mf_type *mf){
+GENERIC_CODE
+int compute_area_of_trapezoid(const mf_type *mf, int value){
   int run_1,run_2,area,top;
   int base;
   base=mf->point2 - mf->point1;
-  run_1=mf->value / mf->slope1;
-  run_2=mf->value / mf->slope2;
+  run_1=value / mf->slope1;
+  run_2=value / mf->slope2;
   top=base - run_1 - run_2;
-  area=mf->value*(base+top)/2;
-  //printf("area = %d\n", area);
+  area=value*(base+top)/2;
   return area;
 }                                        /* END AREA OF TRAPEZOID */
 
-void initialize_system(){                      /* NEW FUNCTION INITIALIZE */
-  int forOutputMf = TOTAL_NUMBER_OF_MF - NUMBER_OF_MF;
-  int a, b, c, d, x;
-  int k = 0;
-  int l = 0;
-  /* name of system input/output */
-  inputOutput[0].name = "Angle";
-  inputOutput[1].name = "Velocity";
-  inputOutput[2].name = "Force";
-  for(int i = 0; i < NUMBER_OF_INPUT_OUTPUT; i++){
-    for(int j = 0; j < NUMBER_OF_MF; j++){
-      mf[k].name = name[j];
-      mf[k].point1=point[j][0];                   /* left x axis value */
-      b = point[j][1];
-      c = point[j][2];
-      mf[k].point2=point[j][3];                   /* right x axis value */
-      mf[k].slope1=UPPER_LIMIT/(b-point[j][0]);     /* left slope */
-      mf[k].slope2=UPPER_LIMIT/(point[j][3]-c);     /* right slope */
-      k++;
+/* one output with a method other than DEFUZZIFIER_AREA, degree holds the
+   output's NUMBER_OF_MF consequent degrees and at least one is nonzero */
+GENERIC_CODE
+int defuzzify_output(const model_type *model, int method, int output, const int degree[NUMBER_OF_MF]){
+  switch(method){
+  case DEFUZZIFIER_CENTROID:
+    return round_to_int(exact_centroid(model,output,degree));
+  case DEFUZZIFIER_BISECTOR:
+    return round_to_int(bisector(model,output,degree));
+  case DEFUZZIFIER_MEAN_OF_MAXIMA:
+    return round_to_int(mean_of_maxima(model,output,degree));
+  default:
+    return height_defuzzification(model,output,degree);
+  }
+}
+
+/* max over the output's mfs, each clipped at its degree */
+GENERIC_CODE
+double aggregated_degree(const mf_type *mf, const int degree[NUMBER_OF_MF], double x){
+  double value = 0;
+  for(int k = 0; k < NUMBER_OF_MF; k++){
+    double rise, fall, clipped;
+    if(degree[k] <= 0 || x <= mf[k].point1 || x >= mf[k].point2)continue;
+    rise = mf[k].slope1*(x - mf[k].point1);
+    fall = mf[k].slope2*(mf[k].point2 - x);
+    clipped = rise < fall ? rise : fall;
+    if(clipped > degree[k])clipped = degree[k];
+    if(clipped > value)value = clipped;
+  }
+  return value;
+}
+
+/* The aggregated set is piecewise linear: it can only bend at a support
+   end or where two edges of the clipped mfs cross (a plateau corner, a
+   triangle peak, one mf overtaking another). Collects all of these in
+   order with the set's degree at each, linear in between. Mfs with degree
+   0 are left out, returns the number of breakpoints */
+GENERIC_CODE
+int aggregate_breakpoints(const model_type *model, int output, const int degree[NUMBER_OF_MF],
+                          double x[MAX_BREAKPOINTS], double y[MAX_BREAKPOINTS]){
+  const mf_type *mf = &model->mf[FIRST_OUTPUT_MF + output*NUMBER_OF_MF];
+  double slope[3*NUMBER_OF_MF], offset[3*NUMBER_OF_MF];  /* edge is slope*x + offset */
+  int owner[3*NUMBER_OF_MF];                               /* mf of the edge */
+  int lines = 0;
+  int n = 0, unique = 0;
+  for(int k = 0; k < NUMBER_OF_MF; k++){
+    if(degree[k] <= 0)continue;
+    x[n++] = mf[k].point1;
+    x[n++] = mf[k].point2;
+    slope[lines] = mf[k].slope1;
+    offset[lines] = -(double)mf[k].slope1*mf[k].point1;
+    owner[lines++] = k;
+    slope[lines] = -mf[k].slope2;
+    offset[lines] = (double)mf[k].slope2*mf[k].point2;
+    owner[lines++] = k;
+    slope[lines] = 0;
+    offset[lines] = degree[k];
+    owner[lines++] = k;
+  }
+  for(int a = 0; a < lines; a++)
+    for(int b = a + 1; b < lines; b++){
+      const mf_type *first = &mf[owner[a]], *second = &mf[owner[b]];
+      double cross;
+      if(slope[a] == slope[b] || first->point2 <= second->point1 || second->point2 <= first->point1)continue;
+      cross = (offset[b] - offset[a])/(slope[a] - slope[b]);
+      /* only where both edges are part of their mf */
+      if(cross > first->point1 && cross > second->point1 && cross < first->point2 && cross < second->point2)
+        x[n++] = cross;
     }
+  for(int i = 1; i < n; i++){                    /* few points, insertion sort */
+    double value = x[i];
+    int j = i;
+    for(; j > 0 && x[j-1] > value; j--)x[j] = x[j-1];
+    x[j] = value;
   }
-  /* READ RULES FILE; INITIALIZE STRUCTURES */
-  for (int i = 0; i < NUMBER_OF_RULE; i++){
-    for(int j = 0; j < NUMBER_OF_MF; j++)
-    {
-      if((strcmp(mf[j].name,rule[i][0]))==0)
-      {
-        ruleBase[i].if_side=ifSide;
-        ifSide[l].value=&mf[j].value;  /* needs address here */
-        l++;
-        break;                           /* match found */
+  for(int i = 0; i < n; i++){
+    if(unique > 0 && x[i] == x[unique-1])continue;
+    x[unique] = x[i];
+    y[unique] = aggregated_degree(mf,degree,x[i]);
+    unique++;
+  }
+  return unique;
+}
+
+/* area and first moment of each linear piece in closed form */
+GENERIC_CODE
+double exact_centroid(const model_type *model, int output, const int degree[NUMBER_OF_MF]){
+  double x[MAX_BREAKPOINTS], y[MAX_BREAKPOINTS];
+  double area = 0, moment = 0;
+  int n = aggregate_breakpoints(model,output,degree,x,y);
+  for(int i = 1; i < n; i++){
+    double width = x[i] - x[i-1];
+    area += width*(y[i-1] + y[i])/2;
+    moment += width*(x[i-1]*(2*y[i-1] + y[i]) + x[i]*(y[i-1] + 2*y[i]))/6;
+  }
+  return area > 0 ? moment/area : 0;
+}
+
+/* walks the pieces up to half the area, then solves the piece's quadratic
+   y0*t + (y1-y0)/(2*width)*t*t == need for t */
+GENERIC_CODE
+double bisector(const model_type *model, int output, const int degree[NUMBER_OF_MF]){
+  double x[MAX_BREAKPOINTS], y[MAX_BREAKPOINTS];
+  double area = 0, need;
+  int n = aggregate_breakpoints(model,output,degree,x,y);
+  for(int i = 1; i < n; i++)area += (x[i] - x[i-1])*(y[i-1] + y[i])/2;
+  need = area/2;
+  for(int i = 1; i < n; i++){
+    double width = x[i] - x[i-1];
+    double piece = width*(y[i-1] + y[i])/2;
+    if(piece > 0 && need <= piece){
+      double a = (y[i] - y[i-1])/(2*width);
+      double root = y[i-1]*y[i-1] + 4*a*need;
+      return x[i-1] + 2*need/(y[i-1] + square_root(root > 0 ? root : 0));
+    }
+    need -= piece;
+  }
+  return n > 0 ? x[n-1] : 0;
+}
+
+/* Every mf tops out at its degree or, for a triangle that never reaches
+   it, at its peak. Averages x over the union of the tops at the highest
+   level, or over the peak points when all of them are single points */
+GENERIC_CODE
+double mean_of_maxima(const model_type *model, int output, const int degree[NUMBER_OF_MF]){
+  const mf_type *mf = &model->mf[FIRST_OUTPUT_MF + output*NUMBER_OF_MF];
+  double top[NUMBER_OF_MF], left[NUMBER_OF_MF], right[NUMBER_OF_MF];
+  double height = 0, length = 0, moment = 0, points = 0;
+  double end = 0;
+  int n = 0;
+  for(int k = 0; k < NUMBER_OF_MF; k++){
+    double peak = (double)mf[k].slope1*mf[k].slope2*(mf[k].point2 - mf[k].point1)/(mf[k].slope1 + mf[k].slope2);
+    top[k] = degree[k] <= 0 ? 0 : degree[k] < peak ? degree[k] : peak;
+    if(top[k] > height)height = top[k];
+  }
+  for(int k = 0; k < NUMBER_OF_MF; k++){
+    double from, to;
+    int j = n;
+    if(height <= 0 || top[k] != height)continue;
+    from = mf[k].point1 + height/mf[k].slope1;
+    to = mf[k].point2 - height/mf[k].slope2;
+    if(to < from)from = to = (from + to)/2;      /* peak, rounding only */
+    for(; j > 0 && left[j-1] > from; j--){
+      left[j] = left[j-1];
+      right[j] = right[j-1];
+    }
+    left[j] = from;
+    right[j] = to;
+    n++;
+  }
+  for(int i = 0; i < n; i++){
+    double from = left[i] > end || i == 0 ? left[i] : end;  /* overlap counted once */
+    points += (left[i] + right[i])/2;
+    if(right[i] > from){
+      length += right[i] - from;
+      moment += (right[i] - from)*(right[i] + from)/2;
+    }
+    if(i == 0 || right[i] > end)end = right[i];
+  }
+  if(length > 0)return moment/length;
+  return n > 0 ? points/n : 0;
+}
+
+/* centres as in DEFUZZIFIER_AREA weighted by degree, integers only */
+GENERIC_CODE
+int height_defuzzification(const model_type *model, int output, const int degree[NUMBER_OF_MF]){
+  const mf_type *mf = &model->mf[FIRST_OUTPUT_MF + output*NUMBER_OF_MF];
+  int sum_of_products = 0;
+  int sum_of_degrees = 0;
+  for(int k = 0; k < NUMBER_OF_MF; k++){
+    sum_of_products += degree[k]*(mf[k].point1 + (mf[k].point2 - mf[k].point1)/2);
+    sum_of_degrees += degree[k];
+  }
+  return sum_of_degrees ? sum_of_products/sum_of_degrees : 0;
+}
+
+/* Newton from above, stops once it no longer decreases; keeps libm out */
+GENERIC_CODE
+double square_root(double value){
+  double root = value > 1 ? value : 1;
+  if(value <= 0)return 0;
+  for(int i = 0; i < 64; i++){
+    double next = (root + value/root)/2;
+    if(next >= root)break;
+    root = next;
+  }
+  return root;
+}
+
+GENERIC_CODE
+int round_to_int(double value){
+  return value >= 0 ? (int)(value + 0.5) : -(int)(0.5 - value);
+}
+
+/* Same result as the dense walk, but a rule is only visited when all its
+   antecedents are nonzero: a zero antecedent gives strength 0, which max()
+   can never raise a consequent with. The rules are reached through the
+   inverted index of whichever input has the fewest active mfs, so the
+   work follows the active set instead of NUMBER_OF_RULE. */
+void rule_evaluation_sparse(const model_type *model, context_type *context){
+  int forOutputMf = FIRST_OUTPUT_MF;
+  int active[NUMBER_OF_INPUT][NUMBER_OF_MF];
+  int numberOfActive[NUMBER_OF_INPUT];
+  int driver = 0;
+  int nomatch = 0;
+  for(int i = forOutputMf; i < TOTAL_NUMBER_OF_MF; i++)
+    context->mf_value[i]=0;
+  for(int i = 0; i < NUMBER_OF_INPUT; i++){
+    numberOfActive[i] = 0;
+    for(int j = i*NUMBER_OF_MF; j < (i+1)*NUMBER_OF_MF; j++)
+      if(context->mf_value[j] > 0)active[i][numberOfActive[i]++] = j;
+    if(numberOfActive[i] < numberOfActive[driver])driver = i;
+  }
+  for(int a = 0; a < numberOfActive[driver]; a++){
+    int m = active[driver][a];
+    for(int r = model->ruleIndexStart[m]; r < model->ruleIndexStart[m+1]; r++){
+      const rule_type *rule = &model->ruleBase[model->ruleIndex[r]];
+      int strength = UPPER_LIMIT;
+      for(int j = 0; j < NUMBER_OF_IF_SIDE; j++){
+        int value = context->mf_value[rule->if_side[j]];
+        strength = value < strength ? value : strength;
       }
+      if(strength == 0)continue;
+      for(int k = 0; k < NUMBER_OF_THEN_SIDE; k++){
+        int *then = &context->mf_value[rule->then_side[k]];
+        *then = strength > *then ? strength : *then;
+      }
+      STATS_RULE(model->ruleIndex[r],strength);
+      nomatch = 1;
+    }
+  }
+  context->status = (nomatch==0) ? STATUS_NO_MATCH : 0;
+}
+
+/* Takagi-Sugeno rules: the antecedents fire as in rule_evaluation(), then
+   every rule adds strength*z to each output, z linear in the inputs. No
+   output mf is aggregated, their degrees stay 0. Past the list engine the
+   rules are reached from the active mfs as in rule_evaluation_sparse() */
+GENERIC_CODE
+void tsk_rule_evaluation(const model_type *model, context_type *context){
+  int forOutputMf = FIRST_OUTPUT_MF;
+  int nomatch = 0;
+  for(int i = forOutputMf; i < TOTAL_NUMBER_OF_MF; i++)
+    context->mf_value[i]=0;
+  for(int o = 0; o < NUMBER_OF_OUTPUT; o++){
+    context->sum_of_products[o]=0;
+    context->sum_of_strengths[o]=0;
+  }
+  if(model->rule_engine == RULE_ENGINE_LIST){
+    for(int i = 0; i < NUMBER_OF_RULE; i++)nomatch |= tsk_fire(model,context,i);
+  }
+  else{
+    int numberOfActive[NUMBER_OF_INPUT];
+    int driver = 0;
+    for(int i = 0; i < NUMBER_OF_INPUT; i++){
+      numberOfActive[i] = 0;
+      for(int j = i*NUMBER_OF_MF; j < (i+1)*NUMBER_OF_MF; j++)
+        if(context->mf_value[j] > 0)numberOfActive[i]++;
+      if(numberOfActive[i] < numberOfActive[driver])driver = i;
+    }
+    for(int m = driver*NUMBER_OF_MF; m < (driver+1)*NUMBER_OF_MF; m++){
+      if(context->mf_value[m] == 0)continue;
+      for(int r = model->ruleIndexStart[m]; r < model->ruleIndexStart[m+1]; r++)
+        nomatch |= tsk_fire(model,context,model->ruleIndex[r]);
+    }
+  }
+  context->status = (nomatch==0) ? STATUS_NO_MATCH : 0;
+}
+
+/* one TSK rule, returns 1 when it fired */
+GENERIC_CODE
+int tsk_fire(const model_type *model, context_type *context, int i){
+  const rule_type *rule = &model->ruleBase[i];
+  int strength = UPPER_LIMIT;
+  for(int j = 0; j < NUMBER_OF_IF_SIDE; j++)
+    strength=min(strength,context->mf_value[rule->if_side[j]]);
+  if(strength == 0)return 0;
+  STATS_RULE(i,strength);
+  for(int o = 0; o < NUMBER_OF_OUTPUT; o++){
+    const int *coefficient = model->tskCoefficient[i][o];
+    long long z = coefficient[0];
+    for(int j = 0; j < NUMBER_OF_INPUT; j++)
+      z += (long long)coefficient[j + 1]*context->value[j];
+    context->sum_of_products[o] += strength*z;
+    context->sum_of_strengths[o] += strength;
+  }
+  return 1;
+}
+
+/* weighted average, no areas */
+GENERIC_CODE
+void tsk_defuzzification(const model_type *model, context_type *context){
+  (void)model;
+  for(int o = 0; o < NUMBER_OF_OUTPUT; o++){
+    if(context->sum_of_strengths[o]==0){                    /* nothing fired, nothing to average */
+      context->status|=STATUS_ZERO_AREA;
+      context->value[NUMBER_OF_INPUT + o]=0;
+      continue;
+    }
+    context->value[NUMBER_OF_INPUT + o]=
+      (int)(context->sum_of_products[o]/((long long)context->sum_of_strengths[o] << TSK_FRACTION_BITS));
+  }
+}
+
+/* TSK consequent "=c0+c1*Angle-c2*Velocity": a constant and signed
+   coefficient*input terms in any order, inputs by name, a term may repeat.
+   "=c0" alone is zero order. Returns -1 on a syntax error, or when a
+   coefficient, repeats summed, is NaN or beyond TSK_COEFFICIENT_LIMIT */
+int parse_tsk_consequent(const model_type *model, const char *text, int coefficient[NUMBER_OF_INPUT + 1]){
+  const long long limit = (long long)TSK_COEFFICIENT_LIMIT << TSK_FRACTION_BITS;
+  const char *p = text + 1;
+  long long sum[NUMBER_OF_INPUT + 1] = {0};
+  memset(coefficient, 0, (NUMBER_OF_INPUT + 1)*sizeof(int));
+  if(text[0] != TSK_MARK || *p == 0)return -1;
+  while(*p){
+    char *end;
+    double value = strtod(p,&end);
+    int term = 0;
+    if(end == p || !(value <= TSK_COEFFICIENT_LIMIT && value >= -TSK_COEFFICIENT_LIMIT))return -1;
+    p = end;
+    if(*p == '*'){                                 /* coefficient of an input */
+      size_t length = strcspn(++p,"+-");
+      for(int i = 0; i < NUMBER_OF_INPUT && term == 0; i++)
+        if(strncmp(model->inputOutput[i].name,p,length)==0 && model->inputOutput[i].name[length]==0)
+          term = i + 1;
+      if(term == 0)return -1;
+      p += length;
     }
-    for(int h = NUMBER_OF_MF; h < (2*NUMBER_OF_MF); h++)
+    if(*p != 0 && *p != '+' && *p != '-')return -1;
+    sum[term] += round_to_int(value*(1 << TSK_FRACTION_BITS));
+    if(sum[term] > limit || sum[term] < -limit)return -1;
+  }
+  for(int i = 0; i <= NUMBER_OF_INPUT; i++)coefficient[i] = (int)sum[i];
+  return 0;
+}
+
+/* Zero-order TSK twin of a Mamdani model: every rule concludes the centre
+   defuzzification() uses for its consequent mf */
+void compile_tsk_model(model_type *tsk, const model_type *model){
+  *tsk = *model;
+  tsk->inference = INFERENCE_TSK;
+  if(model->inference == INFERENCE_TSK)return;
+  memset(tsk->tskCoefficient, 0, sizeof(tsk->tskCoefficient));
+  for(int i = 0; i < NUMBER_OF_RULE; i++)
+    for(int o = 0; o < NUMBER_OF_OUTPUT; o++){
+      const mf_type *mf = &model->mf[model->ruleBase[i].then_side[o]];
+      tsk->tskCoefficient[i][o][0] = (mf->point1 + (mf->point2 - mf->point1)/2) << TSK_FRACTION_BITS;
+    }
+}
+
+/* counting sort of every rule antecedent by its input mf */
+void build_rule_index(model_type *model){
+  int fill[NUMBER_OF_INPUT*NUMBER_OF_MF];
+  memset(model->ruleIndexStart, 0, sizeof(model->ruleIndexStart));
+  for(int i = 0; i < NUMBER_OF_RULE; i++)
+    for(int j = 0; j < NUMBER_OF_IF_SIDE; j++)
+      model->ruleIndexStart[model->ruleBase[i].if_side[j] + 1]++;
+  for(int m = 0; m < NUMBER_OF_INPUT*NUMBER_OF_MF; m++){
+    model->ruleIndexStart[m + 1] += model->ruleIndexStart[m];
+    fill[m] = model->ruleIndexStart[m];
+  }
+  for(int i = 0; i < NUMBER_OF_RULE; i++)
+    for(int j = 0; j < NUMBER_OF_IF_SIDE; j++)
+      model->ruleIndex[fill[model->ruleBase[i].if_side[j]]++] = i;
+  model->rule_engine = NUMBER_OF_RULE > SPARSE_RULE_THRESHOLD ? RULE_ENGINE_SPARSE : RULE_ENGINE_LIST;
+}
+
+#ifdef FUZZY_RULE_GRID
+/* Complete rule bases as a dense grid. Firing strengths of all cells are the
+   outer-product min of the input membership vectors, built one input at a
+   time, then each output mf is a max-reduce over the cells whose mask has
+   its bit. Cells without a rule have mask GRID_NO_RULE and contribute 0.
+   No data dependent branches, both loops vectorize. */
+void rule_evaluation_grid(const model_type *model, context_type *context){
+  int forOutputMf = FIRST_OUTPUT_MF;
+  _Alignas(16) unsigned char strength[2][GRID_STRIDE + 16];
+  int cells = 1;
+  int current = 0;
+  int fired = 0;
+  strength[0][0] = UPPER_LIMIT;
+  for(int i = 0; i < NUMBER_OF_INPUT; i++){
+    const int *value = &context->mf_value[i*NUMBER_OF_MF];
+    unsigned char *from = strength[current];
+    unsigned char *to = strength[current ^ 1];
+#if defined(FUZZY_X86_SIMD) && defined(__SSE2__)
+    /* one 16-byte store per cell, the bytes past NUMBER_OF_MF land in the
+       next cell's slot (rewritten next) or in the padding */
+    _Alignas(16) unsigned char bytes[16] = {0};
+    for(int j = 0; j < NUMBER_OF_MF; j++)bytes[j] = value[j];
+    __m128i row = _mm_load_si128((const __m128i *)bytes);
+    for(int c = 0; c < cells; c++)
+      _mm_storeu_si128((__m128i *)&to[c*NUMBER_OF_MF], _mm_min_epu8(row, _mm_set1_epi8(from[c])));
+#else
+    for(int c = 0; c < cells; c++)
+      for(int j = 0; j < NUMBER_OF_MF; j++)
+        to[c*NUMBER_OF_MF + j] = value[j] < from[c] ? value[j] : from[c];
+#endif
+    cells *= NUMBER_OF_MF;
+    current ^= 1;
+  }
+  for(int k = 0; k < NUMBER_OF_OUTPUT*NUMBER_OF_MF; k++){
+    const unsigned char *mask = model->ruleGridMask[k];
+    unsigned char out = 0;
+#if defined(FUZZY_X86_SIMD) && defined(__SSE2__)
+    /* padding cells have mask 0 and drop out of the max */
+    __m128i packed = _mm_setzero_si128();
+    for(int c = 0; c < GRID_STRIDE; c += 16)
+      packed = _mm_max_epu8(packed, _mm_and_si128(_mm_load_si128((const __m128i *)&strength[current][c]),
+                                                  _mm_load_si128((const __m128i *)&mask[c])));
+    packed = _mm_max_epu8(packed, _mm_srli_si128(packed, 8));
+    packed = _mm_max_epu8(packed, _mm_srli_si128(packed, 4));
+    packed = _mm_max_epu8(packed, _mm_srli_si128(packed, 2));
+    packed = _mm_max_epu8(packed, _mm_srli_si128(packed, 1));
+    out = (unsigned char)_mm_cvtsi128_si32(packed);
+#else
+    for(int c = 0; c < GRID_CELLS; c++){
+      unsigned char s = strength[current][c] & mask[c];
+      out = s > out ? s : out;
+    }
+#endif
+    context->mf_value[forOutputMf + k] = out;
+    fired |= out;
+  }
+  context->status = fired ? 0 : STATUS_NO_MATCH;
+}
+
+/* a cell collects every rule with its antecedents, rule base entries that
+   share antecedents but differ in consequent just set more bits */
+void build_rule_grid(model_type *model){
+  int forOutputMf = FIRST_OUTPUT_MF;
+  memset(model->ruleGrid, GRID_NO_RULE, sizeof(model->ruleGrid));
+  memset(model->ruleGridMask, 0, sizeof(model->ruleGridMask));
+  for(int i = 0; i < NUMBER_OF_RULE; i++){
+    int cell = 0;
+    for(int j = 0; j < NUMBER_OF_IF_SIDE; j++)
+      cell = cell*NUMBER_OF_MF + (model->ruleBase[i].if_side[j] - j*NUMBER_OF_MF);
+    for(int k = 0; k < NUMBER_OF_THEN_SIDE; k++)
+      model->ruleGrid[k][cell] |= 1 << (model->ruleBase[i].then_side[k] - forOutputMf - k*NUMBER_OF_MF);
+  }
+  for(int k = 0; k < NUMBER_OF_OUTPUT*NUMBER_OF_MF; k++)
+    for(int c = 0; c < GRID_CELLS; c++)
+      model->ruleGridMask[k][c] = ((model->ruleGrid[k/NUMBER_OF_MF][c] >> (k % NUMBER_OF_MF)) & 1) ? 0xff : 0;
+}
+#endif
+
+/* name lookup, only used while compiling the rule base */
+int find_mf(const model_type *model, int io, const char *mfName){
+  int first = model->inputOutput[io].first_mf;
+  for(int j = first; j < first + NUMBER_OF_MF; j++)
+  {
+    if((strcmp(model->mf[j].name,mfName))==0)return j;  /* match found */
+  }
+  return -1;
+}
+
+void build_degree_table(const model_type *model, degree_table_type *table){
+  memset(table, 0, sizeof(*table));
+  for(int i = 0; i < NUMBER_OF_INPUT; i++)
+    for(int x = 0; x < SURFACE_SIZE; x++)
+      for(int j = 0; j < NUMBER_OF_MF; j++)
+        table->degree[i][x][j] = compute_degree_of_membership(&model->mf[i*NUMBER_OF_MF + j],x);
+}
+
+/* ENGINE_TABLE needs a table from build_degree_table(), inputs outside
+   0-UPPER_LIMIT still go through the slope arithmetic */
+void select_engine(model_type *model, int engine, const degree_table_type *table){
+  model->engine = engine;
+  model->degree_table = table;
+}
+
+/* DEFUZZIFIER_ method of one output. Every path through the model uses
+   it, the batch kernels fall back to one sample at a time for outputs
+   not on DEFUZZIFIER_AREA */
+void select_defuzzifier(model_type *model, int output, int method){
+  model->defuzzifier[output] = method;
+}
+
+/* left x axis value, right x axis value and the two slopes of a trapezoid
+   given by four points as in point[][]. -1 for points out of order or an
+   edge wider than UPPER_LIMIT (a zero slope) */
+int set_mf_points(mf_type *mf, const int p[4]){
+  if(!(p[0] < p[1] && p[1] <= p[2] && p[2] < p[3]) || p[1] - p[0] > UPPER_LIMIT || p[3] - p[2] > UPPER_LIMIT)
+    return -1;
+  mf->point1=p[0];
+  mf->point2=p[3];
+  mf->slope1=UPPER_LIMIT/(p[1]-p[0]);     /* left slope */
+  mf->slope2=UPPER_LIMIT/(p[3]-p[2]);     /* right slope */
+  memcpy(mf->point,p,sizeof(mf->point));
+  return 0;
+}
+
+/* READ RULES TABLE (laid out as rule[][]); RESOLVE NAMES TO MF INDICES,
+   consequents may be TSK instead. Sets model->inference, returns -1 after
+   putting the first bad entry on err */
+int compile_rules(model_type *model, char *table[][NUMBER_OF_INPUT_OUTPUT], FILE *err){
+  int index;
+  int tsk = 0;
+  for (int i = 0; i < NUMBER_OF_RULE; i++){
+    for(int j = 0; j < NUMBER_OF_INPUT_OUTPUT; j++)
     {
-      if((strcmp(mf[h].name,rule[i][1]))==0)
-      {
-        ifSide[l].value= &mf[h].value;  /* needs address here */
-        l++;
-        break;                       /* match found */
+      if(j >= NUMBER_OF_IF_SIDE && table[i][j][0] == TSK_MARK){
+        if(parse_tsk_consequent(model,table[i][j],model->tskCoefficient[i][j-NUMBER_OF_IF_SIDE]) < 0){
+          fprintf(err,"Error in rule #%d, consequent %s.\n",(i+1),table[i][j]);
+          return -1;
+        }
+        model->ruleBase[i].then_side[j-NUMBER_OF_IF_SIDE]=model->inputOutput[j].first_mf;  /* unused */
+        tsk++;
+        continue;
+      }
+      index = find_mf(model, j, table[i][j]);
+      if(index < 0){
+        fprintf(err,"Error in rule #%d, membership element %s.\n",(i+1),table[i][j]);
+        return -1;
       }
+      if(j < NUMBER_OF_IF_SIDE)model->ruleBase[i].if_side[j]=index;
+      else model->ruleBase[i].then_side[j-NUMBER_OF_IF_SIDE]=index;
     }
-    for(int g = forOutputMf; g < TOTAL_NUMBER_OF_MF; g++)
-    {
-      if((strcmp(mf[g].name,rule[i][2]))==0)
-      {
-        ruleBase[i].then_side=thenSide;
-        thenSide[i].value=&mf[g].value; /* needs address here */
-        break;                        /* match found */
+  }                                     /* END WHILE READING RULES */
+  if(tsk != 0 && tsk != NUMBER_OF_RULE*NUMBER_OF_THEN_SIDE){
+    fprintf(err,"Error in rule table, TSK and mf consequents mixed.\n");
+    return -1;
+  }
+  model->inference = tsk ? INFERENCE_TSK : INFERENCE_MAMDANI;
+  return 0;
+}
+
+void initialize_system(model_type *model){   /* NEW FUNCTION INITIALIZE, compiles the model once */
+  int k = 0;
+  for(int i = 0; i < NUMBER_OF_INPUT_OUTPUT; i++){
+    model->inputOutput[i].name = ioName[i];   /* name of system input/output */
+    model->inputOutput[i].first_mf = k;
+    for(int j = 0; j < NUMBER_OF_MF; j++){
+      model->mf[k].name = name[j];
+      if(set_mf_points(&model->mf[k],point[j]) < 0){
+        printf("Error in membership function %s.\n",name[j]);
+        exit(1);
       }
+      k++;
     }
-  }                                     /* END WHILE READING RULES FILE */
+  }
+  if(compile_rules(model,rule,stdout) < 0)exit(1);
+  model->kernel = select_kernel();
+  select_engine(model,ENGINE_ARITHMETIC,NULL);
+  for(int o = 0; o < NUMBER_OF_OUTPUT; o++)
+    select_defuzzifier(model,o,DEFUZZIFIER_AREA);
+  build_rule_index(model);
+#ifdef FUZZY_RULE_GRID
+  build_rule_grid(model);
+#endif
 }                                        /* END INITIALIZE */
 
-void put_system_outputs(){                     /* NEW */
-  int forOutputMf = TOTAL_NUMBER_OF_MF - NUMBER_OF_MF;
+void put_system_outputs(const model_type *model, const context_type *context){   /* NEW */
+  int forOutputMf = FIRST_OUTPUT_MF;
   int a = 0;
+  if(context->status & STATUS_NO_MATCH)printf("NO MATCHING RULES FOUND!\n");
+  if(context->status & STATUS_ZERO_AREA){
+    printf("Sum of Areas = 0, will cause div error\n");
+    for(int o = 0; o < NUMBER_OF_OUTPUT; o++)
+      printf("Sum of Products= %lld\n",context->sum_of_products[o]);
+  }
   for(int i = 0; i < NUMBER_OF_INPUT; i++)
   {
-    printf("%s: Value = %d\n",inputOutput[i].name,inputOutput[i].value);
+    printf("%s: Value = %d\n",model->inputOutput[i].name,context->value[i]);
     for(int j = 0; j < NUMBER_OF_MF; j++)
     {
       printf("  %s: Value %d Left %d Right %d\n",
-      mf[a].name,mf[a].value,mf[a].point1,mf[a].point2);
+      model->mf[a].name,context->mf_value[a],model->mf[a].point1,model->mf[a].point2);
       a++;
     }
     printf("\n");
   }
   for(int i = NUMBER_OF_INPUT; i < NUMBER_OF_INPUT_OUTPUT; i++){
-    printf("%s: Value= %d\n",inputOutput[i].name,inputOutput[i].value);
-    for(int j = forOutputMf; j < TOTAL_NUMBER_OF_MF; j++){
+    printf("%s: Value= %d\n",model->inputOutput[i].name,context->value[i]);
+    for(int j = forOutputMf; j < forOutputMf + NUMBER_OF_MF; j++){
       printf("  %s: Value %d Left %d Right %d\n",
-      mf[j].name,mf[j].value,mf[j].point1,mf[j].point2);
+      model->mf[j].name,context->mf_value[j],model->mf[j].point1,model->mf[j].point2);
     }
+    forOutputMf += NUMBER_OF_MF;
   }
-  /* print values pointed to by rule_type (if & then) */
+  /* print values referenced by each rule (if & then) */
   printf("\n");
-  int b = 0;
-  int c = 0;
   for(int i = 0; i < NUMBER_OF_RULE; i++){
     printf("Rule #%d:",(i+1));
     for(int j = 0; j < NUMBER_OF_IF_SIDE; j++)
     {
-      printf("  %d",*(ifSide[b].value));
-      b++;
+      printf("  %d",context->mf_value[model->ruleBase[i].if_side[j]]);
     }
     for(int k = 0; k < NUMBER_OF_THEN_SIDE; k++){
-      printf("  %d\n",*(thenSide[c].value));
-      c++;
+      printf("  %d",context->mf_value[model->ruleBase[i].then_side[k]]);
     }
+    printf("\n");
   }
   printf("\n");
 }                                        /* END PUT SYSTEM OUTPUTS */
 
-void get_system_inputs(int input1,int input2){         /* NEW */
-  inputOutput[0].value = input1;
-  inputOutput[1].value = input2;
+void get_system_inputs(context_type *context, const int input[NUMBER_OF_INPUT]){         /* NEW */
+  for(int i = 0; i < NUMBER_OF_INPUT; i++)
+    context->value[i] = input[i];
 }                                        /* END GET SYSTEM INPUTS */
 
-float max(float a, float b){
-  float max;
+/* Compile the fixed-point engine with q fractional bits per degree. Overflow
+   is checked here, once, from the output mfs themselves: twice a clipped
+   area is at most 2*base*1.0*1.0, and an output sums area*(point1 + point2)
+   plus the areas over its mfs, area at most base*1.0. Whenever one of them
+   can pass 31 bits the model is flagged wide and fixed_defuzzification()
+   accumulates in 64 bits. Returns -1 for a q out of range or output
+   supports too wide even for 64 bits. */
+int compile_fixed_model(fixed_model_type *fixed, const model_type *model, int q){
+  double one = (double)(1 << q);
+  if(q < FIXED_Q_MIN || q > FIXED_Q_MAX)return -1;
+  fixed->q = q;
+  fixed->shift = FIXED_PRODUCT_BITS - q;
+  fixed->wide = 0;
+  for(int k = 0; k < TOTAL_NUMBER_OF_MF; k++){
+    fixed_mf_type *mf = &fixed->mf[k];
+    const int *p = model->mf[k].point;   /* as set_mf_points() was given them */
+    mf->point1 = p[0];
+    mf->point2 = p[3];
+    mf->width1 = p[1] - p[0];
+    mf->width2 = p[3] - p[2];
+    /* rounded 1.0/width, in (q + shift) fraction bits */
+    mf->slope1 = ((1 << FIXED_PRODUCT_BITS) + mf->width1/2)/mf->width1;
+    mf->slope2 = ((1 << FIXED_PRODUCT_BITS) + mf->width2/2)/mf->width2;
+  }
+  for(int o = 0; o < NUMBER_OF_OUTPUT; o++){
+    double sum = 0;
+    for(int k = FIRST_OUTPUT_MF + o*NUMBER_OF_MF; k < FIRST_OUTPUT_MF + (o + 1)*NUMBER_OF_MF; k++){
+      const fixed_mf_type *mf = &fixed->mf[k];
+      double base = (double)mf->point2 - mf->point1;
+      double centre = (double)mf->point1 + mf->point2;
+      double twice = 2*base*one*one;
+      sum += base*one*(1 + (centre < 0 ? -centre : centre));
+      if(twice > FIXED_WIDE_LIMIT)return -1;
+      if(twice > FIXED_NARROW_LIMIT)fixed->wide = 1;
+    }
+    if(sum > FIXED_WIDE_LIMIT)return -1;
+    if(sum > FIXED_NARROW_LIMIT)fixed->wide = 1;
+  }
+  memcpy(fixed->ruleBase, model->ruleBase, sizeof(fixed->ruleBase));
+  return 0;
+}
+
+void fixed_fuzzification(const fixed_model_type *fixed, context_type *context){
+  int one = 1 << fixed->q;
+  int k = 0;
+  for(int i = 0; i < NUMBER_OF_INPUT; i++){
+    for(int j = 0; j < NUMBER_OF_MF; j++){
+      const fixed_mf_type *mf = &fixed->mf[k];
+      int delta_1 = context->value[i] - mf->point1;
+      int delta_2 = mf->point2 - context->value[i];
+      int value = 0;
+      if(delta_1 > 0 && delta_2 > 0){
+        /* deltas past the width already mean 1.0, clamping keeps the product in range */
+        int v1 = delta_1 < mf->width1 ? (delta_1*mf->slope1) >> fixed->shift : one;
+        int v2 = delta_2 < mf->width2 ? (delta_2*mf->slope2) >> fixed->shift : one;
+        value = min(min(v1, v2), one);
+      }
+      context->mf_value[k++] = value;
+    }
+  }
+}
+
+void fixed_rule_evaluation(const fixed_model_type *fixed, context_type *context){
+  int forOutputMf = FIRST_OUTPUT_MF;
+  int nomatch = 0;
+  for(int i = forOutputMf; i < TOTAL_NUMBER_OF_MF; i++)
+    context->mf_value[i] = 0;
+  for(int i = 0; i < NUMBER_OF_RULE; i++){
+    const rule_type *rule = &fixed->ruleBase[i];
+    int strength = 1 << fixed->q;
+    for(int j = 0; j < NUMBER_OF_IF_SIDE; j++)
+      strength = min(strength, context->mf_value[rule->if_side[j]]);
+    for(int k = 0; k < NUMBER_OF_THEN_SIDE; k++){
+      int *then = &context->mf_value[rule->then_side[k]];
+      *then = max(strength, *then);
+    }
+    nomatch |= strength;
+  }
+  context->status = nomatch ? 0 : STATUS_NO_MATCH;
+}
+
+/* Trapezoid of height h (Q): the sloped runs are h*width1 and h*width2
+   (x units times 1.0), so twice the area is h*(2*base*1.0 - runs).
+   Areas are kept in x units times 1.0, centroids doubled to stay exact,
+   and the output is rounded to the nearest integer. */
+void fixed_defuzzification(const fixed_model_type *fixed, context_type *context){
+  int one = 1 << fixed->q;
+  context->status &= ~STATUS_ZERO_AREA;
+  for(int o = 0; o < NUMBER_OF_OUTPUT; o++){
+    int forOutputMf = FIRST_OUTPUT_MF + o*NUMBER_OF_MF;
+    if(!fixed->wide){
+      int sum_of_products = 0;
+      int sum_of_areas = 0;
+      for(int i = forOutputMf; i < forOutputMf + NUMBER_OF_MF; i++){
+        const fixed_mf_type *mf = &fixed->mf[i];
+        int h = context->mf_value[i];
+        int base = mf->point2 - mf->point1;
+        int area = (h*(2*base*one - h*mf->width1 - h*mf->width2)) >> (fixed->q + 1);
+        sum_of_products += area*(mf->point1 + mf->point2);
+        sum_of_areas += area;
+      }
+      context->sum_of_products[o] = sum_of_products;
+      if(sum_of_areas == 0){
+        context->status |= STATUS_ZERO_AREA;
+        context->value[NUMBER_OF_INPUT + o] = 0;
+        continue;
+      }
+      context->value[NUMBER_OF_INPUT + o] = (sum_of_products + sum_of_areas)/(2*sum_of_areas);
+    }
+    else{
+      long long sum_of_products = 0;
+      long long sum_of_areas = 0;
+      for(int i = forOutputMf; i < forOutputMf + NUMBER_OF_MF; i++){
+        const fixed_mf_type *mf = &fixed->mf[i];
+        long long h = context->mf_value[i];
+        long long base = mf->point2 - mf->point1;
+        long long area = (h*(2*base*one - h*mf->width1 - h*mf->width2)) >> (fixed->q + 1);
+        sum_of_products += area*(mf->point1 + mf->point2);
+        sum_of_areas += area;
+      }
+      context->sum_of_products[o] = sum_of_products;
+      if(sum_of_areas == 0){
+        context->status |= STATUS_ZERO_AREA;
+        context->value[NUMBER_OF_INPUT + o] = 0;
+        continue;
+      }
+      context->value[NUMBER_OF_INPUT + o] = (int)((sum_of_products + sum_of_areas)/(2*sum_of_areas));
+    }
+  }
+}
+
+#ifdef FUZZY_PACKED
+/* model in the packed layout, -1 for TSK consequents, a defuzzifier other
+   than DEFUZZIFIER_AREA or an mf reaching outside 0-UPPER_LIMIT */
+int compile_packed_model(packed_model_type *packed, const model_type *model){
+  int forOutputMf = FIRST_OUTPUT_MF;
+  if(model->inference == INFERENCE_TSK)return -1;
+  for(int o = 0; o < NUMBER_OF_OUTPUT; o++)
+    if(model->defuzzifier[o] != DEFUZZIFIER_AREA)return -1;
+  memset(packed, 0, sizeof(*packed));
+#ifdef PACKED_INDEX_CELLS
+  for(int i = 0; i < NUMBER_OF_RULE; i++)
+    packed->ruleStart[packed_cell(model->ruleBase[i].if_side) + 1]++;
+  for(int c = 0; c < PACKED_INDEX_CELLS; c++)    /* ruleStart[c+1] back to the start of cell c */
+    packed->ruleStart[c + 1] += packed->ruleStart[c];
+  for(int c = PACKED_INDEX_CELLS; c > 0; c--)packed->ruleStart[c] = packed->ruleStart[c - 1];
+#endif
+  for(int k = 0; k < TOTAL_NUMBER_OF_MF; k++){
+    const mf_type *mf = &model->mf[k];
+    if(mf->point1 < 0 || mf->point2 > UPPER_LIMIT)return -1;
+    packed->mf[k].point1 = (unsigned char)mf->point1;
+    packed->mf[k].point2 = (unsigned char)mf->point2;
+    packed->mf[k].slope1 = (unsigned char)mf->slope1;
+    packed->mf[k].slope2 = (unsigned char)mf->slope2;
+  }
+  for(int i = 0; i < NUMBER_OF_RULE; i++){
+    int r = i;
+#ifdef PACKED_INDEX_CELLS
+    int cell = packed_cell(model->ruleBase[i].if_side);
+    r = packed->ruleStart[cell + 1]++;         /* counting sort, ruleStart[c+1] fills cell c */
+#endif
+    for(int j = 0; j < NUMBER_OF_IF_SIDE; j++)
+      packed->rule[r][j/2] |= (model->ruleBase[i].if_side[j] - j*NUMBER_OF_MF) << 4*(j % 2);
+    for(int o = 0; o < NUMBER_OF_THEN_SIDE; o++){
+      int n = NUMBER_OF_IF_SIDE + o;
+      packed->rule[r][n/2] |= (model->ruleBase[i].then_side[o] - forOutputMf - o*NUMBER_OF_MF) << 4*(n % 2);
+    }
+  }
+#ifdef FUZZY_PACKED_NAMES
+  for(int i = 0; i < NUMBER_OF_INPUT_OUTPUT; i++)packed->ioName[i] = model->inputOutput[i].name;
+  for(int j = 0; j < NUMBER_OF_MF; j++)packed->mfName[j] = model->mf[j].name;
+#endif
+  return 0;
+}
+
+void packed_fuzzification(const packed_model_type *packed, packed_context_type *context){
+  int k = 0;
+  for(int i = 0; i < NUMBER_OF_INPUT; i++){
+    int input = context->value[i];
+    for(int j = 0; j < NUMBER_OF_MF; j++, k++){
+      const packed_mf_type *mf = &packed->mf[k];
+      int delta_1 = input - mf->point1;
+      int delta_2 = mf->point2 - input;
+      int value = 0;
+      if(delta_1 > 0 && delta_2 > 0){
+        value = min(mf->slope1*delta_1,mf->slope2*delta_2);
+        value = min(value,UPPER_LIMIT);
+      }
+      context->mf_value[k] = (unsigned char)value;
+    }
+  }
+}
+
+#ifdef PACKED_INDEX_CELLS
+/* index cell of a rule from its if_side[] */
+int packed_cell(const int if_side[NUMBER_OF_IF_SIDE]){
+#if PACKED_INDEX_CELLS == NUMBER_OF_MF
+  return if_side[0];
+#else
+  return if_side[0]*NUMBER_OF_MF + (if_side[1] - NUMBER_OF_MF);
+#endif
+}
+#endif
+
+/* rules first to end-1 into the consequent degrees, returns 1 if one fired */
+int packed_fire(const packed_model_type *packed, packed_context_type *context, int first, int end){
+  int forOutputMf = FIRST_OUTPUT_MF;
+  int fired = 0;
+  for(int i = first; i < end; i++){
+    const unsigned char *rule = packed->rule[i];
+    int strength = UPPER_LIMIT;
+    for(int j = 0; j < NUMBER_OF_IF_SIDE && strength; j++)      /* most rules have an antecedent at 0 */
+      strength = min(strength,context->mf_value[j*NUMBER_OF_MF + ((rule[j/2] >> 4*(j % 2)) & 15)]);
+    if(strength == 0)continue;
+    for(int o = 0; o < NUMBER_OF_THEN_SIDE; o++){
+      int n = NUMBER_OF_IF_SIDE + o;
+      unsigned char *then = &context->mf_value[forOutputMf + o*NUMBER_OF_MF + ((rule[n/2] >> 4*(n % 2)) & 15)];
+      if(strength > *then)*then = (unsigned char)strength;
+    }
+    fired = 1;
+  }
+  return fired;
+}
+
+/* every rule, or with the index the rules of cells whose input mfs are
+   both above 0, the others cannot fire */
+void packed_rule_evaluation(const packed_model_type *packed, packed_context_type *context){
+  int fired = 0;
+  memset(context->mf_value + FIRST_OUTPUT_MF, 0, NUMBER_OF_OUTPUT*NUMBER_OF_MF);
+#if !defined(PACKED_INDEX_CELLS)
+  fired = packed_fire(packed,context,0,NUMBER_OF_RULE);
+#elif PACKED_INDEX_CELLS == NUMBER_OF_MF
+  for(int a = 0; a < NUMBER_OF_MF; a++)
+    if(context->mf_value[a])fired |= packed_fire(packed,context,packed->ruleStart[a],packed->ruleStart[a + 1]);
+#else
+  for(int a = 0; a < NUMBER_OF_MF; a++){
+    if(context->mf_value[a] == 0)continue;
+    for(int b = 0; b < NUMBER_OF_MF; b++){
+      int cell = a*NUMBER_OF_MF + b;
+      if(context->mf_value[NUMBER_OF_MF + b])
+        fired |= packed_fire(packed,context,packed->ruleStart[cell],packed->ruleStart[cell + 1]);
+    }
+  }
+#endif
+  context->status = fired ? 0 : STATUS_NO_MATCH;
+}
+
+/* defuzzification() on DEFUZZIFIER_AREA, an mf of degree 0 has no area */
+void packed_defuzzification(const packed_model_type *packed, packed_context_type *context){
+  for(int o = 0; o < NUMBER_OF_OUTPUT; o++){
+    int forOutputMf = FIRST_OUTPUT_MF + o*NUMBER_OF_MF;
+    int sum_of_products = 0;
+    int sum_of_areas = 0;
+    for(int i = forOutputMf; i < forOutputMf + NUMBER_OF_MF; i++){
+      const packed_mf_type *mf = &packed->mf[i];
+      int value = context->mf_value[i];
+      int base, top, area;
+      if(value == 0)continue;
+      base = mf->point2 - mf->point1;
+      top = base - value/mf->slope1 - value/mf->slope2;
+      area = value*(base + top)/2;
+      sum_of_products += area*(mf->point1 + base/2);
+      sum_of_areas += area;
+    }
+    if(sum_of_areas == 0){
+      context->status |= STATUS_ZERO_AREA;
+      context->value[NUMBER_OF_INPUT + o] = 0;
+      continue;
+    }
+    context->value[NUMBER_OF_INPUT + o] = sum_of_products/sum_of_areas;
+  }
+}
+
+/* evaluate() on a packed model */
+void packed_evaluate(const packed_model_type *packed, const int input[NUMBER_OF_INPUT], int output[NUMBER_OF_OUTPUT]){
+  packed_context_type context;
+  for(int i = 0; i < NUMBER_OF_INPUT; i++)context.value[i] = input[i];
+  packed_fuzzification(packed,&context);
+  packed_rule_evaluation(packed,&context);
+  packed_defuzzification(packed,&context);
+  for(int o = 0; o < NUMBER_OF_OUTPUT; o++)
+    output[o] = context.value[NUMBER_OF_INPUT + o];
+}
+#endif
+
+/* one sample through the fuzzification/rule_evaluation/defuzzification chain */
+void evaluate(const model_type *model, const int input[NUMBER_OF_INPUT], int output[NUMBER_OF_OUTPUT]){
+  context_type context;
+  get_system_inputs(&context,input);
+  fuzzification(model,&context);
+  rule_evaluation(model,&context);
+  defuzzification(model,&context);
+  for(int o = 0; o < NUMBER_OF_OUTPUT; o++)
+    output[o] = context.value[NUMBER_OF_INPUT + o];
+}
+
+void incremental_reset(incremental_type *state){
+  memset(state, 0, sizeof(*state));
+}
+
+/* Slowly varying inputs: an input whose value did not change keeps its
+   degrees, of one that did only the mfs covering its old or new value
+   are recomputed (the table engine gives the same degrees). A strength
+   can only change for a rule that was live or one using a degree that
+   rose from 0, only those are recomputed. An output mf is re-maxed over
+   the live rules only when its strongest rule weakened, and the area sums of DEFUZZIFIER_AREA outputs move by the changed areas. An
+   exact repeat of one of the last MEMO_SIZE input vectors is answered
+   from the memo. Same outputs and status as evaluate(). TSK models are
+   rebuilt every call (their consequents follow the inputs), the memo
+   still applies */
+int evaluate_incremental(const model_type *model, incremental_type *state, const int input[NUMBER_OF_INPUT],
+                         int output[NUMBER_OF_OUTPUT]){
+  context_type *context = &state->context;
+  int born[NUMBER_OF_INPUT*NUMBER_OF_MF];        /* changed degrees that were 0 */
+  int live[NUMBER_OF_RULE];
+  int touched[NUMBER_OF_OUTPUT*NUMBER_OF_MF];
+  unsigned char mark[NUMBER_OF_OUTPUT*NUMBER_OF_MF];  /* 1: touched, 2: max must be rescanned */
+  int numberOfChanged = 0;
+  int numberOfBorn = 0;
+  int numberOfLive = 0;
+  int numberOfTouched = 0;
+  int rescan = 0;
+  state->stats.calls++;
+  for(int e = 0; e < state->memo_used; e++)
+    if(memcmp(state->memo_input[e], input, sizeof(state->memo_input[e]))==0){
+      memcpy(output, state->memo_output[e], sizeof(state->memo_output[e]));
+      state->stats.memo_hits++;
+      return state->memo_status[e];
+    }
+  if(!state->valid){
+    incremental_rebuild(model,state,input);
+    goto done;
+  }
+  for(int i = 0; i < NUMBER_OF_INPUT; i++){
+    int old = context->value[i];
+    if(input[i] == old)continue;
+    context->value[i] = input[i];
+    for(int m = i*NUMBER_OF_MF; m < (i+1)*NUMBER_OF_MF; m++){
+      const mf_type *mf = &model->mf[m];
+      int degree;
+      if((old <= mf->point1 || old >= mf->point2) && (input[i] <= mf->point1 || input[i] >= mf->point2))
+        continue;                                /* 0 before and after */
+      degree = compute_degree_of_membership(mf,input[i]);
+      if(degree != context->mf_value[m]){
+        if(context->mf_value[m] == 0)born[numberOfBorn++] = m;
+        context->mf_value[m] = degree;
+        numberOfChanged++;
+      }
+    }
+  }
+  state->stats.degrees_changed += numberOfChanged;
+  if(numberOfChanged == 0){
+    state->stats.unchanged++;
+    goto done;
+  }
+  if(++state->stamp == 0){                       /* wrapped, forget old marks */
+    memset(state->visited, 0, sizeof(state->visited));
+    state->stamp = 1;
+  }
+  memset(mark, 0, sizeof(mark));
+  /* pass 0 walks the live rules, pass p the rules of born[p-1] */
+  for(int pass = 0; pass <= numberOfBorn; pass++){
+    const int *rules = state->live;
+    int n = state->fired;
+    if(pass > 0){
+      int m = born[pass-1];
+      rules = &model->ruleIndex[model->ruleIndexStart[m]];
+      n = model->ruleIndexStart[m+1] - model->ruleIndexStart[m];
+    }
+    for(int r = 0; r < n; r++){
+      int i = rules[r];
+      const rule_type *rule = &model->ruleBase[i];
+      int strength = UPPER_LIMIT;
+      int old = state->strength[i];
+      if(state->visited[i] == state->stamp)continue;
+      state->visited[i] = state->stamp;
+      state->stats.rules_evaluated++;
+      for(int j = 0; j < NUMBER_OF_IF_SIDE; j++)
+        strength = min(strength,context->mf_value[rule->if_side[j]]);
+      if(strength > 0)live[numberOfLive++] = i;
+      if(strength == old)continue;
+      state->strength[i] = strength;
+      for(int k = 0; k < NUMBER_OF_THEN_SIDE; k++){
+        int t = rule->then_side[k] - FIRST_OUTPUT_MF;
+        int *then = &context->mf_value[rule->then_side[k]];
+        if(strength > *then)*then = strength;
+        else if(old == *then && strength < old)mark[t] |= 2;   /* was the max, may not be anymore */
+        else continue;
+        if(!(mark[t] & 1))touched[numberOfTouched++] = t;
+        mark[t] |= 1;
+      }
+    }
+  }
+  memcpy(state->live, live, numberOfLive*sizeof(int));
+  state->fired = numberOfLive;
+  for(int c = 0; c < numberOfTouched; c++)
+    if(mark[touched[c]] & 2){
+      rescan = 1;
+      context->mf_value[FIRST_OUTPUT_MF + touched[c]] = 0;
+    }
+  if(rescan)                                     /* only live rules can hold a max */
+    for(int l = 0; l < numberOfLive; l++){
+      const rule_type *rule = &model->ruleBase[live[l]];
+      int strength = state->strength[live[l]];
+      for(int k = 0; k < NUMBER_OF_THEN_SIDE; k++){
+        int *then = &context->mf_value[rule->then_side[k]];
+        if((mark[rule->then_side[k] - FIRST_OUTPUT_MF] & 2) && strength > *then)*then = strength;
+      }
+    }
+  for(int c = 0; c < numberOfTouched; c++){
+    int t = touched[c];
+    int o = t / NUMBER_OF_MF;
+    const mf_type *mf = &model->mf[FIRST_OUTPUT_MF + t];
+    int *then = &context->mf_value[FIRST_OUTPUT_MF + t];
+    int area;
+    area = compute_area_of_trapezoid(mf,*then);
+    state->sum_of_areas[o] += area - state->area[t];
+    state->sum_of_products[o] += (long long)(area - state->area[t])*(mf->point1 + (mf->point2 - mf->point1)/2);
+    state->area[t] = area;
+  }
+  context->status = state->fired ? 0 : STATUS_NO_MATCH;
+  for(int o = 0; o < NUMBER_OF_OUTPUT; o++){
+    const int *degree = &context->mf_value[FIRST_OUTPUT_MF + o*NUMBER_OF_MF];
+    int fired = 0;
+    context->sum_of_products[o] = 0;
+    if(model->defuzzifier[o] == DEFUZZIFIER_AREA){
+      context->sum_of_products[o] = state->sum_of_products[o];
+      if(state->sum_of_areas[o] == 0){
+        context->status |= STATUS_ZERO_AREA;
+        context->value[NUMBER_OF_INPUT + o] = 0;
+      }
+      else context->value[NUMBER_OF_INPUT + o] = (int)(state->sum_of_products[o]/state->sum_of_areas[o]);
+      continue;
+    }
+    for(int k = 0; k < NUMBER_OF_MF; k++)fired |= degree[k];
+    if(!fired){
+      context->status |= STATUS_ZERO_AREA;
+      context->value[NUMBER_OF_INPUT + o] = 0;
+    }
+    else context->value[NUMBER_OF_INPUT + o] = defuzzify_output(model,model->defuzzifier[o],o,degree);
+  }
+done:
+  for(int o = 0; o < NUMBER_OF_OUTPUT; o++)
+    output[o] = context->value[NUMBER_OF_INPUT + o];
+  memcpy(state->memo_input[state->memo_next], input, sizeof(state->memo_input[0]));
+  memcpy(state->memo_output[state->memo_next], output, sizeof(state->memo_output[0]));
+  state->memo_status[state->memo_next] = context->status;
+  state->memo_next = (state->memo_next + 1) % MEMO_SIZE;
+  if(state->memo_used < MEMO_SIZE)state->memo_used++;
+  return context->status;
+}
+
+/* full evaluation, then the rule strengths and areas the next
+   evaluate_incremental() updates */
+void incremental_rebuild(const model_type *model, incremental_type *state, const int input[NUMBER_OF_INPUT]){
+  context_type *context = &state->context;
+  get_system_inputs(context,input);
+  fuzzification(model,context);
+  rule_evaluation(model,context);
+  defuzzification(model,context);
+  state->stats.rebuilds++;
+  state->valid = model->inference == INFERENCE_MAMDANI;
+  if(!state->valid)return;
+  state->fired = 0;
+  for(int i = 0; i < NUMBER_OF_RULE; i++){
+    int strength = UPPER_LIMIT;
+    for(int j = 0; j < NUMBER_OF_IF_SIDE; j++)
+      strength = min(strength,context->mf_value[model->ruleBase[i].if_side[j]]);
+    state->strength[i] = strength;
+    if(strength > 0)state->live[state->fired++] = i;
+  }
+  for(int o = 0; o < NUMBER_OF_OUTPUT; o++){
+    state->sum_of_products[o] = 0;
+    state->sum_of_areas[o] = 0;
+    for(int k = 0; k < NUMBER_OF_MF; k++){
+      int t = o*NUMBER_OF_MF + k;
+      const mf_type *mf = &model->mf[FIRST_OUTPUT_MF + t];
+      state->area[t] = compute_area_of_trapezoid(mf,context->mf_value[FIRST_OUTPUT_MF + t]);
+      state->sum_of_areas[o] += state->area[t];
+      state->sum_of_products[o] += (long long)state->area[t]*(mf->point1 + (mf->point2 - mf->point1)/2);
+    }
+  }
+}
+
+#ifdef FUZZY_STATS
+/* Blocks of the threads, claimed on a thread's first evaluation and given
+   back when it exits, so a pool restarted many times reuses them and the
+   counts of finished threads stay in the snapshot. Past STATS_THREADS live
+   threads the rest share statsShared, where concurrent updates may be lost */
+#ifdef FUZZY_THREADS
+#define STATS_THREADS               (2*MAX_THREADS)
+stats_type *_Atomic statsBlock[STATS_THREADS];
+atomic_int statsInUse[STATS_THREADS];
+pthread_key_t statsKey;
+pthread_once_t statsOnce = PTHREAD_ONCE_INIT;
+_Thread_local stats_type *statsLocal;
+#endif
+stats_type statsShared;
+
+stats_type *stats_local(){
+#ifdef FUZZY_THREADS
+  if(statsLocal == NULL)statsLocal = stats_claim();
+  return statsLocal;
+#else
+  return &statsShared;
+#endif
+}
+
+#ifdef FUZZY_THREADS
+stats_type *stats_claim(){
+  pthread_once(&statsOnce, stats_key_create);
+  for(int b = 0; b < STATS_THREADS; b++){
+    int unused = 0;
+    if(!atomic_compare_exchange_strong(&statsInUse[b], &unused, 1))continue;
+    if(statsBlock[b] == NULL)statsBlock[b] = calloc(1, sizeof(stats_type));
+    if(statsBlock[b] == NULL){
+      atomic_store(&statsInUse[b], 0);
+      break;
+    }
+    pthread_setspecific(statsKey, &statsInUse[b]);
+    return statsBlock[b];
+  }
+  return &statsShared;
+}
+
+void stats_release(void *slot){
+  atomic_store((atomic_int *)slot, 0);
+}
+
+void stats_key_create(){
+  pthread_key_create(&statsKey, stats_release);
+}
+#endif
+
+long long stats_clock(){
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  return (long long)__builtin_ia32_rdtsc();
+#else
+  return 0;                                      /* no cheap clock, stages are counted but not timed */
+#endif
+}
+
+/* 0 unless this call is one of the timed ones */
+long long stats_start(int stage){
+  stats_type *stats = stats_local();
+  if(stats->calls[stage]++ % STATS_TIMING_PERIOD != 0)return 0;
+  return stats_clock();
+}
+
+void stats_stop(int stage, long long start, int status){
+  stats_type *stats = stats_local();
+  if(start != 0){
+    stats->cycles[stage] += stats_clock() - start;
+    stats->timed[stage]++;
+  }
+  if(stage == STATS_RULE_EVALUATION && (status & STATUS_NO_MATCH))stats->no_match++;
+  if(stage == STATS_DEFUZZIFICATION && (status & STATUS_ZERO_AREA))stats->zero_area++;
+}
+
+/* per-rule counts where the engine keeps no rule strengths (the grid and
+   the batch kernels): the rules the sparse walk would fire, from the input
+   degrees it left, each counted weight times */
+void stats_rule_walk(const model_type *model, const int *mf_value, int weight){
+  stats_type *stats = stats_local();
+  int driver = 0;
+  int numberOfActive[NUMBER_OF_INPUT];
+  for(int i = 0; i < NUMBER_OF_INPUT; i++){
+    numberOfActive[i] = 0;
+    for(int j = i*NUMBER_OF_MF; j < (i+1)*NUMBER_OF_MF; j++)numberOfActive[i] += mf_value[j] > 0;
+    if(numberOfActive[i] < numberOfActive[driver])driver = i;
+  }
+  for(int m = driver*NUMBER_OF_MF; m < (driver+1)*NUMBER_OF_MF; m++){
+    if(mf_value[m] == 0)continue;
+    for(int r = model->ruleIndexStart[m]; r < model->ruleIndexStart[m+1]; r++){
+      const rule_type *rule = &model->ruleBase[model->ruleIndex[r]];
+      int strength = UPPER_LIMIT;
+      for(int j = 0; j < NUMBER_OF_IF_SIDE; j++)
+        strength = min(strength,mf_value[rule->if_side[j]]);
+      if(strength > 0)stats->histogram[model->ruleIndex[r]][strength*STATS_BINS/(UPPER_LIMIT + 1)] += weight;
+    }
+  }
+}
+
+/* no-match count of n samples of a block, exact, and the rule histograms
+   from one sample in STATS_SAMPLE_PERIOD: walking every sample would cost
+   more than the kernel itself */
+void stats_rule_block(const model_type *model, short mf_value[][BATCH_BLOCK], int n){
+  int degree[FIRST_OUTPUT_MF];
+  short fired[BATCH_BLOCK] = {0};
+  int no_match = 0;
+  for(int k = FIRST_OUTPUT_MF; k < TOTAL_NUMBER_OF_MF; k++)     /* whole rows vectorize, only n are counted */
+    for(int s = 0; s < BATCH_BLOCK; s++)fired[s] |= mf_value[k][s];
+  for(int s = 0; s < n; s++)no_match += !fired[s];
+  stats_local()->no_match += no_match;
+  for(int s = 0; s < n; s += STATS_SAMPLE_PERIOD){
+    for(int k = 0; k < FIRST_OUTPUT_MF; k++)degree[k] = mf_value[k][s];
+    stats_rule_walk(model,degree,n - s < STATS_SAMPLE_PERIOD ? n - s : STATS_SAMPLE_PERIOD);
+  }
+}
+
+/* sum of every thread's counters. Threads still evaluating may be a few
+   counts ahead of what is read, nothing is stopped */
+void stats_snapshot(stats_type *snapshot){
+  *snapshot = statsShared;
+#ifdef FUZZY_THREADS
+  for(int b = 0; b < STATS_THREADS; b++){
+    const stats_type *stats = statsBlock[b];
+    if(stats == NULL)continue;
+    for(int stage = 0; stage < NUMBER_OF_STATS_STAGE; stage++){
+      snapshot->calls[stage] += stats->calls[stage];
+      snapshot->timed[stage] += stats->timed[stage];
+      snapshot->cycles[stage] += stats->cycles[stage];
+    }
+    snapshot->batch_samples += stats->batch_samples;
+    snapshot->no_match += stats->no_match;
+    snapshot->zero_area += stats->zero_area;
+    for(int i = 0; i < NUMBER_OF_RULE; i++)
+      for(int k = 0; k < STATS_BINS; k++)snapshot->histogram[i][k] += stats->histogram[i][k];
+  }
+#endif
+}
+
+/* zero every thread's counters, meant for when nothing is evaluating */
+void stats_reset(){
+  memset(&statsShared, 0, sizeof(statsShared));
+#ifdef FUZZY_THREADS
+  for(int b = 0; b < STATS_THREADS; b++)
+    if(statsBlock[b] != NULL)memset(statsBlock[b], 0, sizeof(stats_type));
+#endif
+}
+
+void put_stats(FILE *fp, const model_type *model, const stats_type *stats){
+  char *stageName[NUMBER_OF_STATS_STAGE] = {"fuzzification", "rule_evaluation", "defuzzification", "batch"};
+  int silent = 0;
+  for(int stage = 0; stage < NUMBER_OF_STATS_STAGE; stage++){
+    fprintf(fp,"%-16s %lld calls",stageName[stage],stats->calls[stage]);
+    if(stats->timed[stage] > 0)fprintf(fp,", %.1f cycles/call",(double)stats->cycles[stage]/stats->timed[stage]);
+    fprintf(fp,"\n");
+  }
+  fprintf(fp,"batch samples    %lld\n",stats->batch_samples);
+  fprintf(fp,"no match         %lld\n",stats->no_match);
+  fprintf(fp,"zero area        %lld\n",stats->zero_area);
+  fprintf(fp,"rule   fired       strength histogram (%d bins)\n",STATS_BINS);
+  for(int i = 0; i < NUMBER_OF_RULE; i++){
+    long long fired = 0;
+    for(int k = 0; k < STATS_BINS; k++)fired += stats->histogram[i][k];
+    if(fired == 0){
+      silent++;
+      continue;
+    }
+    fprintf(fp,"#%-5d %-12lld",i + 1,fired);
+    for(int k = 0; k < STATS_BINS; k++)fprintf(fp," %u",stats->histogram[i][k]);
+    fprintf(fp,"   if");
+    for(int j = 0; j < NUMBER_OF_IF_SIDE; j++)fprintf(fp," %s",model->mf[model->ruleBase[i].if_side[j]].name);
+    fprintf(fp,"\n");
+  }
+  fprintf(fp,"%d of %d rules never fired\n",silent,NUMBER_OF_RULE);
+}
+#endif
+
+#ifdef FUZZY_SURFACE
+/* evaluate() for the two-input, one-output controller */
+int evaluate_pair(const model_type *model, int input1, int input2){
+  int input[NUMBER_OF_INPUT] = {input1, input2};
+  int output;
+  evaluate(model,input,&output);
+  return output;
+}
+
+void build_surface(const model_type *model, unsigned char table[SURFACE_SIZE][SURFACE_SIZE]){
+  for(int i = 0; i < SURFACE_SIZE; i++)
+    for(int j = 0; j < SURFACE_SIZE; j++)
+      table[i][j] = (unsigned char)evaluate_pair(model,i,j);
+}
+
+/* number of input pairs where the table disagrees with the live engine */
+int verify_surface(const model_type *model, const unsigned char table[SURFACE_SIZE][SURFACE_SIZE]){
+  int mismatch = 0;
+  for(int i = 0; i < SURFACE_SIZE; i++)
+    for(int j = 0; j < SURFACE_SIZE; j++)
+      if(surface_lookup(table,i,j) != evaluate_pair(model,i,j))mismatch++;
+  return mismatch;
+}
+#endif
+
+/* Smallest approximation found within budget of evaluate() on every
+   input of the domain, or on APPROX_SAMPLES random ones when the domain
+   has more than APPROX_EXHAUSTIVE outputs. Returns -1 when out of memory
+   or when no table of APPROX_MAX_TABLE values meets the budget */
+int build_approx(const model_type *model, approx_type *approx, int budget){
+  approx_check_type check;
+  int result;
+  if(approx_check_start(model,&check,12345) < 0)return -1;
+  result = build_approx_checked(model,&check,approx,budget);
+  approx_check_free(&check);
+  return result;
+}
+
+/* Knots start at the ends and the corners of every input mf, where the
+   surface bends, with the first and last input inside its support: when
+   the last rule stops firing the output jumps, an interval one wide keeps
+   the jump out of the interpolation. Each round then splits every knot interval holding an
+   input over budget at its worst input (or halves it), and once within budget every
+   knot whose removal keeps its two intervals within budget is dropped */
+int build_approx_checked(const model_type *model, const approx_check_type *check, approx_type *approx, int budget){
+  int worst[NUMBER_OF_INPUT][SURFACE_SIZE];
+  unsigned char where[NUMBER_OF_INPUT][SURFACE_SIZE];
+  int round = 0;
+  memset(approx, 0, sizeof(*approx));
+  for(int i = 0; i < NUMBER_OF_INPUT; i++){
+    unsigned char corner[SURFACE_SIZE] = {0};
+    corner[0] = corner[UPPER_LIMIT] = 1;
+    for(int j = i*NUMBER_OF_MF; j < (i+1)*NUMBER_OF_MF; j++){
+      const mf_type *mf = &model->mf[j];
+      int x[6] = {mf->point1, mf->point1 + 1, mf->point1 + (UPPER_LIMIT + mf->slope1 - 1)/mf->slope1,
+                  mf->point2 - (UPPER_LIMIT + mf->slope2 - 1)/mf->slope2, mf->point2 - 1, mf->point2};
+      for(int k = 0; k < 6; k++)corner[max(0,min(x[k],UPPER_LIMIT))] = 1;
+    }
+    for(int x = 0; x <= UPPER_LIMIT; x++)
+      if(corner[x])approx->knot[i][approx->numberOfKnot[i]++] = (unsigned char)x;
+  }
+  for(;;){
+    int inserted = 0;
+    if(approx_fill(model,approx) < 0){
+      free_approx(approx);
+      return -1;
+    }
+    if(approx_scan(approx,check,-1,0,UPPER_LIMIT,worst,where) <= budget)break;
+    if(++round > APPROX_ROUNDS)break;
+    for(int i = 0; i < NUMBER_OF_INPUT; i++){
+      unsigned char knot[SURFACE_SIZE];
+      int n = 0;
+      for(int j = 0; j + 1 < approx->numberOfKnot[i]; j++){
+        int low = approx->knot[i][j], high = approx->knot[i][j + 1];
+        knot[n++] = (unsigned char)low;
+        if(worst[i][j] <= budget || high - low < 2)continue;
+        /* at the worst input unless that leaves a sliver, then halved */
+        knot[n++] = 4*(where[i][j] - low) >= high - low && 4*(high - where[i][j]) >= high - low ?
+                    where[i][j] : (unsigned char)((low + high)/2);
+        inserted++;
+      }
+      knot[n++] = (unsigned char)UPPER_LIMIT;
+      memcpy(approx->knot[i], knot, n);
+      approx->numberOfKnot[i] = n;
+    }
+    if(inserted == 0)break;
+  }
+  if(approx_scan(approx,check,-1,0,UPPER_LIMIT,NULL,NULL) > budget){
+    free_approx(approx);
+    return -1;
+  }
+  for(int i = 0; i < NUMBER_OF_INPUT; i++)
+    for(int j = 1; j + 1 < approx->numberOfKnot[i]; ){
+      unsigned char removed = approx->knot[i][j];
+      int n = --approx->numberOfKnot[i];
+      memmove(&approx->knot[i][j], &approx->knot[i][j + 1], n - j);
+      if(approx_fill(model,approx) == 0 &&
+         approx_scan(approx,check,i,approx->knot[i][j - 1],approx->knot[i][j],NULL,NULL) <= budget)continue;
+      memmove(&approx->knot[i][j + 1], &approx->knot[i][j], n - j);
+      approx->knot[i][j++] = removed;
+      approx->numberOfKnot[i]++;
+    }
+  if(approx_fill(model,approx) < 0){
+    free_approx(approx);
+    return -1;
+  }
+  approx->max_error = approx_scan(approx,check,-1,0,UPPER_LIMIT,NULL,NULL);
+  approx->checked = check->count;
+  approx->exhaustive = check->exhaustive;
+  return 0;
+}
+
+void free_approx(approx_type *approx){
+  free(approx->value);
+  approx->value = NULL;
+}
+
+/* cell/weight rows and the grid outputs for the knots, -1 when the grid
+   needs more than APPROX_MAX_TABLE values or memory */
+int approx_fill(const model_type *model, approx_type *approx){
+  long long size = 1;
+  int stride[NUMBER_OF_INPUT];
+  int input[NUMBER_OF_INPUT];
+  int *value;
+  for(int i = NUMBER_OF_INPUT - 1; i >= 0; i--){
+    stride[i] = (int)size;
+    size *= approx->numberOfKnot[i];
+    if(size*NUMBER_OF_OUTPUT > APPROX_MAX_TABLE)return -1;
+  }
+  value = realloc(approx->value, (size_t)size*NUMBER_OF_OUTPUT*sizeof(int));
+  if(value == NULL)return -1;
+  approx->value = value;
+  approx->size = (int)size;
+  memcpy(approx->stride, stride, sizeof(stride));
+  for(int i = 0; i < NUMBER_OF_INPUT; i++){
+    const unsigned char *knot = approx->knot[i];
+    int j = 0;
+    for(int x = 0; x <= UPPER_LIMIT; x++){
+      int gap;
+      while(j + 2 < approx->numberOfKnot[i] && knot[j + 1] <= x)j++;
+      gap = knot[j + 1] - knot[j];
+      approx->cell[i][x] = (unsigned char)j;
+      approx->weight[i][x] = (unsigned short)((((x - knot[j]) << APPROX_WEIGHT_BITS) + gap/2)/gap);
+    }
+  }
+  for(int p = 0; p < approx->size; p++){
+    for(int i = 0; i < NUMBER_OF_INPUT; i++)
+      input[i] = approx->knot[i][p/approx->stride[i] % approx->numberOfKnot[i]];
+    evaluate(model,input,approx->value + (size_t)p*NUMBER_OF_OUTPUT);
+  }
+  return 0;
+}
+
+/* Largest |approx - exact| over the checked inputs whose input axis is in
+   from..to (axis -1: all of them). With worst/where, also the largest
+   error in each knot interval of each input and the input value it is at */
+int approx_scan(const approx_type *approx, const approx_check_type *check, int axis, int from, int to,
+                int worst[NUMBER_OF_INPUT][SURFACE_SIZE], unsigned char where[NUMBER_OF_INPUT][SURFACE_SIZE]){
+  int input[NUMBER_OF_INPUT];
+  int output[NUMBER_OF_OUTPUT];
+  int largest = 0;
+  if(worst != NULL)memset(worst, 0, NUMBER_OF_INPUT*sizeof(worst[0]));
+  for(int i = 0; i < NUMBER_OF_INPUT; i++)input[i] = 0;
+  if(check->exhaustive && axis >= 0)input[axis] = from;
+  for(long long s = 0; s < check->count; s++){
+    const int *exact;
+    int error = 0;
+    if(check->exhaustive){
+      long long index = 0;
+      if(s > 0){                                   /* next input in order, input 0 slowest */
+        int i = NUMBER_OF_INPUT - 1;
+        while(i >= 0){
+          int last = i == axis ? to : UPPER_LIMIT;
+          if(input[i] < last){
+            input[i]++;
+            break;
+          }
+          input[i] = i == axis ? from : 0;
+          i--;
+        }
+        if(i < 0)break;
+      }
+      for(int i = 0; i < NUMBER_OF_INPUT; i++)index = index*SURFACE_SIZE + input[i];
+      exact = check->exact + index*NUMBER_OF_OUTPUT;
+    }
+    else{
+      if(axis >= 0 && (check->input[s][axis] < from || check->input[s][axis] > to))continue;
+      memcpy(input, check->input[s], sizeof(input));
+      exact = check->exact + s*NUMBER_OF_OUTPUT;
+    }
+    approx_lookup(approx,input,output);
+    for(int o = 0; o < NUMBER_OF_OUTPUT; o++)
+      error = max(error, output[o] > exact[o] ? output[o] - exact[o] : exact[o] - output[o]);
+    largest = max(largest,error);
+    if(worst == NULL)continue;
+    {
+      int charged = 0, widest = 0, j;                 /* to the widest interval of the cell */
+      for(int i = 0; i < NUMBER_OF_INPUT; i++){
+        int gap = approx->knot[i][approx->cell[i][input[i]] + 1] - approx->knot[i][approx->cell[i][input[i]]];
+        if(gap > widest){
+          widest = gap;
+          charged = i;
+        }
+      }
+      j = approx->cell[charged][input[charged]];
+      if(error > worst[charged][j]){
+        worst[charged][j] = error;
+        where[charged][j] = (unsigned char)input[charged];
+      }
+    }
+  }
+  return largest;
+}
+
+/* exact outputs of the whole domain, or of APPROX_SAMPLES inputs drawn
+   from seed when it has more than APPROX_EXHAUSTIVE outputs */
+int approx_check_start(const model_type *model, approx_check_type *check, unsigned int seed){
+  long long domain = NUMBER_OF_OUTPUT;
+  int input[NUMBER_OF_INPUT] = {0};
+  for(int i = 0; i < NUMBER_OF_INPUT && domain <= APPROX_EXHAUSTIVE; i++)domain *= SURFACE_SIZE;
+  check->exhaustive = domain <= APPROX_EXHAUSTIVE;
+  check->count = check->exhaustive ? domain/NUMBER_OF_OUTPUT : APPROX_SAMPLES;
+  check->input = check->exhaustive ? NULL : malloc((size_t)check->count*sizeof(*check->input));
+  check->exact = malloc((size_t)check->count*NUMBER_OF_OUTPUT*sizeof(int));
+  if(check->exact == NULL || (!check->exhaustive && check->input == NULL)){
+    approx_check_free(check);
+    return -1;
+  }
+  for(long long s = 0; s < check->count; s++){
+    if(check->exhaustive){
+      long long rest = s;
+      for(int i = NUMBER_OF_INPUT - 1; i >= 0; i--, rest /= SURFACE_SIZE)input[i] = (int)(rest % SURFACE_SIZE);
+    }
+    else{
+      for(int i = 0; i < NUMBER_OF_INPUT; i++){
+        seed = seed*1103515245u + 12345u;
+        input[i] = (seed >> 16) & UPPER_LIMIT;
+      }
+      memcpy(check->input[s], input, sizeof(input));
+    }
+    evaluate(model,input,check->exact + s*NUMBER_OF_OUTPUT);
+  }
+  return 0;
+}
+
+void approx_check_free(approx_check_type *check){
+  free(check->input);
+  free(check->exact);
+  check->input = NULL;
+  check->exact = NULL;
+}
+
+/* approx_lookup() in the domain, evaluate() outside it */
+void approx_evaluate(const model_type *model, const approx_type *approx, const int input[NUMBER_OF_INPUT],
+                     int output[NUMBER_OF_OUTPUT]){
+  for(int i = 0; i < NUMBER_OF_INPUT; i++)
+    if(input[i] < 0 || input[i] > UPPER_LIMIT){
+      evaluate(model,input,output);
+      return;
+    }
+  approx_lookup(approx,input,output);
+}
+
+/* corners of the cell, then one lerp per input halves them, inputs must
+   be in 0-UPPER_LIMIT */
+void approx_lookup(const approx_type *approx, const int input[NUMBER_OF_INPUT], int output[NUMBER_OF_OUTPUT]){
+  int offset[1 << NUMBER_OF_INPUT];
+  long long corner[1 << NUMBER_OF_INPUT];
+  offset[0] = 0;
+  for(int i = 0; i < NUMBER_OF_INPUT; i++)offset[0] += approx->cell[i][input[i]]*approx->stride[i];
+  for(int i = 0; i < NUMBER_OF_INPUT; i++)                  /* bit i of a corner: upper knot of input i */
+    for(int c = 0; c < 1 << i; c++)offset[c + (1 << i)] = offset[c] + approx->stride[i];
+  for(int o = 0; o < NUMBER_OF_OUTPUT; o++){
+    for(int c = 0; c < 1 << NUMBER_OF_INPUT; c++)
+      corner[c] = (long long)approx->value[offset[c]*NUMBER_OF_OUTPUT + o]*(1 << APPROX_WEIGHT_BITS);
+    for(int i = NUMBER_OF_INPUT - 1; i >= 0; i--){
+      int w = approx->weight[i][input[i]];
+      for(int c = 0; c < 1 << i; c++)corner[c] += (corner[c + (1 << i)] - corner[c])*w >> APPROX_WEIGHT_BITS;
+    }
+    output[o] = (int)((corner[0] + (1 << (APPROX_WEIGHT_BITS - 1))) >> APPROX_WEIGHT_BITS);
+  }
+}
+
+/* Batched inference over contiguous arrays, input[i][s] is input i of sample s.
+   Each stage runs across a block of samples before the next one starts, degrees
+   are kept per mf in structure-of-arrays form. Fuzzification and rule evaluation
+   go through the kernel picked at initialize_system(), all kernels give
+   bit-identical results. No global state, no printf: a sample with no firing
+   rule or zero area gets output 0 as in defuzzification(). Output o of sample s
+   is output[s*NUMBER_OF_OUTPUT + o] */
+void evaluate_batch(const model_type *model, const int *const input[NUMBER_OF_INPUT],
+                    int *output, int count){
+  evaluate_batch_kernel(model,model->kernel,input,output,count);
+}
+
+void evaluate_batch_kernel(const model_type *model, int kernel, const int *const input[NUMBER_OF_INPUT],
+                           int *output, int count){
+  short mf_value[TOTAL_NUMBER_OF_MF][BATCH_BLOCK];
+  const int *block[NUMBER_OF_INPUT];
+  kernel_type fuzzify = kernel_function(kernel);
+  STATS_START(STATS_BATCH);
+#ifdef FUZZY_STATS
+  stats_local()->batch_samples += count;
+#endif
+  if(model->inference == INFERENCE_TSK){         /* the kernels aggregate output mfs, TSK has none */
+    int sample[NUMBER_OF_INPUT];
+    for(int s = 0; s < count; s++){
+      for(int i = 0; i < NUMBER_OF_INPUT; i++)sample[i] = input[i][s];
+      evaluate(model,sample,output + s*NUMBER_OF_OUTPUT);
+    }
+    STATS_STOP(STATS_BATCH,0);
+    return;
+  }
+  for(int base = 0; base < count; base += BATCH_BLOCK){
+    int n = count - base < BATCH_BLOCK ? count - base : BATCH_BLOCK;
+    for(int i = 0; i < NUMBER_OF_INPUT; i++)block[i] = input[i] + base;
+    fuzzify(model,block,0,n,mf_value);
+#ifdef FUZZY_STATS
+    stats_rule_block(model,mf_value,n);
+#endif
+    defuzzification_block(model,mf_value,n,output + base*NUMBER_OF_OUTPUT);
+  }
+  STATS_STOP(STATS_BATCH,0);
+}                                        /* END EVALUATE BATCH */
+
+kernel_type kernel_function(int kernel){
+#ifdef FUZZY_X86_SIMD
+  if(kernel == KERNEL_SSE2)return kernel_sse2;
+  if(kernel == KERNEL_AVX2)return kernel_avx2;
+#endif
+  return kernel_scalar;
+}
+
+/* defuzzification of n samples of a block, value/slope is done as a multiply
+   by the rounded-up reciprocal: exact for value <= UPPER_LIMIT and slope <= UPPER_LIMIT */
+void defuzzification_block(const model_type *model, short mf_value[][BATCH_BLOCK], int n, int *output){
+  int forOutputMf = FIRST_OUTPUT_MF;
+#ifdef FUZZY_STATS
+  unsigned char zero[BATCH_BLOCK] = {0};         /* sample has an output of zero area */
+#endif
+  for(int o = 0; o < NUMBER_OF_OUTPUT; o++){
+    int sum_of_products[BATCH_BLOCK];
+    int sum_of_areas[BATCH_BLOCK];
+    if(model->defuzzifier[o] != DEFUZZIFIER_AREA){
+      for(int s = 0; s < n; s++){
+        int degree[NUMBER_OF_MF];
+        int fired = 0;
+        for(int k = 0; k < NUMBER_OF_MF; k++)
+          fired |= degree[k] = mf_value[forOutputMf + o*NUMBER_OF_MF + k][s];
+        output[s*NUMBER_OF_OUTPUT + o] = fired ? defuzzify_output(model,model->defuzzifier[o],o,degree) : 0;
+#ifdef FUZZY_STATS
+        zero[s] |= !fired;
+#endif
+      }
+      continue;
+    }
+    memset(sum_of_products, 0, n*sizeof(int));
+    memset(sum_of_areas, 0, n*sizeof(int));
+    for(int i = forOutputMf + o*NUMBER_OF_MF; i < forOutputMf + (o+1)*NUMBER_OF_MF; i++){
+      const mf_type *mf = &model->mf[i];
+      const short *value = mf_value[i];
+      int base = mf->point2 - mf->point1;
+      int centroid = mf->point1 + base/2;
+      int reciprocal_1 = (65536 + mf->slope1 - 1)/mf->slope1;
+      int reciprocal_2 = (65536 + mf->slope2 - 1)/mf->slope2;
+      for(int s = 0; s < n; s++){
+        int top = base - ((value[s]*reciprocal_1) >> 16) - ((value[s]*reciprocal_2) >> 16);
+        int area = value[s]*(base+top)/2;
+        sum_of_products[s] += area*centroid;
+        sum_of_areas[s] += area;
+      }
+    }
+    for(int s = 0; s < n; s++){
+      output[s*NUMBER_OF_OUTPUT + o] = sum_of_areas[s] ? sum_of_products[s]/sum_of_areas[s] : 0;
+#ifdef FUZZY_STATS
+      zero[s] |= !sum_of_areas[s];
+#endif
+    }
+  }
+#ifdef FUZZY_STATS
+  {
+    int zeros = 0;
+    for(int s = 0; s < n; s++)zeros += zero[s];
+    stats_local()->zero_area += zeros;
+  }
+#endif
+}
+
+/* Step count instances through the shared model, BATCH_BLOCK at a time on
+   the batch kernels. Only the instances are written, so any number of
+   threads may step disjoint instances of one model at once, no locks.
+   Every rule concludes every output, so when no rule fires all output
+   degrees are 0 and both STATUS_NO_MATCH and STATUS_ZERO_AREA are set,
+   as fuzzification()/rule_evaluation()/defuzzification() would */
+void step_instances(const model_type *model, instance_type *instance, int count){
+  short mf_value[TOTAL_NUMBER_OF_MF][BATCH_BLOCK];
+  int input[NUMBER_OF_INPUT][BATCH_BLOCK];
+  int output[BATCH_BLOCK*NUMBER_OF_OUTPUT];
+  const int *block[NUMBER_OF_INPUT];
+  kernel_type fuzzify = kernel_function(model->kernel);
+  if(model->inference == INFERENCE_TSK){         /* one at a time, as evaluate_batch_kernel() */
+    for(int s = 0; s < count; s++){
+      context_type context;
+      get_system_inputs(&context,instance[s].value);
+      fuzzification(model,&context);
+      rule_evaluation(model,&context);
+      defuzzification(model,&context);
+      for(int k = 0; k < TOTAL_NUMBER_OF_MF; k++)instance[s].mf_value[k] = (unsigned char)context.mf_value[k];
+      for(int o = 0; o < NUMBER_OF_OUTPUT; o++)instance[s].value[NUMBER_OF_INPUT + o] = context.value[NUMBER_OF_INPUT + o];
+      instance[s].status = (unsigned char)context.status;
+    }
+    return;
+  }
+  for(int i = 0; i < NUMBER_OF_INPUT; i++)block[i] = input[i];
+  for(int base = 0; base < count; base += BATCH_BLOCK){
+    instance_type *current = instance + base;
+    int n = count - base < BATCH_BLOCK ? count - base : BATCH_BLOCK;
+    for(int s = 0; s < n; s++)
+      for(int i = 0; i < NUMBER_OF_INPUT; i++)input[i][s] = current[s].value[i];
+    fuzzify(model,block,0,n,mf_value);
+    defuzzification_block(model,mf_value,n,output);
+    for(int s = 0; s < n; s++){
+      int fired = 0;
+      for(int k = 0; k < TOTAL_NUMBER_OF_MF; k++)current[s].mf_value[k] = (unsigned char)mf_value[k][s];
+      for(int k = FIRST_OUTPUT_MF; k < TOTAL_NUMBER_OF_MF; k++)fired |= mf_value[k][s];
+      for(int o = 0; o < NUMBER_OF_OUTPUT; o++)current[s].value[NUMBER_OF_INPUT + o] = output[s*NUMBER_OF_OUTPUT + o];
+      current[s].status = fired ? 0 : STATUS_NO_MATCH | STATUS_ZERO_AREA;
+    }
+  }
+}                                        /* END STEP INSTANCES */
+
+/* scalar reference kernel, also finishes the tail the SIMD kernels leave */
+void kernel_scalar(const model_type *model, const int *const input[NUMBER_OF_INPUT],
+                   int from, int n, short mf_value[][BATCH_BLOCK]){
+  int forOutputMf = FIRST_OUTPUT_MF;
+  int k = 0;
+  for(int i = 0; i < NUMBER_OF_INPUT; i++){
+    const int *in = input[i];
+    for(int j = 0; j < NUMBER_OF_MF; j++){
+      const mf_type *mf = &model->mf[k];
+      short *value = mf_value[k];
+      for(int s = from; s < n; s++){
+        int delta_1 = in[s] - mf->point1;
+        int delta_2 = mf->point2 - in[s];
+        int v1 = mf->slope1*delta_1;
+        int v2 = mf->slope2*delta_2;
+        int v = v1 < v2 ? v1 : v2;
+        v = v < UPPER_LIMIT ? v : UPPER_LIMIT;
+        value[s] = v & -((delta_1>0)&(delta_2>0));
+      }
+      k++;
+    }
+  }
+  for(int i = forOutputMf; i < TOTAL_NUMBER_OF_MF; i++)
+    for(int s = from; s < n; s++)mf_value[i][s] = 0;
+  for(int i = 0; i < NUMBER_OF_RULE; i++){
+    const rule_type *rule = &model->ruleBase[i];
+    short strength[BATCH_BLOCK];
+    for(int s = from; s < n; s++)strength[s] = UPPER_LIMIT;
+    for(int j = 0; j < NUMBER_OF_IF_SIDE; j++){
+      const short *value = mf_value[rule->if_side[j]];
+      for(int s = from; s < n; s++)
+        strength[s] = value[s] < strength[s] ? value[s] : strength[s];
+    }
+    for(int j = 0; j < NUMBER_OF_THEN_SIDE; j++){
+      short *value = mf_value[rule->then_side[j]];
+      for(int s = from; s < n; s++)
+        value[s] = strength[s] > value[s] ? strength[s] : value[s];
+    }
+  }
+}                                        /* END KERNEL SCALAR */
+
+#ifdef FUZZY_X86_SIMD
+/* Packed 16-bit versions of kernel_scalar(), one lane per sample. Inputs are
+   narrowed with saturation and deltas are clamped to UPPER_LIMIT before the
+   multiply: slopes are at most UPPER_LIMIT, so the product fits 16 bits
+   unsigned and min(product, UPPER_LIMIT) is unchanged. */
+__attribute__((target("sse2")))
+void kernel_sse2(const model_type *model, const int *const input[NUMBER_OF_INPUT],
+                 int from, int n, short mf_value[][BATCH_BLOCK]){
+  int forOutputMf = FIRST_OUTPUT_MF;
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i limit = _mm_set1_epi16(UPPER_LIMIT);
+  int s;
+  for(s = from; s + 8 <= n; s += 8){
+    int k = 0;
+    for(int i = 0; i < NUMBER_OF_INPUT; i++){
+      __m128i x = _mm_packs_epi32(_mm_loadu_si128((const __m128i *)(input[i] + s)),
+                                  _mm_loadu_si128((const __m128i *)(input[i] + s + 4)));
+      for(int j = 0; j < NUMBER_OF_MF; j++){
+        const mf_type *mf = &model->mf[k];
+        __m128i delta_1 = _mm_subs_epi16(x, _mm_set1_epi16(mf->point1));
+        __m128i delta_2 = _mm_subs_epi16(_mm_set1_epi16(mf->point2), x);
+        __m128i inside = _mm_and_si128(_mm_cmpgt_epi16(delta_1, zero), _mm_cmpgt_epi16(delta_2, zero));
+        __m128i v1 = _mm_mullo_epi16(_mm_set1_epi16(mf->slope1), _mm_min_epi16(delta_1, limit));
+        __m128i v2 = _mm_mullo_epi16(_mm_set1_epi16(mf->slope2), _mm_min_epi16(delta_2, limit));
+        __m128i v = _mm_sub_epi16(v1, _mm_subs_epu16(v1, v2));      /* unsigned min */
+        v = _mm_sub_epi16(v, _mm_subs_epu16(v, limit));
+        _mm_storeu_si128((__m128i *)&mf_value[k][s], _mm_and_si128(v, inside));
+        k++;
+      }
+    }
+    __m128i out[NUMBER_OF_OUTPUT*NUMBER_OF_MF];
+    for(int j = 0; j < NUMBER_OF_OUTPUT*NUMBER_OF_MF; j++)out[j] = zero;
+    for(int i = 0; i < NUMBER_OF_RULE; i++){
+      const rule_type *rule = &model->ruleBase[i];
+      __m128i strength = limit;
+      for(int j = 0; j < NUMBER_OF_IF_SIDE; j++)
+        strength = _mm_min_epi16(strength, _mm_loadu_si128((const __m128i *)&mf_value[rule->if_side[j]][s]));
+      for(int j = 0; j < NUMBER_OF_THEN_SIDE; j++)
+        out[rule->then_side[j] - forOutputMf] = _mm_max_epi16(out[rule->then_side[j] - forOutputMf], strength);
+    }
+    for(int j = 0; j < NUMBER_OF_OUTPUT*NUMBER_OF_MF; j++)
+      _mm_storeu_si128((__m128i *)&mf_value[forOutputMf + j][s], out[j]);
+  }
+  kernel_scalar(model,input,s,n,mf_value);
+}                                        /* END KERNEL SSE2 */
+
+__attribute__((target("avx2")))
+void kernel_avx2(const model_type *model, const int *const input[NUMBER_OF_INPUT],
+                 int from, int n, short mf_value[][BATCH_BLOCK]){
+  int forOutputMf = FIRST_OUTPUT_MF;
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i limit = _mm256_set1_epi16(UPPER_LIMIT);
+  int s;
+  for(s = from; s + 16 <= n; s += 16){
+    int k = 0;
+    for(int i = 0; i < NUMBER_OF_INPUT; i++){
+      /* packs works per 128-bit lane, the permute puts samples back in order */
+      __m256i x = _mm256_packs_epi32(_mm256_loadu_si256((const __m256i *)(input[i] + s)),
+                                     _mm256_loadu_si256((const __m256i *)(input[i] + s + 8)));
+      x = _mm256_permute4x64_epi64(x, 0xD8);
+      for(int j = 0; j < NUMBER_OF_MF; j++){
+        const mf_type *mf = &model->mf[k];
+        __m256i delta_1 = _mm256_subs_epi16(x, _mm256_set1_epi16(mf->point1));
+        __m256i delta_2 = _mm256_subs_epi16(_mm256_set1_epi16(mf->point2), x);
+        __m256i inside = _mm256_and_si256(_mm256_cmpgt_epi16(delta_1, zero), _mm256_cmpgt_epi16(delta_2, zero));
+        __m256i v1 = _mm256_mullo_epi16(_mm256_set1_epi16(mf->slope1), _mm256_min_epi16(delta_1, limit));
+        __m256i v2 = _mm256_mullo_epi16(_mm256_set1_epi16(mf->slope2), _mm256_min_epi16(delta_2, limit));
+        __m256i v = _mm256_min_epu16(_mm256_min_epu16(v1, v2), limit);
+        _mm256_storeu_si256((__m256i *)&mf_value[k][s], _mm256_and_si256(v, inside));
+        k++;
+      }
+    }
+    __m256i out[NUMBER_OF_OUTPUT*NUMBER_OF_MF];
+    for(int j = 0; j < NUMBER_OF_OUTPUT*NUMBER_OF_MF; j++)out[j] = zero;
+    for(int i = 0; i < NUMBER_OF_RULE; i++){
+      const rule_type *rule = &model->ruleBase[i];
+      __m256i strength = limit;
+      for(int j = 0; j < NUMBER_OF_IF_SIDE; j++)
+        strength = _mm256_min_epi16(strength, _mm256_loadu_si256((const __m256i *)&mf_value[rule->if_side[j]][s]));
+      for(int j = 0; j < NUMBER_OF_THEN_SIDE; j++)
+        out[rule->then_side[j] - forOutputMf] = _mm256_max_epi16(out[rule->then_side[j] - forOutputMf], strength);
+    }
+    for(int j = 0; j < NUMBER_OF_OUTPUT*NUMBER_OF_MF; j++)
+      _mm256_storeu_si256((__m256i *)&mf_value[forOutputMf + j][s], out[j]);
+  }
+  kernel_scalar(model,input,s,n,mf_value);
+}                                        /* END KERNEL AVX2 */
+#endif
+
+int kernel_supported(int kernel){
+  if(kernel == KERNEL_SCALAR)return 1;
+#ifdef FUZZY_X86_SIMD
+  __builtin_cpu_init();
+  if(kernel == KERNEL_SSE2)return __builtin_cpu_supports("sse2");
+  if(kernel == KERNEL_AVX2)return __builtin_cpu_supports("avx2");
+#endif
+  return 0;
+}
+
+/* widest kernel this cpu runs (CPUID), scalar otherwise */
+int select_kernel(){
+  for(int kernel = NUMBER_OF_KERNEL - 1; kernel > KERNEL_SCALAR; kernel--)
+    if(kernel_supported(kernel))return kernel;
+  return KERNEL_SCALAR;
+}
+
+#ifdef FUZZY_THREADS
+/* threads - 1 new threads join the caller, returns the pool size actually started */
+int pool_start(pool_type *pool, int threads){
+  memset(pool, 0, sizeof(*pool));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  threads = threads < 1 ? 1 : (threads > MAX_THREADS ? MAX_THREADS : threads);
+  pool->threads = 1;
+  pool->worker[0].pool = pool;
+  for(int i = 1; i < threads; i++){
+    worker_type *worker = &pool->worker[i];
+    worker->pool = pool;
+    worker->id = i;
+    if(pthread_create(&worker->thread, NULL, worker_main, worker) != 0)break;
+    pool->threads++;
+  }
+  return pool->threads;
+}
+
+void pool_stop(pool_type *pool){
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for(int i = 1; i < pool->threads; i++)pthread_join(pool->worker[i].thread, NULL);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->done);
+}
+
+/* run task on units 0..units-1 and return when all are done. Every worker
+   starts with an even share; which thread runs a unit does not change what
+   the unit computes */
+void pool_run(pool_type *pool, task_type task, void *job, int units){
+  for(int i = 0; i < pool->threads; i++){
+    unsigned long long first = (unsigned long long)units*i/pool->threads;
+    unsigned long long end = (unsigned long long)units*(i + 1)/pool->threads;
+    atomic_store(&pool->worker[i].range, first << 32 | end);
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->task = task;
+  pool->job = job;
+  pool->busy = pool->threads - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  worker_drain(pool,0);
+  pthread_mutex_lock(&pool->lock);
+  while(pool->busy > 0)pthread_cond_wait(&pool->done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void *worker_main(void *argument){
+  worker_type *self = argument;
+  pool_type *pool = self->pool;
+  int seen = 0;
+  pthread_mutex_lock(&pool->lock);
+  for(;;){
+    while(pool->generation == seen && !pool->stop)pthread_cond_wait(&pool->wake, &pool->lock);
+    if(pool->stop)break;
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+    worker_drain(pool,self->id);
+    pthread_mutex_lock(&pool->lock);
+    if(--pool->busy == 0)pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+/* own units first, then steal until no worker has any left */
+void worker_drain(pool_type *pool, int id){
+  worker_type *self = &pool->worker[id];
+  for(;;){
+    unsigned long long range = atomic_load(&self->range);
+    unsigned int first = range >> 32;
+    unsigned int end = (unsigned int)range;
+    if(first < end){
+      if(atomic_compare_exchange_weak(&self->range, &range, (unsigned long long)(first + 1) << 32 | end))
+        pool->task(pool->job, first);
+      continue;
+    }
+    if(!worker_steal(pool,id))return;
+  }
+}
+
+/* Move the upper half of some other worker's units to this (empty) worker.
+   Units only ever move out of a range, so a packed value is never reused
+   and the compare-and-swap cannot be fooled (no ABA) */
+int worker_steal(pool_type *pool, int id){
+  for(int k = 1; k < pool->threads; k++){
+    worker_type *victim = &pool->worker[(id + k) % pool->threads];
+    unsigned long long range = atomic_load(&victim->range);
+    for(;;){
+      unsigned int first = range >> 32;
+      unsigned int end = (unsigned int)range;
+      unsigned int split = end - (end - first + 1)/2;
+      if(first >= end)break;
+      if(atomic_compare_exchange_weak(&victim->range, &range, (unsigned long long)first << 32 | split)){
+        atomic_store(&pool->worker[id].range, (unsigned long long)split << 32 | end);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+void batch_task(void *job, int unit){
+  const batch_job_type *batch = job;
+  const int *input[NUMBER_OF_INPUT];
+  int from = unit*PARALLEL_CHUNK;
+  int n = batch->count - from < PARALLEL_CHUNK ? batch->count - from : PARALLEL_CHUNK;
+  for(int i = 0; i < NUMBER_OF_INPUT; i++)input[i] = batch->input[i] + from;
+  evaluate_batch(batch->model,input,batch->output + (long)from*NUMBER_OF_OUTPUT,n);
+}
+
+void instance_task(void *job, int unit){
+  const instance_job_type *step = job;
+  int from = unit*PARALLEL_CHUNK;
+  int n = step->count - from < PARALLEL_CHUNK ? step->count - from : PARALLEL_CHUNK;
+  step_instances(step->model,step->instance + from,n);
+}
+
+/* step_instances() over a started pool, same result as one thread */
+void step_instances_parallel(pool_type *pool, const model_type *model, instance_type *instance, int count){
+  instance_job_type job = {model, instance, count};
+  pool_run(pool,instance_task,&job,(count + PARALLEL_CHUNK - 1)/PARALLEL_CHUNK);
+}
+
+/* evaluate_batch() spread over a started pool. Each thread keeps its degrees
+   on its own stack and writes only its own samples' outputs, the model is
+   only read: the result is bit-identical to evaluate_batch() for any pool
+   size and any schedule */
+void evaluate_batch_parallel(pool_type *pool, const model_type *model, const int *const input[NUMBER_OF_INPUT],
+                             int *output, int count){
+  batch_job_type job = {model, input, output, count};
+  pool_run(pool,batch_task,&job,(count + PARALLEL_CHUNK - 1)/PARALLEL_CHUNK);
+}
+
+/* unpublished copy of model, NULL when out of memory */
+model_version_type *new_model_version(const model_type *model){
+  model_version_type *version = aligned_alloc(64, sizeof(model_version_type));
+  if(version == NULL){
+    fprintf(stderr,"ERROR- Out of memory for a model version.\n");
+    return NULL;
+  }
+  version->model = *model;
+  version->version = 0;
+  version->retired_epoch = 0;
+  version->next_retired = NULL;
+  finish_model_version(version);
+  return version;
+}
+
+/* index, grid and degree rows after the mfs or rules of a version changed,
+   the engines and defuzzifiers stay those of the model it was copied from */
+void finish_model_version(model_version_type *version){
+  model_type *model = &version->model;
+  int rule_engine = model->rule_engine;
+  build_rule_index(model);
+  model->rule_engine = rule_engine;
+#ifdef FUZZY_RULE_GRID
+  build_rule_grid(model);
+#endif
+  if(model->engine == ENGINE_TABLE){
+    build_degree_table(model,&version->table);
+    select_engine(model,ENGINE_TABLE,&version->table);
+  }
+}
+
+/* base with the changes of a model file, NULL after reporting an error */
+model_version_type *load_model_version(const model_type *base, const char *filename){
+  model_version_type *version = new_model_version(base);
+  if(version == NULL)return NULL;
+  if(read_model_file(&version->model,filename) < 0){
+    free(version);
+    return NULL;
+  }
+  finish_model_version(version);
+  return version;
+}
+
+/* version 1 is a copy of model, -1 when out of memory */
+int live_start(live_model_type *live, const model_type *model){
+  model_version_type *first = new_model_version(model);
+  if(first == NULL)return -1;
+  first->version = 1;
+  atomic_init(&live->current, first);
+  atomic_init(&live->epoch, 1);
+  for(int r = 0; r < LIVE_READERS; r++){
+    atomic_init(&live->reader[r].epoch, 0);
+    atomic_init(&live->reader[r].in_use, 0);
+  }
+  pthread_mutex_init(&live->publish, NULL);
+  live->retired = NULL;
+  live->numberOfRetired = 0;
+  return 0;
+}
+
+/* every version is freed, no reader may be registered any more */
+void live_stop(live_model_type *live){
+  live_reclaim(live);
+  free(atomic_load(&live->current));
+  pthread_mutex_destroy(&live->publish);
+}
+
+/* reader slot of the calling thread, -1 when LIVE_READERS are in use */
+int live_register(live_model_type *live){
+  for(int r = 0; r < LIVE_READERS; r++){
+    int unused = 0;
+    if(atomic_compare_exchange_strong(&live->reader[r].in_use, &unused, 1))return r;
+  }
+  return -1;
+}
+
+void live_unregister(live_model_type *live, int slot){
+  atomic_store(&live->reader[slot].epoch, 0);
+  atomic_store(&live->reader[slot].in_use, 0);
+}
+
+/* Current version, usable until live_exit(). Wait-free: one load of the
+   epoch, one store to the reader's own line and one load of current. The
+   epoch load is an acquire so a reader seeing a new epoch also sees the
+   current stored before it; the store is sequentially consistent so a
+   publisher scanning the readers after its swap either sees it or the
+   reader loads the new version */
+const model_version_type *live_enter(live_model_type *live, int slot){
+  atomic_store(&live->reader[slot].epoch, atomic_load_explicit(&live->epoch, memory_order_acquire));
+  return atomic_load(&live->current);
+}
+
+void live_exit(live_model_type *live, int slot){
+  atomic_store_explicit(&live->reader[slot].epoch, 0, memory_order_release);
+}
+
+/* next replaces the current version for every later live_enter(), readers
+   inside keep the old one. Never waits for them: the old version is freed
+   by this or a later publish, or live_reclaim(), once they all left.
+   Returns the version number of next */
+long long live_publish(live_model_type *live, model_version_type *next){
+  model_version_type *old;
+  pthread_mutex_lock(&live->publish);
+  old = atomic_load_explicit(&live->current, memory_order_relaxed);
+  next->version = old->version + 1;
+  atomic_store(&live->current, next);
+  old->retired_epoch = atomic_fetch_add(&live->epoch, 1) + 1;
+  old->next_retired = live->retired;
+  live->retired = old;
+  live->numberOfRetired++;
+  live_reclaim_locked(live);
+  pthread_mutex_unlock(&live->publish);
+  return next->version;
+}
+
+/* frees what no reader can hold, returns the versions still waiting */
+int live_reclaim(live_model_type *live){
+  int waiting;
+  pthread_mutex_lock(&live->publish);
+  waiting = live_reclaim_locked(live);
+  pthread_mutex_unlock(&live->publish);
+  return waiting;
+}
+
+int live_reclaim_locked(live_model_type *live){
+  long long oldest = -1;                         /* epoch of the oldest reader inside, -1 none */
+  model_version_type **link = &live->retired;
+  for(int r = 0; r < LIVE_READERS; r++){
+    long long epoch = atomic_load(&live->reader[r].epoch);
+    if(epoch != 0 && (oldest < 0 || epoch < oldest))oldest = epoch;
+  }
+  while(*link != NULL){
+    model_version_type *version = *link;
+    if(oldest < 0 || oldest >= version->retired_epoch){
+      *link = version->next_retired;
+      free(version);
+      live->numberOfRetired--;
+    }
+    else link = &version->next_retired;
+  }
+  return live->numberOfRetired;
+}
+
+/* publishes filename over base when it changed since seen (modification
+   time to the nanosecond, size or inode). Returns the new version, 0 when unchanged, -1
+   after reporting a bad file, which is not looked at again until it changes */
+long long live_reload(live_model_type *live, const model_type *base, const char *filename, struct stat *seen){
+  struct stat now;
+  model_version_type *version;
+  if(stat(filename,&now) != 0){
+    fprintf(stderr,"ERROR- Unable to open model file named %s.\n",filename);
+    return -1;
+  }
+  if(now.st_mtim.tv_sec == seen->st_mtim.tv_sec && now.st_mtim.tv_nsec == seen->st_mtim.tv_nsec &&
+     now.st_size == seen->st_size && now.st_ino == seen->st_ino)return 0;
+  *seen = now;
+  version = load_model_version(base,filename);
+  if(version == NULL)return -1;
+  return live_publish(live,version);
+}
+
+void latency_add(latency_type *latency, long long ns){
+  int shift = 0;
+  ns = ns < 0 ? 0 : ns;
+  while((ns >> shift) >= (2 << LATENCY_SUB_BITS))shift++;
+  latency->bucket[ns < (1 << LATENCY_SUB_BITS) ? ns : ((shift + 1) << LATENCY_SUB_BITS) +
+                  ((ns >> shift) & ((1 << LATENCY_SUB_BITS) - 1))]++;
+  latency->count++;
+}
+
+/* lowest latency of the bucket holding the given fraction of the counts */
+long long latency_percentile(const latency_type *latency, double fraction){
+  long long rank = (long long)(fraction*latency->count);
+  long long seen = 0;
+  for(int b = 0; b < LATENCY_BUCKETS; b++){
+    seen += latency->bucket[b];
+    if(seen > rank || (seen == latency->count && seen > 0)){
+      if(b < (1 << LATENCY_SUB_BITS))return b;
+      return (long long)((b & ((1 << LATENCY_SUB_BITS) - 1)) | (1 << LATENCY_SUB_BITS)) <<
+             ((b >> LATENCY_SUB_BITS) - 1);
+    }
+  }
+  return 0;
+}
+
+/* 0 when the ring is full */
+int ring_push(ring_type *ring, pipeline_batch_type *batch){
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  if(tail - atomic_load_explicit(&ring->head, memory_order_acquire) == PIPELINE_DEPTH)return 0;
+  ring->slot[tail % PIPELINE_DEPTH] = batch;
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  return 1;
+}
+
+/* NULL when the ring is empty */
+pipeline_batch_type *ring_pop(ring_type *ring){
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  pipeline_batch_type *batch;
+  if(head == atomic_load_explicit(&ring->tail, memory_order_acquire))return NULL;
+  batch = ring->slot[head % PIPELINE_DEPTH];
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return batch;
+}
+
+/* push, yielding while the ring is full (backpressure), the wait is
+   counted in stalls and stalled. The batch is the consumer's once pushed */
+void ring_push_wait(ring_type *ring, pipeline_batch_type *batch, long long *stalls, long long *stalled){
+  long long start = now_nanoseconds();
+  long long now = start;
+  batch->queued = now;
+  if(ring_push(ring,batch))return;
+  (*stalls)++;
+  do{
+    sched_yield();
+    now = now_nanoseconds();
+    batch->queued = now;
+  }while(!ring_push(ring,batch));
+  *stalled += now - start;
+}
+
+/* -1 when out of memory or no thread could be started */
+int pipeline_start(pipeline_type *pipeline, const model_type *model){
+  memset(pipeline, 0, sizeof(*pipeline));
+  pipeline->model = model;
+  pipeline->batch = aligned_alloc(64, PIPELINE_BATCHES*sizeof(pipeline_batch_type));
+  if(pipeline->batch == NULL){
+    fprintf(stderr,"ERROR- Out of memory for the pipeline.\n");
+    return -1;
+  }
+  for(int b = 0; b < PIPELINE_BATCHES; b++)pipeline->free_batch[b] = &pipeline->batch[b];
+  pipeline->numberOfFree = PIPELINE_BATCHES;
+  for(int s = 0; s < NUMBER_OF_PIPELINE_STAGE; s++){
+    stage_type *stage = &pipeline->stage[s];
+    stage->pipeline = pipeline;
+    stage->id = STATS_FUZZIFICATION + s;
+    if(pthread_create(&stage->thread, NULL, stage_main, stage) != 0){
+      fprintf(stderr,"ERROR- Unable to start the pipeline threads.\n");
+      pipeline_stop(pipeline);
+      return -1;
+    }
+    pipeline->started++;
+  }
+  return 0;
+}
+
+/* sends the end of the stream after the batches in flight, which are
+   dropped, and joins the stages. After a failed pipeline_start() the
+   stages that did start are told to stop instead. The counters stay
+   readable */
+void pipeline_stop(pipeline_type *pipeline){
+  if(pipeline->started == NUMBER_OF_PIPELINE_STAGE){
+    pipeline_batch_type *end;
+    while((end = pipeline_batch(pipeline)) == NULL)pipeline_release(pipeline,pipeline_collect(pipeline,1));
+    end->count = 0;
+    pipeline_submit(pipeline,end);
+    while((end = pipeline_collect(pipeline,1))->count != 0)pipeline_release(pipeline,end);
+    pipeline_release(pipeline,end);
+  }
+  else atomic_store(&pipeline->stop, 1);        /* nothing was submitted, every started stage idles */
+  for(int s = 0; s < pipeline->started; s++)pthread_join(pipeline->stage[s].thread, NULL);
+  pipeline->started = 0;
+  free(pipeline->batch);
+  pipeline->batch = NULL;
+}
+
+void *stage_main(void *argument){
+  stage_type *stage = argument;
+  pipeline_type *pipeline = stage->pipeline;
+  const model_type *model = pipeline->model;
+  int s = stage->id - STATS_FUZZIFICATION;
+  for(;;){
+    pipeline_batch_type *batch;
+    long long start;
+    int last;
+    while((batch = ring_pop(&pipeline->ring[s])) == NULL){
+      if(atomic_load_explicit(&pipeline->stop, memory_order_relaxed))return NULL;
+      sched_yield();
+    }
+    start = now_nanoseconds();
+    last = batch->count == 0;
+    if(!last){
+      latency_add(&stage->wait,start - batch->queued);
+      for(int k = 0; k < batch->count; k++){
+        context_type *context = &batch->context[k];
+        if(stage->id == STATS_FUZZIFICATION){
+          for(int i = 0; i < NUMBER_OF_INPUT; i++)context->value[i] = batch->input[i][k];
+          fuzzification(model,context);
+        }
+        else if(stage->id == STATS_RULE_EVALUATION)rule_evaluation(model,context);
+        else defuzzification(model,context);
+      }
+      latency_add(&stage->service,now_nanoseconds() - start);
+      stage->batches++;
+    }
+    ring_push_wait(&pipeline->ring[s + 1],batch,&stage->stalls,&stage->stalled);
+    if(last)return NULL;
+  }
+}
+
+/* a batch to fill, NULL while all are in flight: pipeline_collect() one */
+pipeline_batch_type *pipeline_batch(pipeline_type *pipeline){
+  if(pipeline->numberOfFree == 0)return NULL;
+  return pipeline->free_batch[--pipeline->numberOfFree];
+}
+
+/* batch->count samples of batch->input[][] into the first stage, waits
+   while it is full */
+void pipeline_submit(pipeline_type *pipeline, pipeline_batch_type *batch){
+  batch->submitted = now_nanoseconds();
+  ring_push_wait(&pipeline->ring[0],batch,&pipeline->stalls,&pipeline->stalled);
+}
+
+/* the oldest batch out of the last stage, outputs and status in
+   context[], in submit order. Without wait NULL if none is done yet */
+pipeline_batch_type *pipeline_collect(pipeline_type *pipeline, int wait){
+  pipeline_batch_type *batch;
+  while((batch = ring_pop(&pipeline->ring[NUMBER_OF_PIPELINE_STAGE])) == NULL){
+    if(!wait)return NULL;
+    sched_yield();
+  }
+  if(batch->count > 0)latency_add(&pipeline->total,now_nanoseconds() - batch->submitted);
+  return batch;
+}
+
+void pipeline_release(pipeline_type *pipeline, pipeline_batch_type *batch){
+  pipeline->free_batch[pipeline->numberOfFree++] = batch;
+}
+#endif
+
+#ifdef FUZZY_HOSTED
+/* move the unconsumed bytes to the front and read up to a full buffer,
+   returns the bytes now available */
+int reader_fill(reader_type *reader){
+  size_t got;
+  memmove(reader->buffer, reader->buffer + reader->next, reader->end - reader->next);
+  reader->end -= reader->next;
+  reader->next = 0;
+  if(reader->eof)return reader->end;
+  got = fread(reader->buffer + reader->end, 1, STREAM_BUFFER - reader->end, reader->fp);
+  reader->end += (int)got;
+  if(reader->end < STREAM_BUFFER)reader->eof = 1;
+  return reader->end;
+}
+
+/* up to max samples of columns values (NUMBER_OF_INPUT, or with the
+   outputs NUMBER_OF_INPUT_OUTPUT) into column[value][sample], returns how
+   many. Bad input is reported on stderr and sets reader->error */
+int read_block(reader_type *reader, int format, int *column[], int columns, int max){
+  int count = 0;
+  int sample[NUMBER_OF_INPUT_OUTPUT];
+  while(count < max){
+    if(format == FORMAT_RAW){
+      const int size = 4*columns;
+      const unsigned char *b;
+      if(reader->end - reader->next < size && reader_fill(reader) < size){
+        if(reader->end == 0)break;
+        fprintf(stderr,"ERROR- Raw input ends inside a sample (%d of %d bytes).\n",reader->end,size);
+        reader->error = 1;
+        break;
+      }
+      b = reader->buffer + reader->next;
+      for(int i = 0; i < columns; i++, b += 4)
+        column[i][count] = (int)((unsigned int)b[0] | (unsigned int)b[1] << 8 |
+                                 (unsigned int)b[2] << 16 | (unsigned int)b[3] << 24);
+      reader->next += size;
+      count++;
+    }
+    else{
+      unsigned char *start = reader->buffer + reader->next;
+      unsigned char *newline = memchr(start, '\n', reader->end - reader->next);
+      unsigned char *end;
+      int values;
+      if(newline == NULL){
+        reader_fill(reader);
+        start = reader->buffer;
+        newline = memchr(start, '\n', reader->end);
+        if(newline == NULL && !reader->eof){
+          fprintf(stderr,"ERROR- Line %lld is longer than %d bytes.\n",reader->line,STREAM_BUFFER);
+          reader->error = 1;
+          break;
+        }
+        if(newline == NULL && reader->end == 0)break;
+      }
+      end = newline ? newline : reader->buffer + reader->end;
+      reader->next = (int)(end - reader->buffer) + (newline != NULL);
+      values = read_csv_line(reader,start,end,sample,columns);
+      reader->line++;
+      if(values < 0){
+        reader->error = 1;
+        break;
+      }
+      if(values == 0)continue;                   /* blank line or header */
+      for(int i = 0; i < columns; i++)column[i][count] = sample[i];
+      count++;
+    }
+  }
+  return count;
+}                                        /* END READ BLOCK */
+
+/* one csv line of columns values, returns columns, 0 for a blank line or
+   the header of line 1, or -1 */
+int read_csv_line(reader_type *reader, const unsigned char *p, const unsigned char *end, int sample[], int columns){
+  int values = 0;
+  while(p < end && (*p == ' ' || *p == '\t' || *p == '\r'))p++;
+  if(p == end)return 0;
+  if(reader->line == 1 && *p != '-' && *p != '+' && (*p < '0' || *p > '9'))return 0;
+  while(p < end){
+    int negative = 0;
+    int value = 0;
+    int digits = 0;
+    if(values == columns){
+      fprintf(stderr,"ERROR- Line %lld has more than %d values.\n",reader->line,columns);
+      return -1;
+    }
+    if(*p == '-' || *p == '+')negative = *p++ == '-';
+    for(; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+      if(digits < 9)value = value*10 + (*p - '0');
+    if(digits == 0 || digits > 9){
+      fprintf(stderr,"ERROR- Line %lld, value %d is not a number in range.\n",reader->line,values + 1);
+      return -1;
+    }
+    sample[values++] = negative ? -value : value;
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\r'))p++;
+    if(p < end && *p == ',')p++;
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\r'))p++;
+  }
+  if(values != columns){
+    fprintf(stderr,"ERROR- Line %lld has %d values, %d expected.\n",reader->line,values,columns);
+    return -1;
+  }
+  return values;
+}                                        /* END READ CSV LINE */
+
+void writer_flush(writer_type *writer){
+  fwrite(writer->buffer, 1, writer->used, writer->fp);
+  writer->used = 0;
+}
+
+/* one value, the last of a sample ends the csv line */
+void write_value(writer_type *writer, int value, int last){
+  char *out;
+  if(writer->used > STREAM_BUFFER - 16)writer_flush(writer);
+  out = writer->buffer + writer->used;
+  if(writer->format == FORMAT_RAW){
+    unsigned int bits = (unsigned int)value;
+    for(int b = 0; b < 4; b++, bits >>= 8)*out++ = (char)(bits & 0xff);
+  }
+  else{
+    char digit[12];
+    int n = 0;
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+    if(value < 0)*out++ = '-';
+    do{
+      digit[n++] = (char)('0' + magnitude % 10);
+      magnitude /= 10;
+    }while(magnitude);
+    while(n)*out++ = digit[--n];
+    *out++ = last ? '\n' : ',';
+  }
+  writer->used = (int)(out - writer->buffer);
+}
+
+/* Changes to a compiled model, one per line, '#' starts a comment:
+     mf <input/output> <mf> <p1> <p2> <p3> <p4>    the four points, as point[][]
+     rule <name> <name> ...                        one line of rule[][]
+   Rule lines replace the whole rule base, NUMBER_OF_RULE of them in order.
+   Returns -1 after putting the first error on stderr, model is then
+   partly changed */
+int read_model_file(model_type *model, const char *filename){
+  FILE *fp = fopen(filename,"r");
+  char line[MODEL_LINE];
+  char (*word)[NUMBER_OF_INPUT_OUTPUT][MODEL_WORD] = malloc(NUMBER_OF_RULE*sizeof(*word));
+  char *(*table)[NUMBER_OF_INPUT_OUTPUT] = malloc(NUMBER_OF_RULE*sizeof(*table));
+  int numberOfRule = 0;
+  int lineNumber = 0;
+  int result = 0;
+  if(fp == NULL || word == NULL || table == NULL){
+    if(fp == NULL)fprintf(stderr,"ERROR- Unable to open model file named %s.\n",filename);
+    else fprintf(stderr,"ERROR- Out of memory for the model file.\n");
+    result = -1;
+  }
+  while(result == 0 && fgets(line,sizeof(line),fp)){
+    char keyword[8], rest[2];
+    int offset, length;
+    lineNumber++;
+    line[strcspn(line,"#\r\n")] = 0;
+    if(sscanf(line,"%7s%n",keyword,&offset) != 1)continue;
+    if(strcmp(keyword,"mf")==0){
+      char io[MODEL_WORD], mfName[MODEL_WORD];
+      int p[4];
+      int i = 0, k = -1;
+      if(sscanf(line + offset,"%63s %63s %d %d %d %d %1s",io,mfName,&p[0],&p[1],&p[2],&p[3],rest) == 6){
+        while(i < NUMBER_OF_INPUT_OUTPUT && strcmp(model->inputOutput[i].name,io) != 0)i++;
+        if(i < NUMBER_OF_INPUT_OUTPUT)k = find_mf(model,i,mfName);
+      }
+      if(k < 0 || set_mf_points(&model->mf[k],p) < 0){
+        fprintf(stderr,"ERROR- Line %d of %s, bad membership function.\n",lineNumber,filename);
+        result = -1;
+      }
+    }
+    else if(strcmp(keyword,"rule")==0){
+      if(numberOfRule == NUMBER_OF_RULE){
+        fprintf(stderr,"ERROR- Line %d of %s, more than %d rules.\n",lineNumber,filename,NUMBER_OF_RULE);
+        result = -1;
+        break;
+      }
+      for(int j = 0; j < NUMBER_OF_INPUT_OUTPUT && result == 0; j++, offset += length){
+        if(sscanf(line + offset,"%63s%n",word[numberOfRule][j],&length) != 1)result = -1;
+        table[numberOfRule][j] = word[numberOfRule][j];
+      }
+      if(result < 0 || sscanf(line + offset,"%1s",rest) == 1){
+        fprintf(stderr,"ERROR- Line %d of %s, a rule needs %d names.\n",lineNumber,filename,NUMBER_OF_INPUT_OUTPUT);
+        result = -1;
+      }
+      numberOfRule++;
+    }
+    else{
+      fprintf(stderr,"ERROR- Line %d of %s is neither mf nor rule.\n",lineNumber,filename);
+      result = -1;
+    }
+  }
+  if(result == 0 && numberOfRule != 0 && numberOfRule != NUMBER_OF_RULE){
+    fprintf(stderr,"ERROR- %s has %d rules, %d expected.\n",filename,numberOfRule,NUMBER_OF_RULE);
+    result = -1;
+  }
+  if(result == 0 && numberOfRule != 0)result = compile_rules(model,table,stderr);
+  if(fp != NULL)fclose(fp);
+  free(word);
+  free(table);
+  return result;
+}
+
+/* "run [-i csv|raw] [-o csv|raw] [-t level] [-j threads] [-s] [-w model] [-p] [file]":
+   samples from the file or stdin ("-") to stdout, STREAM_BLOCK at a time
+   through evaluate_batch() (evaluate_batch_parallel() with -j). Trace levels
+   TRACE_STATUS and TRACE_DUMP evaluate one sample at a time. -s puts the
+   FUZZY_STATS counters at the end. -w applies a read_model_file() file and
+   republishes it whenever it changes, checked between blocks, a block is
+   evaluated on one version. -p runs the three stages as a pipeline_type
+   instead and puts its latencies at the end. Errors go to stderr so stdout
+   stays data */
+int run_stream(const model_type *model, int argc, char *argv[]){
+  static reader_type reader;
+  static writer_type writer;
+  int *column[NUMBER_OF_INPUT];
+  int *output = malloc((size_t)STREAM_BLOCK*NUMBER_OF_OUTPUT*sizeof(int));
+  int *samples = malloc((size_t)STREAM_BLOCK*NUMBER_OF_INPUT*sizeof(int));
+  int in = FORMAT_CSV;
+  int trace = TRACE_NONE;
+  int threads = 1;
+  int result = 0;
+  int usage = 0;
+  int stats = 0;
+  int pipelined = 0;
+  long long count = 0, no_match = 0, zero_area = 0;
+  const char *filename = NULL;
+  const char *watch = NULL;
+  const model_type *active = model;
+#ifdef FUZZY_THREADS
+  static pool_type pool;
+  static live_model_type live;
+  struct stat seen = {0};
+  int slot = -1;
+#endif
+  writer.fp = stdout;
+  writer.format = FORMAT_CSV;
+  for(int a = 0; a < argc; a++){
+    const char *value = a + 1 < argc ? argv[a + 1] : "";
+    if(strcmp(argv[a],"-i")==0 || strcmp(argv[a],"-o")==0){
+      int format = strcmp(value,"raw")==0 ? FORMAT_RAW : strcmp(value,"csv")==0 ? FORMAT_CSV : -1;
+      if(format < 0)usage = 1;
+      else if(argv[a][1] == 'i')in = format;
+      else writer.format = format;
+      a++;
+    }
+    else if(strcmp(argv[a],"-t")==0){
+      trace = atoi(value);
+      a++;
+    }
+    else if(strcmp(argv[a],"-j")==0){
+      threads = atoi(value);
+      a++;
+    }
+    else if(strcmp(argv[a],"-s")==0)stats = 1;
+    else if(strcmp(argv[a],"-p")==0)pipelined = 1;
+    else if(strcmp(argv[a],"-w")==0){
+      watch = value;
+      a++;
+    }
+    else if(filename == NULL && (argv[a][0] != '-' || strcmp(argv[a],"-")==0))filename = argv[a];
+    else usage = 1;
+  }
+  if(usage || trace < TRACE_NONE || trace > TRACE_DUMP || threads < 1 ||
+     (pipelined && (trace != TRACE_NONE || threads > 1 || watch != NULL))){
+    fprintf(stderr,"usage: run [-i csv|raw] [-o csv|raw] [-t 0|1|2] [-j threads] [-s] [-w model] [-p] [file]\n");
+    if(pipelined)fprintf(stderr,"       -p goes without -t, -j and -w\n");
+    free(output);
+    free(samples);
+    return 1;
+  }
+#ifndef FUZZY_THREADS
+  if(threads > 1 || watch != NULL || pipelined){
+    fprintf(stderr,"ERROR- Built without threads, -j, -w and -p not available.\n");
+    free(output);
+    free(samples);
+    return 1;
+  }
+#endif
+#ifndef FUZZY_STATS
+  if(stats){
+    fprintf(stderr,"ERROR- Built without FUZZY_STATS, -s not available.\n");
+    free(output);
+    free(samples);
+    return 1;
+  }
+#endif
+  if(output == NULL || samples == NULL){
+    fprintf(stderr,"ERROR- Out of memory for the stream buffers.\n");
+    free(output);
+    free(samples);
+    return 1;
+  }
+  reader.fp = filename == NULL || strcmp(filename,"-")==0 ? stdin : fopen(filename, in == FORMAT_RAW ? "rb" : "r");
+  if(reader.fp == NULL){
+    fprintf(stderr,"ERROR- Unable to open data file named %s.\n",filename);
+    free(output);
+    free(samples);
+    return 1;
+  }
+  reader.line = 1;
+  for(int i = 0; i < NUMBER_OF_INPUT; i++)column[i] = samples + i*STREAM_BLOCK;
+#ifdef FUZZY_THREADS
+  if(watch != NULL){
+    int started = live_start(&live,model) == 0;
+    if(!started || live_reload(&live,model,watch,&seen) < 0){
+      if(started)live_stop(&live);
+      if(reader.fp != stdin)fclose(reader.fp);
+      free(output);
+      free(samples);
+      return 1;
+    }
+    slot = live_register(&live);
+  }
+  if(threads > 1 && trace == TRACE_NONE)threads = pool_start(&pool,threads);
+  else threads = 1;
+  if(pipelined && (count = stream_pipeline(model,&reader,in,&writer)) < 0){
+    count = 0;
+    result = 1;
+  }
+#endif
+  while(!pipelined){
+    int n = read_block(&reader,in,column,NUMBER_OF_INPUT,STREAM_BLOCK);
+    if(n == 0)break;
+#ifdef FUZZY_THREADS
+    if(watch != NULL){
+      long long version = live_reload(&live,model,watch,&seen);
+      if(version > 0)fprintf(stderr,"%s is version %lld\n",watch,version);
+      active = &live_enter(&live,slot)->model;
+    }
+#endif
+    if(trace != TRACE_NONE){
+      for(int s = 0; s < n; s++){
+        context_type context;
+        for(int i = 0; i < NUMBER_OF_INPUT; i++)context.value[i] = column[i][s];
+        fuzzification(active,&context);
+        rule_evaluation(active,&context);
+        defuzzification(active,&context);
+        if(trace == TRACE_DUMP){
+          writer_flush(&writer);
+          put_system_outputs(active,&context);
+        }
+        for(int o = 0; o < NUMBER_OF_OUTPUT; o++)write_value(&writer,context.value[NUMBER_OF_INPUT + o],0);
+        write_value(&writer,context.status,1);
+        no_match += (context.status & STATUS_NO_MATCH) != 0;
+        zero_area += (context.status & STATUS_ZERO_AREA) != 0;
+      }
+      count += n;
+#ifdef FUZZY_THREADS
+      if(watch != NULL)live_exit(&live,slot);
+#endif
+      if(reader.error)break;
+      continue;
+    }
+#ifdef FUZZY_THREADS
+    if(threads > 1)evaluate_batch_parallel(&pool,active,(const int *const *)column,output,n);
+    else
+#endif
+    evaluate_batch(active,(const int *const *)column,output,n);
+    for(int s = 0; s < n*NUMBER_OF_OUTPUT; s++)
+      write_value(&writer,output[s],(s + 1) % NUMBER_OF_OUTPUT == 0);
+    count += n;
+#ifdef FUZZY_THREADS
+    if(watch != NULL)live_exit(&live,slot);
+#endif
+    if(reader.error)break;
+  }
+  writer_flush(&writer);
+  fflush(stdout);
+  if(ferror(stdout)){
+    fprintf(stderr,"ERROR- Writing the outputs failed.\n");
+    result = 1;
+  }
+  if(reader.error || ferror(reader.fp))result = 1;
+  if(trace != TRACE_NONE)
+    fprintf(stderr,"%lld samples, %lld with no matching rule, %lld with zero area\n",count,no_match,zero_area);
+#ifdef FUZZY_THREADS
+  if(threads > 1)pool_stop(&pool);
+  if(watch != NULL){
+    live_unregister(&live,slot);
+    live_stop(&live);
+  }
+#endif
+#ifdef FUZZY_STATS
+  if(stats){
+    static stats_type snapshot;
+    stats_snapshot(&snapshot);
+    put_stats(stderr,model,&snapshot);
+  }
+#endif
+  if(reader.fp != stdin)fclose(reader.fp);
+  free(output);
+  free(samples);
+  return result;
+}                                        /* END RUN STREAM */
+
+double now_seconds(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+long long now_nanoseconds(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/* next pseudo-random sample, two inputs per step of the generator */
+void random_inputs(unsigned int *seed, int input[NUMBER_OF_INPUT]){
+  for(int i = 0; i < NUMBER_OF_INPUT; i++){
+    if(i % 2 == 0)*seed = *seed*1103515245u + 12345u;
+    input[i] = (*seed >> (8 + 8*(i % 2))) & UPPER_LIMIT;
+  }
+}
+
+/* "approx [budget ...]": for each error budget (default 0 1 2 4 8 16) the
+   smallest approx_type found, its size, its maximum error against
+   evaluate() and the speed of both. The error is over every input when
+   the domain has up to APPROX_EXHAUSTIVE outputs, otherwise over random
+   inputs other than the ones the table was built on */
+int run_approx(const model_type *model, int argc, char *argv[]){
+  enum { count = 1 << 20 };
+  int defaults[] = {0, 1, 2, 4, 8, 16};
+  int numberOfBudget = argc > 0 ? argc : (int)(sizeof(defaults)/sizeof(defaults[0]));
+  int (*sample)[NUMBER_OF_INPUT] = malloc((size_t)count*sizeof(*sample));
+  approx_check_type check, fresh;
+  unsigned int seed = 777;
+  long long checksum = 0;
+  double t0, exact_rate;
+  int result = 0;
+  if(sample == NULL || approx_check_start(model,&check,12345) < 0){
+    printf("ERROR- Out of memory for the approximation.\n");
+    free(sample);
+    return 1;
+  }
+  if(!check.exhaustive && approx_check_start(model,&fresh,54321) < 0){
+    printf("ERROR- Out of memory for the approximation.\n");
+    approx_check_free(&check);
+    free(sample);
+    return 1;
+  }
+  for(int s = 0; s < count; s++)random_inputs(&seed,sample[s]);
+  t0 = now_seconds();
+  for(int s = 0; s < count; s++){
+    int output[NUMBER_OF_OUTPUT];
+    evaluate(model,sample[s],output);
+    checksum += output[0];
+  }
+  exact_rate = count/(now_seconds() - t0);
+  printf("evaluate         %.0f samples/sec\n",exact_rate);
+  printf("checked on       %lld inputs, %s\n",check.count,check.exhaustive ? "the whole domain" : "random, error measured on others");
+  for(int b = 0; b < numberOfBudget; b++){
+    int budget = argc > 0 ? atoi(argv[b]) : defaults[b];
+    approx_type approx;
+    int error;
+    t0 = now_seconds();
+    if(budget < 0 || build_approx_checked(model,&check,&approx,budget) < 0){
+      printf("budget %-9d no table of at most %d values found\n",budget,APPROX_MAX_TABLE);
+      result = 1;
+      continue;
+    }
+    printf("budget %-9d knots",budget);
+    for(int i = 0; i < NUMBER_OF_INPUT; i++)printf("%s%d",i ? "x" : " ",approx.numberOfKnot[i]);
+    printf(", %u bytes, built in %.1f ms\n",(unsigned)(approx.size*NUMBER_OF_OUTPUT*sizeof(int) +
+           sizeof(approx.cell) + sizeof(approx.weight)),(now_seconds() - t0)*1e3);
+    error = check.exhaustive ? approx.max_error : approx_scan(&approx,&fresh,-1,0,UPPER_LIMIT,NULL,NULL);
+    t0 = now_seconds();
+    for(int s = 0; s < count; s++){
+      int output[NUMBER_OF_OUTPUT];
+      approx_evaluate(model,&approx,sample[s],output);
+      checksum += output[0];
+    }
+    printf("                 max error %d, %.0f samples/sec (x%.1f)\n",error,
+           count/(now_seconds() - t0),count/(now_seconds() - t0)/exact_rate);
+    if(error > budget)result = 1;
+    free_approx(&approx);
+  }
+  printf("checksum         %lld\n",checksum);
+  approx_check_free(&check);
+  if(!check.exhaustive)approx_check_free(&fresh);
+  free(sample);
+  return result;
+}
+
+/* every sample of a csv file of inputs then wanted outputs, -1 after an
+   error on stderr or for a file without samples */
+int read_dataset(dataset_type *data, const char *filename){
+  static reader_type reader;
+  int *column[NUMBER_OF_INPUT_OUTPUT];
+  int capacity = 0;
+  memset(data, 0, sizeof(*data));
+  memset(&reader, 0, sizeof(reader));
+  reader.fp = strcmp(filename,"-")==0 ? stdin : fopen(filename,"r");
+  if(reader.fp == NULL){
+    fprintf(stderr,"ERROR- Unable to open data file named %s.\n",filename);
+    return -1;
+  }
+  reader.line = 1;
+  for(;;){
+    int n;
+    if(data->count + STREAM_BLOCK > capacity){
+      capacity = capacity ? 2*capacity : STREAM_BLOCK;
+      for(int i = 0; i < NUMBER_OF_INPUT_OUTPUT; i++){
+        int *grown = realloc(data->column[i], (size_t)capacity*sizeof(int));
+        if(grown == NULL){
+          fprintf(stderr,"ERROR- Out of memory for the data set.\n");
+          reader.error = 1;
+          break;
+        }
+        data->column[i] = grown;
+      }
+      if(reader.error)break;
+    }
+    for(int i = 0; i < NUMBER_OF_INPUT_OUTPUT; i++)column[i] = data->column[i] + data->count;
+    n = read_block(&reader,FORMAT_CSV,column,NUMBER_OF_INPUT_OUTPUT,STREAM_BLOCK);
+    data->count += n;
+    if(n == 0 || reader.error)break;
+  }
+  if(reader.fp != stdin)fclose(reader.fp);
+  if(!reader.error && data->count == 0)fprintf(stderr,"ERROR- %s has no samples.\n",filename);
+  if(reader.error || data->count == 0){
+    free_dataset(data);
+    return -1;
+  }
+  return 0;
+}
+
+void free_dataset(dataset_type *data){
+  for(int i = 0; i < NUMBER_OF_INPUT_OUTPUT; i++)free(data->column[i]);
+  memset(data, 0, sizeof(*data));
+}
+
+/* base is the mf points and consequents model was compiled with */
+void tune_start(tuner_type *tuner, const model_type *model, const dataset_type *data, int cost){
+  int forOutputMf = FIRST_OUTPUT_MF;
+  memset(tuner, 0, sizeof(*tuner));
+  tuner->model = model;
+  tuner->data = data;
+  tuner->cost = cost;
+  tuner->numberOfMf = model->inference == INFERENCE_TSK ? NUMBER_OF_INPUT*NUMBER_OF_MF : TOTAL_NUMBER_OF_MF;
+  tuner->numberOfConsequent = model->inference == INFERENCE_TSK ? 0 : NUMBER_OF_RULE*NUMBER_OF_OUTPUT;
+  for(int k = 0; k < TOTAL_NUMBER_OF_MF; k++)
+    memcpy(tuner->base.point[k], model->mf[k].point, sizeof(tuner->base.point[k]));
+  for(int i = 0; i < NUMBER_OF_RULE; i++)
+    for(int o = 0; o < NUMBER_OF_OUTPUT; o++)
+      tuner->base.consequent[i][o] = (unsigned char)(model->ruleBase[i].then_side[o] - forOutputMf - o*NUMBER_OF_MF);
+}
+
+/* model (a scratch copy, last set to some other candidate) changed to
+   candidate: slopes of the mfs whose points differ and the consequents.
+   -1 for points set_mf_points() refuses, the mfs set before stay set */
+int apply_candidate(const tuner_type *tuner, const candidate_type *candidate, model_type *model){
+  int forOutputMf = FIRST_OUTPUT_MF;
+  for(int k = 0; k < tuner->numberOfMf; k++)
+    if(memcmp(candidate->point[k], model->mf[k].point, sizeof(candidate->point[k])) != 0 &&
+       set_mf_points(&model->mf[k],candidate->point[k]) < 0)return -1;
+  for(int i = 0; i < NUMBER_OF_RULE && tuner->numberOfConsequent; i++)
+    for(int o = 0; o < NUMBER_OF_OUTPUT; o++)
+      model->ruleBase[i].then_side[o] = forOutputMf + o*NUMBER_OF_MF + candidate->consequent[i][o];
+  return 0;
+}
+
+/* COST_ of model over the whole data set, outputs of all samples count alike */
+double candidate_cost(const tuner_type *tuner, const model_type *model){
+  const dataset_type *data = tuner->data;
+  int output[TUNE_CHUNK*NUMBER_OF_OUTPUT];
+  const int *input[NUMBER_OF_INPUT];
+  double sum = 0;
+  long long worst = 0;
+  for(int base = 0; base < data->count; base += TUNE_CHUNK){
+    int n = data->count - base < TUNE_CHUNK ? data->count - base : TUNE_CHUNK;
+    for(int i = 0; i < NUMBER_OF_INPUT; i++)input[i] = data->column[i] + base;
+    evaluate_batch(model,input,output,n);
+    for(int o = 0; o < NUMBER_OF_OUTPUT; o++){
+      const int *target = data->column[NUMBER_OF_INPUT + o] + base;
+      long long squares = 0, absolute = 0;
+      for(int s = 0; s < n; s++){
+        long long error = (long long)output[s*NUMBER_OF_OUTPUT + o] - target[s];
+        squares += error*error;
+        absolute += error < 0 ? -error : error;
+        worst = error > worst ? error : (-error > worst ? -error : worst);
+      }
+      sum += tuner->cost == COST_MSE ? (double)squares : (double)absolute;
+    }
+  }
+  if(tuner->cost == COST_MAX)return (double)worst;
+  return sum/((double)data->count*NUMBER_OF_OUTPUT);
+}
+
+/* pool unit: costs of the candidates it claims, on scratch[unit] */
+void tune_task(void *job, int unit){
+  tuner_type *tuner = job;
+  model_type *model = &tuner->scratch[unit];
+  for(;;){
+#ifdef FUZZY_THREADS
+    int c = atomic_fetch_add(&tuner->next, 1);
+#else
+    int c = tuner->next++;
+#endif
+    if(c >= tuner->count)break;
+    tuner->candidate[c].cost = apply_candidate(tuner,&tuner->candidate[c],model) < 0 ? TUNE_INVALID
+                                                                                     : candidate_cost(tuner,model);
+  }
+}
+
+/* costs of count candidates, one pool unit per worker */
+void score_candidates(tuner_type *tuner, candidate_type *candidate, int count){
+  tuner->candidate = candidate;
+  tuner->count = count;
+#ifdef FUZZY_THREADS
+  atomic_store(&tuner->next, 0);
+  if(tuner->pool != NULL && tuner->pool->threads > 1)pool_run(tuner->pool,tune_task,tuner,tuner->pool->threads);
+  else
+#else
+  tuner->next = 0;
+#endif
+  tune_task(tuner,0);
+  tuner->evaluations += count;
+}
+
+/* point which of p moved by delta, clipped so the points stay in order
+   and in 0-UPPER_LIMIT. Returns 0 if it could not move */
+int move_point(int p[4], int which, int delta){
+  int low = which == 0 ? 0 : p[which - 1] + (which != 2);
+  int high = which == 3 ? UPPER_LIMIT : p[which + 1] - (which != 1);
+  int value = p[which] + delta;
+  value = value < low ? low : (value > high ? high : value);
+  if(value == p[which])return 0;
+  p[which] = value;
+  return 1;
+}
+
+/* one to three random changes: a point by up to step either way or a
+   consequent to a neighbouring mf */
+void mutate_candidate(const tuner_type *tuner, candidate_type *candidate, unsigned int *seed, int step){
+  int changes = 1 + (int)((*seed = *seed*1103515245u + 12345u) >> 16) % 3;
+  int parameters = 4*tuner->numberOfMf + tuner->numberOfConsequent;
+  for(int c = 0; c < changes; c++){
+    int which, delta;
+    *seed = *seed*1103515245u + 12345u;
+    which = (int)((*seed >> 8) % (unsigned)parameters);
+    *seed = *seed*1103515245u + 12345u;
+    delta = 1 + (int)((*seed >> 16) % (unsigned)step);
+    if(*seed & 0x100)delta = -delta;
+    if(which < 4*tuner->numberOfMf)move_point(candidate->point[which/4],which % 4,delta);
+    else{
+      unsigned char *mf = &candidate->consequent[0][0] + (which - 4*tuner->numberOfMf);
+      int next = *mf + (delta < 0 ? -1 : 1);
+      if(next >= 0 && next < NUMBER_OF_MF)*mf = (unsigned char)next;
+    }
+  }
+}
+
+/* from with one point moved by step, or one consequent by one mf, either
+   way, into out. Returns how many, at most 8*numberOfMf + 2*numberOfConsequent */
+int neighbour_candidates(const tuner_type *tuner, const candidate_type *from, candidate_type *out, int step){
+  int count = 0;
+  for(int k = 0; k < tuner->numberOfMf; k++)
+    for(int which = 0; which < 4; which++)
+      for(int d = -1; d <= 1; d += 2){
+        out[count] = *from;
+        if(move_point(out[count].point[k],which,d*step))count++;
+      }
+  for(int c = 0; c < tuner->numberOfConsequent; c++)
+    for(int d = -1; d <= 1; d += 2){
+      int next = (&from->consequent[0][0])[c] + d;
+      if(next < 0 || next >= NUMBER_OF_MF)continue;
+      out[count] = *from;
+      (&out[count].consequent[0][0])[c] = (unsigned char)next;
+      count++;
+    }
+  return count;
+}
+
+/* Search from tuner->base for the candidate of lowest cost, puts the best
+   cost of every generation. Mutations come from one generator on the
+   calling thread, a run gives the same result for any number of threads.
+     SEARCH_GRID    all neighbour_candidates(), the best replaces the
+                    current one, step halves when none is better, stops
+                    after step 1
+     SEARCH_RANDOM  population mutations of the best so far
+     SEARCH_EVOLVE  population kept, the best survives, the others are
+                    uniform crossovers (per mf and per consequent) of two
+                    three-way tournament winners, then mutated
+   Returns -1 when out of memory */
+int tune(tuner_type *tuner, int search, int generations, int population, candidate_type *best){
+  int size = search == SEARCH_GRID ? 8*tuner->numberOfMf + 2*tuner->numberOfConsequent : population;
+  candidate_type *current = malloc((size_t)size*sizeof(candidate_type));
+  candidate_type *next = malloc((size_t)size*sizeof(candidate_type));
+  unsigned int seed = 2017;
+  int step = TUNE_STEP;
+  int units = 1;
+#ifdef FUZZY_THREADS
+  if(tuner->pool != NULL)units = tuner->pool->threads;
+#endif
+  tuner->scratch = malloc((size_t)units*sizeof(model_type));
+  if(current == NULL || next == NULL || tuner->scratch == NULL){
+    free(current);
+    free(next);
+    free(tuner->scratch);
+    tuner->scratch = NULL;
+    return -1;
+  }
+  for(int u = 0; u < units; u++)tuner->scratch[u] = *tuner->model;
+  *best = tuner->base;
+  score_candidates(tuner,best,1);
+  printf("generation %4d  cost %.4f\n",0,best->cost);
+  if(search == SEARCH_EVOLVE){
+    current[0] = *best;
+    for(int c = 1; c < population; c++){
+      current[c] = *best;
+      mutate_candidate(tuner,&current[c],&seed,step);
+    }
+    score_candidates(tuner,current + 1,population - 1);
+  }
+  for(int g = 1; g <= generations; g++){
+    int count = population;
+    int improved = 0;
+    if(search == SEARCH_GRID)count = neighbour_candidates(tuner,best,next,step);
+    else if(search == SEARCH_RANDOM){
+      for(int c = 0; c < count; c++){
+        next[c] = *best;
+        mutate_candidate(tuner,&next[c],&seed,step);
+      }
+    }
+    else{
+      next[0] = *best;
+      for(int c = 1; c < count; c++){
+        const candidate_type *parent[2];
+        for(int p = 0; p < 2; p++){
+          parent[p] = NULL;
+          for(int t = 0; t < 3; t++){
+            const candidate_type *entrant;
+            seed = seed*1103515245u + 12345u;
+            entrant = &current[(seed >> 8) % (unsigned)count];
+            if(parent[p] == NULL || entrant->cost < parent[p]->cost)parent[p] = entrant;
+          }
+        }
+        for(int k = 0; k < TOTAL_NUMBER_OF_MF; k++){
+          seed = seed*1103515245u + 12345u;
+          memcpy(next[c].point[k], parent[(seed >> 16) & 1]->point[k], sizeof(next[c].point[k]));
+        }
+        for(int r = 0; r < NUMBER_OF_RULE; r++)
+          for(int o = 0; o < NUMBER_OF_OUTPUT; o++){
+            seed = seed*1103515245u + 12345u;
+            next[c].consequent[r][o] = parent[(seed >> 16) & 1]->consequent[r][o];
+          }
+        mutate_candidate(tuner,&next[c],&seed,step);
+      }
+    }
+    if(count > 0)score_candidates(tuner,search == SEARCH_EVOLVE ? next + 1 : next,search == SEARCH_EVOLVE ? count - 1 : count);
+    for(int c = 0; c < count; c++)
+      if(next[c].cost < best->cost){
+        *best = next[c];
+        improved = 1;
+      }
+    if(search == SEARCH_EVOLVE){
+      candidate_type *swap = current;
+      current = next;
+      next = swap;
+    }
+    else if(!improved && (search == SEARCH_GRID || step > 1))step /= 2;
+    printf("generation %4d  cost %.4f  %d candidates\n",g,best->cost,count);
+    if(step == 0)break;                          /* SEARCH_GRID: no move of one improves */
+  }
+  free(current);
+  free(next);
+  free(tuner->scratch);
+  tuner->scratch = NULL;
+  return 0;
+}
+
+/* the tuned points (and rules, Mamdani only) as a read_model_file() file */
+void put_model_file(FILE *fp, const model_type *model, const candidate_type *candidate){
+  int forOutputMf = FIRST_OUTPUT_MF;
+  int mfs = model->inference == INFERENCE_TSK ? NUMBER_OF_INPUT*NUMBER_OF_MF : TOTAL_NUMBER_OF_MF;
+  fprintf(fp,"# cost %.4f\n",candidate->cost);
+  for(int k = 0; k < mfs; k++)
+    fprintf(fp,"mf %s %s %d %d %d %d\n",model->inputOutput[k/NUMBER_OF_MF].name,model->mf[k].name,
+            candidate->point[k][0],candidate->point[k][1],candidate->point[k][2],candidate->point[k][3]);
+  for(int i = 0; i < NUMBER_OF_RULE && model->inference == INFERENCE_MAMDANI; i++){
+    fprintf(fp,"rule");
+    for(int j = 0; j < NUMBER_OF_IF_SIDE; j++)fprintf(fp," %s",model->mf[model->ruleBase[i].if_side[j]].name);
+    for(int o = 0; o < NUMBER_OF_OUTPUT; o++)
+      fprintf(fp," %s",model->mf[forOutputMf + o*NUMBER_OF_MF + candidate->consequent[i][o]].name);
+    fprintf(fp,"\n");
+  }
+}
+
+/* "tune [-s grid|random|evolve] [-g generations] [-n population] [-j threads]
+   [-c mse|mae|max] [-o model] data.csv": tunes the mf
+   points and rule consequents against a csv of inputs then wanted outputs,
+   held in memory for every candidate. Puts the cost of each generation and
+   candidates and samples per second, -o writes the best as a model file
+   for "run -w". TSK consequents are not tuned, their input mfs are */
+int run_tune(const model_type *model, int argc, char *argv[]){
+  static const char *searchName[NUMBER_OF_SEARCH] = {"grid", "random", "evolve"};
+  static const char *costName[NUMBER_OF_COST] = {"mse", "mae", "max"};
+  static tuner_type tuner;
+  static candidate_type best;
+  dataset_type data;
+  int search = SEARCH_GRID;
+  int cost = COST_MSE;
+  int generations = 50;
+  int population = 64;
+  int threads = 1;
+  int usage = 0;
+  int result = 0;
+  const char *filename = NULL;
+  const char *modelName = NULL;
+  double t0, seconds;
+#ifdef FUZZY_THREADS
+  static pool_type pool;
+#endif
+  for(int a = 0; a < argc; a++){
+    const char *value = a + 1 < argc ? argv[a + 1] : "";
+    if(strcmp(argv[a],"-s")==0 || strcmp(argv[a],"-c")==0){
+      int found = -1;
+      for(int k = 0; k < (argv[a][1] == 's' ? NUMBER_OF_SEARCH : NUMBER_OF_COST); k++)
+        if(strcmp(value, argv[a][1] == 's' ? searchName[k] : costName[k])==0)found = k;
+      if(found < 0)usage = 1;
+      else if(argv[a][1] == 's')search = found;
+      else cost = found;
+      a++;
+    }
+    else if(strcmp(argv[a],"-g")==0 || strcmp(argv[a],"-n")==0 || strcmp(argv[a],"-j")==0){
+      int number = atoi(value);
+      if(argv[a][1] == 'g')generations = number;
+      else if(argv[a][1] == 'n')population = number;
+      else threads = number;
+      a++;
+    }
+    else if(strcmp(argv[a],"-o")==0){
+      modelName = value;
+      a++;
+    }
+    else if(filename == NULL && (argv[a][0] != '-' || strcmp(argv[a],"-")==0))filename = argv[a];
+    else usage = 1;
+  }
+  if(usage || filename == NULL || generations < 0 || population < 2 || threads < 1){
+    fprintf(stderr,"usage: tune [-s grid|random|evolve] [-g generations] [-n population] [-j threads] "
+                   "[-c mse|mae|max] [-o model] data.csv\n");
+    return 1;
+  }
+#ifndef FUZZY_THREADS
+  if(threads > 1){
+    fprintf(stderr,"ERROR- Built without threads, -j not available.\n");
+    return 1;
+  }
+#endif
+  if(read_dataset(&data,filename) < 0)return 1;
+  tune_start(&tuner,model,&data,cost);
+#ifdef FUZZY_THREADS
+  if(threads > 1){
+    threads = pool_start(&pool,threads);
+    tuner.pool = &pool;
+  }
+#endif
+  printf("%d samples, %d mfs and %d consequents tuned, %s search, %s cost, %d thread(s)\n",data.count,
+         tuner.numberOfMf,tuner.numberOfConsequent,searchName[search],costName[cost],threads);
+  t0 = now_seconds();
+  if(tune(&tuner,search,generations,population,&best) < 0){
+    fprintf(stderr,"ERROR- Out of memory for the candidates.\n");
+    result = 1;
+  }
+  seconds = now_seconds() - t0;
+#ifdef FUZZY_THREADS
+  if(tuner.pool != NULL)pool_stop(&pool);
+#endif
+  if(result == 0){
+    printf("%lld candidates in %.2f s, %.0f candidates/sec, %.3g samples/sec\n",tuner.evaluations,seconds,
+           tuner.evaluations/seconds,(double)tuner.evaluations*data.count/seconds);
+    if(modelName != NULL){
+      FILE *fp = fopen(modelName,"w");
+      if(fp == NULL){
+        fprintf(stderr,"ERROR- Unable to write model file named %s.\n",modelName);
+        result = 1;
+      }
+      else{
+        put_model_file(fp,model,&best);
+        if(fclose(fp) != 0)result = 1;
+      }
+    }
+  }
+  free_dataset(&data);
+  return result;
+}                                        /* END RUN TUNE */
+
+#ifdef FUZZY_SURFACE
+/* "surface": build (unless compiled in), verify and time the lookup table */
+int run_surface(const model_type *model){
+  const int count = 1 << 24;
+  unsigned int seed = 12345;
+  unsigned int checksum = 0;
+  double t0, t1;
+  int mismatch;
+  t0 = now_seconds();
+#ifndef FUZZY_SURFACE_FILE
+  build_surface(model,surfaceTable);
+#endif
+  t1 = now_seconds();
+#ifdef FUZZY_SURFACE_FILE
+  printf("surface table    const, generated offline\n");
+#else
+  printf("surface build    %.3f ms\n",(t1-t0)*1e3);
+#endif
+  printf("surface memory   %u bytes\n",(unsigned)sizeof(surfaceTable));
+  mismatch = verify_surface(model,surfaceTable);
+  printf("surface verify   %d of %d entries differ from the live engine\n",
+         mismatch,SURFACE_SIZE*SURFACE_SIZE);
+  t0 = now_seconds();
+  for(int s = 0; s < count; s++){
+    seed = seed*1103515245u + 12345u;
+    checksum += surface_lookup(surfaceTable,(seed >> 8) & UPPER_LIMIT,(seed >> 16) & UPPER_LIMIT);
+  }
+  t1 = now_seconds();
+  printf("surface lookup   %.0f samples/sec (checksum %u)\n",count/(t1-t0),checksum);
+  return mismatch ? 1 : 0;
+}
+
+/* "surface-emit": the table as C source for -DFUZZY_SURFACE_FILE */
+void emit_surface(const model_type *model){
+  static unsigned char table[SURFACE_SIZE][SURFACE_SIZE];
+  build_surface(model,table);
+  printf("/* generated by \"FuzzyLogic surface-emit\", do not edit */\n");
+  printf("const unsigned char surfaceTable[SURFACE_SIZE][SURFACE_SIZE] = {\n");
+  for(int i = 0; i < SURFACE_SIZE; i++){
+    printf("  {");
+    for(int j = 0; j < SURFACE_SIZE; j++)
+      printf("%d%s%s",table[i][j],j + 1 < SURFACE_SIZE ? "," : "",(j % 32 == 31 && j + 1 < SURFACE_SIZE) ? "\n   " : "");
+    printf("}%s\n",i + 1 < SURFACE_SIZE ? "," : "");
+  }
+  printf("};\n");
+}
+
+/* "specialize-emit": straight-line C for the current model, same arithmetic
+   as fuzzification()/rule_evaluation()/defuzzification() with the list walk,
+   so the result is bit-identical to evaluate() */
+void emit_specialized(const model_type *model){
+  int forOutputMf = FIRST_OUTPUT_MF;
+  int used[TOTAL_NUMBER_OF_MF] = {0};
+  printf("/* generated by \"FuzzyLogic specialize-emit\", do not edit */\n");
+  printf("#define SPECIALIZED_MIN(a, b) ((a) < (b) ? (a) : (b))\n");
+  printf("#define SPECIALIZED_MAX(a, b) ((a) > (b) ? (a) : (b))\n");
+  printf("#define SPECIALIZED_DEGREE(x, point1, point2, slope1, slope2) \\\n");
+  printf("  (((x) - (point1) <= 0 || (point2) - (x) <= 0) ? 0 : \\\n");
+  printf("   SPECIALIZED_MIN(SPECIALIZED_MIN((slope1)*((x) - (point1)), (slope2)*((point2) - (x))), %d))\n",UPPER_LIMIT);
+  printf("#define SPECIALIZED_AREA(value, base, slope1, slope2) \\\n");
+  printf("  ((value)*((base) + (base) - (value)/(slope1) - (value)/(slope2))/2)\n\n");
+  printf("SPECIALIZED_CODE\nint specialized_evaluate(");
+  for(int i = 0; i < NUMBER_OF_INPUT; i++)printf("%sint input%d",i ? ", " : "",i + 1);
+  printf("){\n");
+  for(int i = 0; i < NUMBER_OF_RULE; i++)
+    for(int j = 0; j < NUMBER_OF_IF_SIDE; j++)used[model->ruleBase[i].if_side[j]] = 1;
+  for(int k = 0; k < TOTAL_NUMBER_OF_MF; k++){
+    const mf_type *mf = &model->mf[k];
+    if(k < forOutputMf && !used[k])continue;
+    if(k < forOutputMf)
+      printf("  int m%d = SPECIALIZED_DEGREE(input%d, %d, %d, %d, %d);   /* %s %s */\n",k,k/NUMBER_OF_MF + 1,
+             mf->point1,mf->point2,mf->slope1,mf->slope2,model->inputOutput[k/NUMBER_OF_MF].name,mf->name);
+    else
+      printf("  int m%d = 0;   /* %s %s */\n",k,model->inputOutput[k/NUMBER_OF_MF].name,mf->name);
+  }
+  printf("  int strength, sum_of_products, sum_of_areas, area;\n");
+  for(int i = 0; i < NUMBER_OF_RULE; i++){
+    const rule_type *rule = &model->ruleBase[i];
+    printf("  strength = %d;\n",UPPER_LIMIT);
+    for(int j = 0; j < NUMBER_OF_IF_SIDE; j++)
+      printf("  strength = SPECIALIZED_MIN(strength, m%d);\n",rule->if_side[j]);
+    for(int k = 0; k < NUMBER_OF_THEN_SIDE; k++)
+      printf("  m%d = SPECIALIZED_MAX(strength, m%d);   /* rule #%d */\n",rule->then_side[k],rule->then_side[k],i + 1);
+  }
+  printf("  sum_of_products = 0;\n  sum_of_areas = 0;\n");
+  for(int k = forOutputMf; k < TOTAL_NUMBER_OF_MF; k++){
+    const mf_type *mf = &model->mf[k];
+    printf("  area = SPECIALIZED_AREA(m%d, %d, %d, %d);\n",k,mf->point2 - mf->point1,mf->slope1,mf->slope2);
+    printf("  sum_of_products += area*%d;\n  sum_of_areas += area;\n",mf->point1 + (mf->point2 - mf->point1)/2);
+  }
+  printf("  return sum_of_areas ? sum_of_products/sum_of_areas : 0;\n}\n");
+}
+
+/* "bench-specialized": generated engine against the generic one */
+int benchmark_specialized(const model_type *model){
+#ifdef FUZZY_SPECIALIZED_FILE
+  const int count = 1 << 22;
+  unsigned int checksum[2] = {0, 0};
+  unsigned int seed;
+  double t0, t1, t2;
+  int mismatch = 0;
+  for(int i = 0; i < SURFACE_SIZE; i++)
+    for(int j = 0; j < SURFACE_SIZE; j++)
+      if(specialized_evaluate(i,j) != evaluate_pair(model,i,j))mismatch++;
+  seed = 12345;
+  t0 = now_seconds();
+  for(int s = 0; s < count; s++){
+    seed = seed*1103515245u + 12345u;
+    checksum[0] += evaluate_pair(model,(seed >> 8) & UPPER_LIMIT,(seed >> 16) & UPPER_LIMIT);
+  }
+  t1 = now_seconds();
+  seed = 12345;
+  for(int s = 0; s < count; s++){
+    seed = seed*1103515245u + 12345u;
+    checksum[1] += specialized_evaluate((seed >> 8) & UPPER_LIMIT,(seed >> 16) & UPPER_LIMIT);
+  }
+  t2 = now_seconds();
+  printf("%-12s %12s %12s %12s\n","engine","ns/sample","model RAM","code bytes");
+#ifdef FUZZY_CODE_SECTIONS
+  printf("%-12s %12.1f %12u %12ld\n","generic",(t1-t0)*1e9/count,(unsigned)sizeof(model_type),
+         (long)(__stop_fuzzy_generic - __start_fuzzy_generic));
+  printf("%-12s %12.1f %12u %12ld\n","specialized",(t2-t1)*1e9/count,0u,
+         (long)(__stop_fuzzy_specialized - __start_fuzzy_specialized));
+#else
+  printf("%-12s %12.1f %12u %12s\n","generic",(t1-t0)*1e9/count,(unsigned)sizeof(model_type),"n/a");
+  printf("%-12s %12.1f %12u %12s\n","specialized",(t2-t1)*1e9/count,0u,"n/a");
+#endif
+  printf("mismatches       %d of %d input pairs\n",mismatch + (checksum[0] != checksum[1]),SURFACE_SIZE*SURFACE_SIZE);
+  return mismatch ? 1 : 0;
+#else
+  (void)model;
+  printf("ERROR- build with -DFUZZY_SPECIALIZED_FILE=\\\"specialized.h\\\" from \"FuzzyLogic specialize-emit\".\n");
+  return 1;
+#endif
+}
+
+#endif
+
+#ifdef FUZZY_THREADS
+/* "bench-parallel [threads]": evaluate_batch_parallel() from 1 to all cores
+   (or the given number of threads), checked against evaluate_batch() */
+int benchmark_parallel(const model_type *model, int max_threads){
+  const int count = 1 << 22;
+  int *samples = malloc((size_t)count*NUMBER_OF_INPUT*sizeof(int));
+  int *reference = malloc((size_t)count*NUMBER_OF_OUTPUT*sizeof(int));
+  int *parallel = malloc((size_t)count*NUMBER_OF_OUTPUT*sizeof(int));
+  const int *input[NUMBER_OF_INPUT];
+  int sample[NUMBER_OF_INPUT];
+  static pool_type pool;
+  unsigned int seed = 12345;
+  double t0, t1, base_rate = 0;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int mismatch = 0;
+  if(!samples || !reference || !parallel){
+    printf("ERROR- Out of memory for benchmark.\n");
+    return 1;
+  }
+  if(max_threads <= 0)max_threads = cores > 0 ? (int)cores : 1;
+  for(int s = 0; s < count; s++){
+    random_inputs(&seed,sample);
+    for(int i = 0; i < NUMBER_OF_INPUT; i++)samples[i*count + s] = sample[i];
+  }
+  for(int i = 0; i < NUMBER_OF_INPUT; i++)input[i] = samples + i*count;
+  evaluate_batch(model,input,reference,count);
+  printf("samples          %d, %ld cores online, kernel %s\n",count,cores,kernelName[model->kernel]);
+  for(int threads = 1; threads <= max_threads && threads <= MAX_THREADS; threads++){
+    int mismatch_threads = 0;
+    int started = pool_start(&pool,threads);
+    memset(parallel, 0, (size_t)count*NUMBER_OF_OUTPUT*sizeof(int));
+    t0 = now_seconds();
+    evaluate_batch_parallel(&pool,model,input,parallel,count);
+    t1 = now_seconds();
+    pool_stop(&pool);
+    for(int s = 0; s < count*NUMBER_OF_OUTPUT; s++)if(parallel[s] != reference[s])mismatch_threads++;
+    if(threads == 1)base_rate = count/(t1-t0);
+    printf("threads %-8d %.0f samples/sec (x%.2f), %d mismatches\n",started,count/(t1-t0),
+           count/(t1-t0)/base_rate,mismatch_threads);
+    mismatch += mismatch_threads;
+  }
+  free(samples);
+  free(reference);
+  free(parallel);
+  return mismatch ? 1 : 0;
+}
+
+/* "bench-reload [readers]": readers evaluate through a live model, one
+   live_enter() per sample, while the main thread publishes a new version
+   every RELOAD_PERIOD microseconds, alternating the model and a mirrored
+   twin. Each output is checked against the version the reader entered,
+   a torn or freed version shows as a mismatch */
+#define RELOAD_SAMPLES              4096
+#define RELOAD_PERIOD               100
+int benchmark_reload(const model_type *model, int readers){
+  static int sample[RELOAD_SAMPLES][NUMBER_OF_INPUT];
+  static int expected[2][RELOAD_SAMPLES*NUMBER_OF_OUTPUT];
+  static live_model_type live;
+  pthread_t thread[MAX_THREADS];
+  reload_job_type job[MAX_THREADS];
+  atomic_int stop;
+  model_version_type *twin = new_model_version(model);
+  unsigned int seed = 12345;
+  double t0, t1, direct_rate;
+  long long mismatch = 0;
+  if(twin == NULL || live_start(&live,model) < 0)return 1;
+  readers = readers < 1 ? 1 : (readers > MAX_THREADS ? MAX_THREADS : readers);
+  for(int i = 0; i < NUMBER_OF_RULE; i++)        /* every consequent mirrored, and the TSK ones negated */
+    for(int o = 0; o < NUMBER_OF_OUTPUT; o++){
+      int first = FIRST_OUTPUT_MF + o*NUMBER_OF_MF;
+      twin->model.ruleBase[i].then_side[o] = first + NUMBER_OF_MF - 1 - (twin->model.ruleBase[i].then_side[o] - first);
+      for(int j = 0; j <= NUMBER_OF_INPUT; j++)twin->model.tskCoefficient[i][o][j] = -twin->model.tskCoefficient[i][o][j];
+    }
+  finish_model_version(twin);
+  for(int s = 0; s < RELOAD_SAMPLES; s++){
+    random_inputs(&seed,sample[s]);
+    evaluate(model,sample[s],expected[1] + s*NUMBER_OF_OUTPUT);
+    evaluate(&twin->model,sample[s],expected[0] + s*NUMBER_OF_OUTPUT);
+  }
+  t0 = now_seconds();
+  for(int repeat = 0; repeat < 256; repeat++)
+    for(int s = 0; s < RELOAD_SAMPLES; s++){
+      int output[NUMBER_OF_OUTPUT];
+      evaluate(model,sample[s],output);
+      mismatch += output[0] != expected[1][s*NUMBER_OF_OUTPUT];
+    }
+  direct_rate = 256.0*RELOAD_SAMPLES/(now_seconds() - t0);
+  printf("readers          %d, %d samples, %u bytes per version\n",readers,RELOAD_SAMPLES,
+         (unsigned)sizeof(model_version_type));
+  printf("direct           %.0f evaluations/sec, one thread\n",direct_rate);
+  for(int reload = 0; reload <= 1; reload++){
+    long long evaluations = 0, published = 0;
+    int started = 0, most_waiting = 0;
+    atomic_init(&stop, 0);
+    t1 = now_seconds();
+    for(int r = 0; r < readers; r++){
+      job[r] = (reload_job_type){&live, (const int (*)[NUMBER_OF_INPUT])sample, {expected[0], expected[1]}, &stop, 0, 0};
+      if(pthread_create(&thread[r], NULL, reload_reader, &job[r]) != 0)break;
+      started++;
+    }
+    t0 = now_seconds();
+    do{
+      struct timespec pause = {0, RELOAD_PERIOD*1000};
+      nanosleep(&pause, NULL);
+      if(reload){
+        model_version_type *next = new_model_version(published % 2 ? model : &twin->model);
+        if(next == NULL)break;
+        live_publish(&live,next);
+        published++;
+        pthread_mutex_lock(&live.publish);
+        if(live.numberOfRetired > most_waiting)most_waiting = live.numberOfRetired;
+        pthread_mutex_unlock(&live.publish);
+      }
+      t1 = now_seconds();
+    }while(t1 - t0 < 1.0);
+    atomic_store(&stop, 1);
+    for(int r = 0; r < started; r++){
+      pthread_join(thread[r], NULL);
+      evaluations += job[r].evaluations;
+      mismatch += job[r].mismatches;
+    }
+    printf("%-16s %.0f evaluations/sec (x%.2f)",reload ? "live, reloading" : "live",
+           evaluations/(t1 - t0),evaluations/(t1 - t0)/direct_rate);
+    if(reload)printf(", %lld versions published, at most %d waiting, %d after the readers left",
+                     published,most_waiting,live_reclaim(&live));
+    printf("\n");
+  }
+  printf("mismatches       %lld\n",mismatch);
+  live_stop(&live);
+  free(twin);
+  return mismatch ? 1 : 0;
+}
+
+void *reload_reader(void *argument){
+  reload_job_type *job = argument;
+  int slot = live_register(job->live);
+  int s = 0;
+  if(slot < 0)return NULL;
+  while(!atomic_load_explicit(job->stop, memory_order_relaxed)){
+    const model_version_type *version = live_enter(job->live,slot);
+    const int *expected = job->expected[version->version & 1] + s*NUMBER_OF_OUTPUT;
+    int output[NUMBER_OF_OUTPUT];
+    evaluate(&version->model,job->sample[s],output);
+    live_exit(job->live,slot);
+    for(int o = 0; o < NUMBER_OF_OUTPUT; o++)job->mismatches += output[o] != expected[o];
+    job->evaluations++;
+    s = (s + 1) % RELOAD_SAMPLES;
+  }
+  live_unregister(job->live,slot);
+  return NULL;
+}
+
+/* run_stream() -p: reads PIPELINE_BATCH samples at a time into free
+   batches, writes out the finished ones as they come, in order. Returns
+   the samples written, -1 if the pipeline did not start */
+long long stream_pipeline(const model_type *model, reader_type *reader, int format, writer_type *writer){
+  static pipeline_type pipeline;
+  long long count = 0;
+  int inFlight = 0;
+  int done = 0;
+  if(pipeline_start(&pipeline,model) < 0)return -1;
+  while(!done || inFlight > 0){
+    pipeline_batch_type *batch = done ? NULL : pipeline_batch(&pipeline);
+    if(batch != NULL){
+      int *column[NUMBER_OF_INPUT];
+      for(int i = 0; i < NUMBER_OF_INPUT; i++)column[i] = batch->input[i];
+      batch->count = read_block(reader,format,column,NUMBER_OF_INPUT,PIPELINE_BATCH);
+      done = batch->count == 0 || reader->error;
+      if(batch->count == 0){
+        pipeline_release(&pipeline,batch);
+        continue;
+      }
+      pipeline_submit(&pipeline,batch);
+      inFlight++;
+    }
+    /* wait for a finished batch only when there is nothing else to do */
+    while((batch = pipeline_collect(&pipeline,batch == NULL)) != NULL){
+      for(int k = 0; k < batch->count; k++)
+        for(int o = 0; o < NUMBER_OF_OUTPUT; o++)
+          write_value(writer,batch->context[k].value[NUMBER_OF_INPUT + o],o == NUMBER_OF_OUTPUT - 1);
+      count += batch->count;
+      pipeline_release(&pipeline,batch);
+      inFlight--;
+    }
+  }
+  pipeline_stop(&pipeline);
+  put_pipeline(stderr,&pipeline);
+  return count;
+}
+
+/* p50/p99 per stage of the time a batch waits in the ring before the
+   stage and spends in it, microseconds, and how often the stage found the
+   next ring full */
+void put_pipeline(FILE *fp, const pipeline_type *pipeline){
+  char *stageName[NUMBER_OF_PIPELINE_STAGE] = {"fuzzification", "rule_evaluation", "defuzzification"};
+  fprintf(fp,"%-16s %10s %9s %9s %9s %9s %12s %12s\n","stage","batches","wait p50","wait p99",
+          "work p50","work p99","full stalls","stalled ms");
+  fprintf(fp,"%-16s %10s %9s %9s %9s %9s %12lld %12.1f\n","submit","","","","","",pipeline->stalls,pipeline->stalled*1e-6);
+  for(int s = 0; s < NUMBER_OF_PIPELINE_STAGE; s++){
+    const stage_type *stage = &pipeline->stage[s];
+    fprintf(fp,"%-16s %10lld %9.1f %9.1f %9.1f %9.1f %12lld %12.1f\n",stageName[s],stage->batches,
+            latency_percentile(&stage->wait,0.5)*1e-3,latency_percentile(&stage->wait,0.99)*1e-3,
+            latency_percentile(&stage->service,0.5)*1e-3,latency_percentile(&stage->service,0.99)*1e-3,
+            stage->stalls,stage->stalled*1e-6);
+  }
+  fprintf(fp,"%-16s %10lld batches of %d, submit to collect p50 %.1f us, p99 %.1f us\n","end to end",
+          pipeline->total.count,PIPELINE_BATCH,latency_percentile(&pipeline->total,0.5)*1e-3,
+          latency_percentile(&pipeline->total,0.99)*1e-3);
+}
+
+/* "bench-pipeline": the three stages on one thread, sample by sample,
+   against the pipeline with a thread per stage, outputs compared */
+int benchmark_pipeline(const model_type *model){
+  const int count = 1 << 20;
+  static pipeline_type pipeline;
+  int (*sample)[NUMBER_OF_INPUT] = malloc((size_t)count*sizeof(*sample));
+  int *expected = malloc((size_t)count*NUMBER_OF_OUTPUT*sizeof(int));
+  unsigned int seed = 12345;
+  long long mismatch = 0;
+  int next = 0, collected = 0;
+  double t0, serial, pipelined;
+  if(sample == NULL || expected == NULL){
+    printf("ERROR- Out of memory for benchmark.\n");
+    free(sample);
+    free(expected);
+    return 1;
+  }
+  for(int s = 0; s < count; s++)random_inputs(&seed,sample[s]);
+  t0 = now_seconds();
+  for(int s = 0; s < count; s++){
+    context_type context;
+    get_system_inputs(&context,sample[s]);
+    fuzzification(model,&context);
+    rule_evaluation(model,&context);
+    defuzzification(model,&context);
+    for(int o = 0; o < NUMBER_OF_OUTPUT; o++)expected[s*NUMBER_OF_OUTPUT + o] = context.value[NUMBER_OF_INPUT + o];
+  }
+  serial = now_seconds() - t0;
+  if(pipeline_start(&pipeline,model) < 0){
+    free(sample);
+    free(expected);
+    return 1;
+  }
+  t0 = now_seconds();
+  while(collected < count){
+    pipeline_batch_type *batch = next < count ? pipeline_batch(&pipeline) : NULL;
+    if(batch != NULL){
+      batch->count = count - next < PIPELINE_BATCH ? count - next : PIPELINE_BATCH;
+      for(int k = 0; k < batch->count; k++, next++)
+        for(int i = 0; i < NUMBER_OF_INPUT; i++)batch->input[i][k] = sample[next][i];
+      pipeline_submit(&pipeline,batch);
+    }
+    while((batch = pipeline_collect(&pipeline,batch == NULL)) != NULL){
+      for(int k = 0; k < batch->count; k++, collected++)
+        for(int o = 0; o < NUMBER_OF_OUTPUT; o++)
+          mismatch += batch->context[k].value[NUMBER_OF_INPUT + o] != expected[collected*NUMBER_OF_OUTPUT + o];
+      pipeline_release(&pipeline,batch);
+    }
+  }
+  pipelined = now_seconds() - t0;
+  pipeline_stop(&pipeline);
+  printf("samples          %d, %d rules, %ld cores online\n",count,NUMBER_OF_RULE,sysconf(_SC_NPROCESSORS_ONLN));
+  printf("one thread       %.0f samples/sec\n",count/serial);
+  printf("pipeline         %.0f samples/sec (x%.2f), rings of %d batches of %d samples\n",count/pipelined,
+         serial/pipelined,PIPELINE_DEPTH,PIPELINE_BATCH);
+  put_pipeline(stdout,&pipeline);
+  printf("mismatches       %lld\n",mismatch);
+  free(sample);
+  free(expected);
+  return mismatch ? 1 : 0;
+}
+#endif
+
+/* "bench-instances": many controllers on one model, stepped all at once
+   against one fuzzification/rule_evaluation/defuzzification pass each */
+int benchmark_instances(const model_type *model){
+  enum { count = 4096, repeat = 256 };
+  instance_type *instance = aligned_alloc(64, count*sizeof(instance_type));
+  context_type context;
+  unsigned int seed = 12345;
+  double t0, t1, t2;
+  int mismatch = 0;
+  if(!instance){
+    printf("ERROR- Out of memory for benchmark.\n");
+    return 1;
+  }
+  memset(instance, 0, count*sizeof(instance_type));
+  printf("instances        %d, %u bytes each, model %u bytes shared\n",count,
+         (unsigned)sizeof(instance_type),(unsigned)sizeof(model_type));
+  for(int s = 0; s < count; s++)random_inputs(&seed,instance[s].value);
+  step_instances(model,instance,count);
+  for(int s = 0; s < count; s++){
+    get_system_inputs(&context,instance[s].value);
+    fuzzification(model,&context);
+    rule_evaluation(model,&context);
+    defuzzification(model,&context);
+    for(int o = NUMBER_OF_INPUT; o < NUMBER_OF_INPUT_OUTPUT; o++)
+      if(context.value[o] != instance[s].value[o])mismatch++;
+    for(int k = 0; k < TOTAL_NUMBER_OF_MF; k++)
+      if(context.mf_value[k] != instance[s].mf_value[k])mismatch++;
+    if(context.status != instance[s].status)mismatch++;
+  }
+  t0 = now_seconds();
+  for(int r = 0; r < repeat; r++){
+    for(int s = r & 7; s < count; s += 8)instance[s].value[0] = (instance[s].value[0] + 1) & UPPER_LIMIT;
+    for(int s = 0; s < count; s++){
+      get_system_inputs(&context,instance[s].value);
+      fuzzification(model,&context);
+      rule_evaluation(model,&context);
+      defuzzification(model,&context);
+    }
+  }
+  t1 = now_seconds();
+  for(int r = 0; r < repeat; r++){
+    for(int s = r & 7; s < count; s += 8)instance[s].value[0] = (instance[s].value[0] + 1) & UPPER_LIMIT;
+    step_instances(model,instance,count);
+  }
+  t2 = now_seconds();
+  printf("one at a time    %.1f ns/instance\n",(t1-t0)*1e9/((double)count*repeat));
+  printf("step_instances   %.1f ns/instance\n",(t2-t1)*1e9/((double)count*repeat));
+#ifdef FUZZY_THREADS
+  {
+    static pool_type pool;
+    instance_type *parallel = aligned_alloc(64, count*sizeof(instance_type));
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = pool_start(&pool,cores > 0 ? (int)cores : 1);
+    if(!parallel){
+      printf("ERROR- Out of memory for benchmark.\n");
+      pool_stop(&pool);
+      free(instance);
+      return 1;
+    }
+    memcpy(parallel, instance, count*sizeof(instance_type));
+    step_instances(model,instance,count);
+    t0 = now_seconds();
+    for(int r = 0; r < repeat; r++)step_instances_parallel(&pool,model,parallel,count);
+    t1 = now_seconds();
+    pool_stop(&pool);
+    printf("%d threads        %.1f ns/instance\n",threads,(t1-t0)*1e9/((double)count*repeat));
+    if(memcmp(parallel, instance, count*sizeof(instance_type)) != 0)mismatch++;
+    free(parallel);
+  }
+#endif
+  printf("mismatches       %d\n",mismatch);
+  free(instance);
+  return mismatch ? 1 : 0;
+}
+
+/* "bench-rules": every rule engine, fuzzification + rule evaluation */
+int benchmark_rules(const model_type *model){
+  const int count = 1 << 22;
+  model_type rule_model = *model;
+  context_type context;
+  int input[NUMBER_OF_INPUT];
+  unsigned int checksum[NUMBER_OF_RULE_ENGINE];
+  long visited = 0;
+  double t0, t1;
+  int mismatch = 0;
+#ifdef FUZZY_RULE_GRID
+  printf("rules            %d, %d grid cells (sparse above %d rules)\n",
+         NUMBER_OF_RULE,GRID_CELLS,SPARSE_RULE_THRESHOLD);
+#else
+  printf("rules            %d, no rule grid for %d inputs (sparse above %d rules)\n",
+         NUMBER_OF_RULE,NUMBER_OF_INPUT,SPARSE_RULE_THRESHOLD);
+#endif
+  for(int engine = 0; engine < NUMBER_OF_RULE_ENGINE; engine++){
+    unsigned int seed = 12345;
+#ifndef FUZZY_RULE_GRID
+    if(engine == RULE_ENGINE_GRID)continue;
+#endif
+    rule_model.rule_engine = engine;
+    checksum[engine] = 0;
+    t0 = now_seconds();
+    for(int s = 0; s < count; s++){
+      random_inputs(&seed,input);
+      get_system_inputs(&context,input);
+      fuzzification(&rule_model,&context);
+      rule_evaluation(&rule_model,&context);
+      for(int i = FIRST_OUTPUT_MF; i < TOTAL_NUMBER_OF_MF; i++)
+        checksum[engine] = checksum[engine]*31 + context.mf_value[i];
+    }
+    t1 = now_seconds();
+    printf("%-16s %.1f ns/sample%s\n",ruleEngineName[engine],(t1-t0)*1e9/count,
+           engine == model->rule_engine ? " [selected]" : "");
+    if(checksum[engine] != checksum[RULE_ENGINE_LIST]){
+      printf("ERROR- %s rule evaluation disagrees with the rule list.\n",ruleEngineName[engine]);
+      mismatch++;
+    }
+  }
+  /* rules reached through input 1 mfs, averaged over its whole domain */
+  for(int x = 0; x < SURFACE_SIZE; x++){
+    for(int i = 0; i < NUMBER_OF_INPUT; i++)input[i] = x;
+    get_system_inputs(&context,input);
+    fuzzification(model,&context);
+    for(int j = 0; j < NUMBER_OF_MF; j++)
+      if(context.mf_value[j] > 0)
+        visited += model->ruleIndexStart[j+1] - model->ruleIndexStart[j];
+  }
+  printf("sparse visits    %.2f rules per sample\n",(double)visited/SURFACE_SIZE);
+  return mismatch ? 1 : 0;
+}
+
+long long read_cycles(){
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  return (long long)__builtin_ia32_rdtsc();
+#else
+  return (long long)(now_seconds()*1e9);
+#endif
+}
+
+void counter_open(counter_type *counter){
+  for(int i = 0; i < NUMBER_OF_COUNTER; i++)counter->fd[i] = -1;
+#ifdef FUZZY_PERF_COUNTERS
+  struct perf_event_attr attr;
+  unsigned long long config[NUMBER_OF_COUNTER] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                  PERF_COUNT_HW_CACHE_MISSES};
+  for(int i = 0; i < NUMBER_OF_COUNTER; i++){
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config[i];
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    counter->fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+#endif
+}
+
+void counter_close(counter_type *counter){
+#ifdef FUZZY_PERF_COUNTERS
+  for(int i = 0; i < NUMBER_OF_COUNTER; i++)if(counter->fd[i] >= 0)close(counter->fd[i]);
+#endif
+  for(int i = 0; i < NUMBER_OF_COUNTER; i++)counter->fd[i] = -1;
+}
+
+void counter_start(counter_type *counter){
+#ifdef FUZZY_PERF_COUNTERS
+  for(int i = 0; i < NUMBER_OF_COUNTER; i++)
+    if(counter->fd[i] >= 0){
+      ioctl(counter->fd[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(counter->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  counter->start = read_cycles();
+}
+
+void counter_stop(counter_type *counter, long long *cycles, long long *instructions, long long *misses){
+  long long stop = read_cycles();
+  long long value[NUMBER_OF_COUNTER] = {-1, -1, -1};
+#ifdef FUZZY_PERF_COUNTERS
+  for(int i = 0; i < NUMBER_OF_COUNTER; i++)
+    if(counter->fd[i] >= 0){
+      ioctl(counter->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+      if(read(counter->fd[i], &value[i], sizeof(value[i])) != sizeof(value[i]))value[i] = -1;
+    }
+#endif
+  *cycles = value[0] >= 0 ? value[0] : stop - counter->start;
+  *instructions = value[1];
+  *misses = value[2];
+}
+
+#ifdef FUZZY_SURFACE
+/* double precision model of the same pipeline without integer truncation:
+   exact slopes from the points of every mf, degrees in 0..1,
+   trapezoid-area centroid */
+double reference_evaluate(const model_type *model, int input1, int input2){
+  double degree[TOTAL_NUMBER_OF_MF];
+  int input[NUMBER_OF_INPUT] = {input1, input2};
+  int forOutputMf = FIRST_OUTPUT_MF;
+  double sum_of_products = 0, sum_of_areas = 0;
+  for(int i = 0; i < NUMBER_OF_INPUT; i++)
+    for(int j = 0; j < NUMBER_OF_MF; j++){
+      const int *p = model->mf[i*NUMBER_OF_MF + j].point;
+      double left = (double)(input[i] - p[0])/(p[1] - p[0]);
+      double right = (double)(p[3] - input[i])/(p[3] - p[2]);
+      double value = left < right ? left : right;
+      degree[i*NUMBER_OF_MF + j] = value < 0 ? 0 : (value > 1 ? 1 : value);
+    }
+  for(int i = forOutputMf; i < TOTAL_NUMBER_OF_MF; i++)degree[i] = 0;
+  for(int i = 0; i < NUMBER_OF_RULE; i++){
+    double strength = 1;
+    for(int j = 0; j < NUMBER_OF_IF_SIDE; j++){
+      double value = degree[model->ruleBase[i].if_side[j]];
+      strength = value < strength ? value : strength;
+    }
+    for(int k = 0; k < NUMBER_OF_THEN_SIDE; k++){
+      double *then = &degree[model->ruleBase[i].then_side[k]];
+      *then = strength > *then ? strength : *then;
+    }
+  }
+  for(int j = 0; j < NUMBER_OF_MF; j++){
+    const int *p = model->mf[forOutputMf + j].point;
+    double h = degree[forOutputMf + j];
+    double base = p[3] - p[0];
+    double top = base - h*(p[1] - p[0]) - h*(p[3] - p[2]);
+    double area = h*(base + top)/2;
+    sum_of_products += area*(p[0] + p[3])/2;
+    sum_of_areas += area;
+  }
+  return sum_of_areas > 0 ? sum_of_products/sum_of_areas : 0;
+}
+
+/* "bench-fixed": accuracy against reference_evaluate() and per-stage
+   cycles/instructions, for the integer engine (UPPER_LIMIT scale) and the
+   fixed-point engine at every q */
+int benchmark_fixed(const model_type *model){
+  enum { count = 4096, repeat = 64 };
+  static context_type context[count];
+  static double reference[SURFACE_SIZE][SURFACE_SIZE];
+  static fixed_model_type fixed;
+  counter_type counter;
+  unsigned int seed = 12345;
+  char *stageName[3] = {"fuzzification", "rule_evaluation", "defuzzification"};
+  counter_open(&counter);
+  printf("counters         %s\n",counter.fd[0] >= 0 ? "perf_event_open" : "cycles from the time stamp counter, no instructions");
+  for(int i = 0; i < SURFACE_SIZE; i++)
+    for(int j = 0; j < SURFACE_SIZE; j++)reference[i][j] = reference_evaluate(model,i,j);
+  printf("%-10s %5s %10s %10s", "engine", "wide", "max error", "mean error");
+  for(int stage = 0; stage < 3; stage++)printf(" %16s",stageName[stage]);
+  printf("   (cycles/instructions per sample)\n");
+  for(int q = FIXED_Q_MIN - 1; q <= FIXED_Q_MAX; q++){
+    double max_error = 0, sum_error = 0;
+    long long cycles[3], instructions[3], misses;
+    char label[16];
+    /* q == FIXED_Q_MIN - 1 stands for the UPPER_LIMIT scaled integer engine */
+    if(q >= FIXED_Q_MIN && compile_fixed_model(&fixed,model,q) < 0){
+      fprintf(stderr,"ERROR- Output mfs too wide for the Q%d fixed-point engine.\n",q);
+      break;
+    }
+    for(int i = 0; i < SURFACE_SIZE; i++)
+      for(int j = 0; j < SURFACE_SIZE; j++){
+        context_type one;
+        int input[NUMBER_OF_INPUT] = {i, j};
+        double error;
+        get_system_inputs(&one,input);
+        if(q < FIXED_Q_MIN){
+          fuzzification(model,&one);
+          rule_evaluation(model,&one);
+          defuzzification(model,&one);
+        }
+        else{
+          fixed_fuzzification(&fixed,&one);
+          fixed_rule_evaluation(&fixed,&one);
+          fixed_defuzzification(&fixed,&one);
+        }
+        error = one.value[NUMBER_OF_INPUT] - reference[i][j];
+        error = error < 0 ? -error : error;
+        max_error = error > max_error ? error : max_error;
+        sum_error += error;
+      }
+    for(int s = 0; s < count; s++){
+      int input[NUMBER_OF_INPUT];
+      random_inputs(&seed,input);
+      get_system_inputs(&context[s],input);
+    }
+    for(int stage = 0; stage < 3; stage++){
+      counter_start(&counter);
+      for(int r = 0; r < repeat; r++)
+        for(int s = 0; s < count; s++){
+          if(q < FIXED_Q_MIN){
+            if(stage == 0)fuzzification(model,&context[s]);
+            if(stage == 1)rule_evaluation(model,&context[s]);
+            if(stage == 2)defuzzification(model,&context[s]);
+          }
+          else{
+            if(stage == 0)fixed_fuzzification(&fixed,&context[s]);
+            if(stage == 1)fixed_rule_evaluation(&fixed,&context[s]);
+            if(stage == 2)fixed_defuzzification(&fixed,&context[s]);
+          }
+        }
+      counter_stop(&counter,&cycles[stage],&instructions[stage],&misses);
+    }
+    if(q < FIXED_Q_MIN)sprintf(label,"integer");
+    else sprintf(label,"Q%d",q);
+    printf("%-10s %5s %10.2f %10.3f",label,q >= FIXED_Q_MIN && fixed.wide ? "yes" : "no",
+           max_error,sum_error/(SURFACE_SIZE*SURFACE_SIZE));
+    for(int stage = 0; stage < 3; stage++)
+      printf(" %7.1f/%-8.1f",(double)cycles[stage]/(count*repeat),
+             instructions[stage] >= 0 ? (double)instructions[stage]/(count*repeat) : -1.0);
+    printf("\n");
+  }
+  counter_close(&counter);
+  return 0;
+}
+#endif
+
+#ifdef FUZZY_PACKED
+/* "bench-packed": bytes of the packed layout against the compiled one, then
+   outputs and status of both on every input (random ones when the domain
+   is over 2^24 inputs) and their speed */
+int benchmark_packed(const model_type *model){
+  const int count = 1 << 22;
+  static packed_model_type packed;
+  long long domain = 1;
+  long long inputs, mismatch = 0;
+  unsigned int strings = 0;
+  unsigned int names = 0;
+  unsigned int rules = sizeof(packed.rule);
+  unsigned int checksum[2] = {0, 0};
+  unsigned int seed;
+  double best[2] = {1e30, 1e30};
+  if(compile_packed_model(&packed,model) < 0){
+    printf("ERROR- The packed layout needs mf consequents, area defuzzification and mfs within 0-%d.\n",UPPER_LIMIT);
+    return 1;
+  }
+  for(int i = 0; i < NUMBER_OF_INPUT_OUTPUT; i++)strings += (unsigned)strlen(model->inputOutput[i].name) + 1;
+  for(int j = 0; j < NUMBER_OF_MF; j++)strings += (unsigned)strlen(model->mf[j].name) + 1;
+#ifdef FUZZY_PACKED_NAMES
+  names = strings + (unsigned)(sizeof(packed.ioName) + sizeof(packed.mfName));
+#endif
+#ifdef PACKED_INDEX_CELLS
+  rules += sizeof(packed.ruleStart);
+#endif
+  /* model bytes include the name strings it points to */
+  printf("%-12s %10s %10s %10s %12s %14s\n","layout","mfs","rules","names","model bytes","RAM per call");
+  printf("%-12s %10u %10u %10u %12u %14u\n","compiled",(unsigned)sizeof(model->mf),(unsigned)sizeof(model->ruleBase),
+         strings,(unsigned)sizeof(model_type) + strings,(unsigned)sizeof(context_type));
+  printf("%-12s %10u %10u %10u %12u %14u\n","packed",(unsigned)sizeof(packed.mf),rules,
+         names,(unsigned)sizeof(packed_model_type) + (names ? strings : 0),(unsigned)sizeof(packed_context_type));
+  for(int i = 0; i < NUMBER_OF_INPUT && domain <= (1 << 24); i++)domain *= SURFACE_SIZE;
+  inputs = domain <= (1 << 24) ? domain : count;
+  seed = 12345;
+  for(long long s = 0; s < inputs; s++){
+    context_type context;
+    packed_context_type small;
+    int input[NUMBER_OF_INPUT];
+    long long rest = s;
+    if(domain <= (1 << 24))
+      for(int i = NUMBER_OF_INPUT - 1; i >= 0; i--, rest /= SURFACE_SIZE)input[i] = (int)(rest % SURFACE_SIZE);
+    else random_inputs(&seed,input);
+    get_system_inputs(&context,input);
+    fuzzification(model,&context);
+    rule_evaluation(model,&context);
+    defuzzification(model,&context);
+    for(int i = 0; i < NUMBER_OF_INPUT; i++)small.value[i] = input[i];
+    packed_fuzzification(&packed,&small);
+    packed_rule_evaluation(&packed,&small);
+    packed_defuzzification(&packed,&small);
+    if(memcmp(context.value, small.value, sizeof(context.value)) != 0 || context.status != small.status)mismatch++;
+  }
+  for(int r = 0; r < 3; r++){
+    for(int layout = 0; layout < 2; layout++){
+      double t0 = now_seconds(), seconds;
+      seed = 12345;
+      for(int s = 0; s < count; s++){
+        int input[NUMBER_OF_INPUT];
+        int output[NUMBER_OF_OUTPUT];
+        random_inputs(&seed,input);
+        if(layout == 0)evaluate(model,input,output);
+        else packed_evaluate(&packed,input,output);
+        checksum[layout] += output[0];
+      }
+      seconds = now_seconds() - t0;
+      best[layout] = seconds < best[layout] ? seconds : best[layout];
+    }
+  }
+  printf("compiled         %.1f ns/sample\n",best[0]*1e9/count);
+  printf("packed           %.1f ns/sample (x%.2f)\n",best[1]*1e9/count,best[0]/best[1]);
+  printf("mismatches       %lld of %lld %s inputs\n",mismatch + (checksum[0] != checksum[1]),inputs,
+         domain <= (1 << 24) ? "(all)" : "random");
+  return mismatch || checksum[0] != checksum[1] ? 1 : 0;
+}
+#endif
+
+/* "bench-engine": arithmetic against table-driven fuzzification */
+int benchmark_engines(const model_type *model){
+  const int count = 1 << 22;
+  static degree_table_type table;
+  model_type engine_model = *model;
+  context_type context;
+  int input[NUMBER_OF_INPUT];
+  int output[NUMBER_OF_OUTPUT];
+  unsigned int checksum[NUMBER_OF_ENGINE][2];
+  double t0, t1, t2;
+  build_degree_table(model,&table);
+  printf("degree table     %u bytes, %d bytes per input value\n",(unsigned)sizeof(table),MF_ROW);
+  for(int engine = 0; engine < NUMBER_OF_ENGINE; engine++){
+    unsigned int seed = 12345;
+    select_engine(&engine_model,engine,&table);
+    checksum[engine][0] = checksum[engine][1] = 0;
+    t0 = now_seconds();
+    for(int s = 0; s < count; s++){
+      random_inputs(&seed,input);
+      get_system_inputs(&context,input);
+      fuzzification(&engine_model,&context);
+      checksum[engine][0] += context.mf_value[s % (NUMBER_OF_INPUT*NUMBER_OF_MF)];
+    }
+    t1 = now_seconds();
+    for(int s = 0; s < count; s++){
+      random_inputs(&seed,input);
+      evaluate(&engine_model,input,output);
+      for(int o = 0; o < NUMBER_OF_OUTPUT; o++)checksum[engine][1] = checksum[engine][1]*31 + output[o];
+    }
+    t2 = now_seconds();
+    printf("%-16s fuzzification %.1f ns/sample, full inference %.1f ns/sample\n",
+           engineName[engine],(t1-t0)*1e9/count,(t2-t1)*1e9/count);
+  }
+  if(checksum[ENGINE_TABLE][0] != checksum[ENGINE_ARITHMETIC][0] ||
+     checksum[ENGINE_TABLE][1] != checksum[ENGINE_ARITHMETIC][1]){
+    printf("ERROR- table engine disagrees with arithmetic engine.\n");
+    return 1;
+  }
+  return 0;
+}
+
+/* "bench-defuzz": cost of every defuzzifier against how far it lands from
+   the centroid of the aggregated set, integrated numerically on a fine
+   grid. The analytic centroid must match that reference */
+int benchmark_defuzzifiers(const model_type *model){
+  enum{count = 1024, steps = 32, repeat = 256};
+  static context_type context[count];
+  static double reference[count][NUMBER_OF_OUTPUT];
+  model_type method_model = *model;
+  int input[NUMBER_OF_INPUT];
+  unsigned int seed = 12345;
+  double low = model->mf[FIRST_OUTPUT_MF].point1, high = model->mf[FIRST_OUTPUT_MF].point2;
+  double analytic = 0;
+  int fired = 0;
+  for(int i = FIRST_OUTPUT_MF; i < TOTAL_NUMBER_OF_MF; i++){
+    if(model->mf[i].point1 < low)low = model->mf[i].point1;
+    if(model->mf[i].point2 > high)high = model->mf[i].point2;
+  }
+  for(int s = 0; s < count; s++){
+    random_inputs(&seed,input);
+    get_system_inputs(&context[s],input);
+    fuzzification(model,&context[s]);
+    rule_evaluation(model,&context[s]);
+    for(int o = 0; o < NUMBER_OF_OUTPUT; o++){
+      const mf_type *mf = &model->mf[FIRST_OUTPUT_MF + o*NUMBER_OF_MF];
+      const int *degree = &context[s].mf_value[FIRST_OUTPUT_MF + o*NUMBER_OF_MF];
+      double area = 0, moment = 0, difference;
+      for(double x = low + 0.5/steps; x < high; x += 1.0/steps){   /* midpoint rule */
+        double y = aggregated_degree(mf,degree,x);
+        area += y;
+        moment += x*y;
+      }
+      reference[s][o] = -1;                      /* nothing fired, no centroid */
+      if(area <= 0)continue;
+      reference[s][o] = moment/area;
+      fired++;
+      difference = exact_centroid(model,o,degree) - reference[s][o];
+      difference = difference < 0 ? -difference : difference;
+      if(difference > analytic)analytic = difference;
+    }
+  }
+  printf("samples          %d, %d outputs fired, reference integrated in 1/%d steps\n",count,fired,steps);
+  printf("analytic centroid %.2e max difference to the reference\n",analytic);
+  for(int method = 0; method < NUMBER_OF_DEFUZZIFIER; method++){
+    double worst = 0, total = 0;
+    double t0, t1;
+    for(int o = 0; o < NUMBER_OF_OUTPUT; o++)select_defuzzifier(&method_model,o,method);
+    t0 = now_seconds();
+    for(int r = 0; r < repeat; r++)
+      for(int s = 0; s < count; s++)defuzzification(&method_model,&context[s]);
+    t1 = now_seconds();
+    for(int s = 0; s < count; s++)
+      for(int o = 0; o < NUMBER_OF_OUTPUT; o++){
+        double error;
+        if(reference[s][o] < 0)continue;
+        error = context[s].value[NUMBER_OF_INPUT + o] - reference[s][o];
+        error = error < 0 ? -error : error;
+        total += error;
+        if(error > worst)worst = error;
+      }
+    printf("%-16s %7.1f ns/sample, from centroid: max %6.2f mean %6.3f%s\n",defuzzifierName[method],
+           (t1-t0)*1e9/((double)repeat*count),worst,fired ? total/fired : 0,
+           method == model->defuzzifier[0] ? " [selected]" : "");
+  }
+  if(analytic > 0.01){
+    printf("ERROR- analytic centroid disagrees with the integrated reference.\n");
+    return 1;
+  }
+  return 0;
+}
+
+/* "bench-tsk": latency of the model against its zero-order TSK twin from
+   compile_tsk_model(), per stage and end to end */
+int benchmark_tsk(const model_type *model){
+  const int count = 1 << 20;
+  static model_type tsk;
+  const model_type *engine[2];
+  char *inferenceName[2] = {"mamdani", "tsk"};
+  context_type context;
+  int input[NUMBER_OF_INPUT];
+  long long difference = 0;
+  compile_tsk_model(&tsk,model);
+  engine[INFERENCE_MAMDANI] = model;
+  engine[INFERENCE_TSK] = &tsk;
+  printf("samples          %d\n",count);
+  for(int e = 0; e < 2; e++){
+    unsigned int seed = 12345;
+    unsigned int checksum = 0;
+    double t0, t1;
+    if(e == INFERENCE_MAMDANI && model->inference == INFERENCE_TSK){
+      printf("%-16s model has TSK consequents\n",inferenceName[e]);
+      continue;
+    }
+    t0 = now_seconds();
+    for(int s = 0; s < count; s++){
+      random_inputs(&seed,input);
+      get_system_inputs(&context,input);
+      fuzzification(engine[e],&context);
+      rule_evaluation(engine[e],&context);
+      defuzzification(engine[e],&context);
+      for(int o = 0; o < NUMBER_OF_OUTPUT; o++)checksum = checksum*31 + context.value[NUMBER_OF_INPUT + o];
+    }
+    t1 = now_seconds();
+    printf("%-16s %.1f ns/sample (checksum %08x)\n",inferenceName[e],(t1-t0)*1e9/count,checksum);
+  }
+  if(model->inference == INFERENCE_MAMDANI){
+    unsigned int seed = 12345;
+    int output[2][NUMBER_OF_OUTPUT];
+    for(int s = 0; s < count; s++){
+      random_inputs(&seed,input);
+      evaluate(model,input,output[0]);
+      evaluate(&tsk,input,output[1]);
+      for(int o = 0; o < NUMBER_OF_OUTPUT; o++)
+        difference += output[0][o] > output[1][o] ? output[0][o] - output[1][o] : output[1][o] - output[0][o];
+    }
+    printf("tsk twin         %.3f mean difference to the mamdani output\n",(double)difference/count/NUMBER_OF_OUTPUT);
+  }
+  return 0;
+}
+
+/* "bench-incremental [trace]": evaluate() against evaluate_incremental() on a
+   recorded trace, NUMBER_OF_INPUT whitespace separated values per step,
+   or on a random walk of a few counts per step that holds still a quarter
+   of the time */
+int benchmark_incremental(const model_type *model, const char *filename){
+  static incremental_type state;
+  int *trace = NULL;
+  int *full, *incremental;
+  int steps = 0;
+  int mismatch = 0;
+  double best_full = 0, best_incremental = 0;
+  if(filename != NULL){
+    FILE *fp = fopen(filename,"r");
+    int allocated = 0, values = 0, value;
+    if(fp == NULL){
+      printf("ERROR- Unable to open data file named %s.\n",filename);
+      return 1;
+    }
+    while(fscanf(fp,"%d",&value) == 1){
+      if(values == allocated){
+        int *grown = realloc(trace, (allocated ? 2*allocated : 4096)*sizeof(int));
+        if(grown == NULL)break;
+        trace = grown;
+        allocated = allocated ? 2*allocated : 4096;
+      }
+      trace[values++] = value;
+    }
+    fclose(fp);
+    steps = values / NUMBER_OF_INPUT;
+  }
+  else{
+    unsigned int seed = 12345;
+    steps = 1 << 20;
+    trace = malloc((size_t)steps*NUMBER_OF_INPUT*sizeof(int));
+    if(trace != NULL){
+      random_inputs(&seed,trace);
+      for(int s = 1; s < steps; s++)
+        for(int i = 0; i < NUMBER_OF_INPUT; i++){
+          int value = trace[(s-1)*NUMBER_OF_INPUT + i];
+          seed = seed*1103515245u + 12345u;
+          if(((seed >> 16) & 3) != 0)value += (int)((seed >> 20) % 5) - 2;
+          trace[s*NUMBER_OF_INPUT + i] = value < 0 ? 0 : value > UPPER_LIMIT ? UPPER_LIMIT : value;
+        }
+    }
+  }
+  full = malloc((size_t)(steps ? steps : 1)*NUMBER_OF_OUTPUT*sizeof(int));
+  incremental = malloc((size_t)(steps ? steps : 1)*NUMBER_OF_OUTPUT*sizeof(int));
+  if(trace == NULL || full == NULL || incremental == NULL){
+    printf("ERROR- Out of memory for benchmark.\n");
+    return 1;
+  }
+  for(int pass = 0; pass < 3; pass++){            /* best of three, from a fresh state each */
+    double t = now_seconds();
+    for(int s = 0; s < steps; s++)evaluate(model,&trace[s*NUMBER_OF_INPUT],&full[s*NUMBER_OF_OUTPUT]);
+    t = now_seconds() - t;
+    if(pass == 0 || t < best_full)best_full = t;
+    incremental_reset(&state);
+    t = now_seconds();
+    for(int s = 0; s < steps; s++)
+      evaluate_incremental(model,&state,&trace[s*NUMBER_OF_INPUT],&incremental[s*NUMBER_OF_OUTPUT]);
+    t = now_seconds() - t;
+    if(pass == 0 || t < best_incremental)best_incremental = t;
+  }
+  for(int s = 0; s < steps*NUMBER_OF_OUTPUT; s++)if(full[s] != incremental[s])mismatch++;
+  printf("steps            %d%s\n",steps,filename ? "" : " (random walk)");
+  printf("full             %.1f ns/step\n",steps ? best_full*1e9/steps : 0);
+  printf("incremental      %.1f ns/step (x%.2f)\n",steps ? best_incremental*1e9/steps : 0,
+         best_incremental > 0 ? best_full/best_incremental : 0);
+  printf("memo hits        %.1f%%\n",steps ? 100.0*state.stats.memo_hits/steps : 0);
+  printf("degrees still    %.1f%% of steps skip rules and defuzzification\n",steps ? 100.0*state.stats.unchanged/steps : 0);
+  printf("rebuilds         %lld\n",state.stats.rebuilds);
+  printf("degrees changed  %.2f per step\n",steps ? (double)state.stats.degrees_changed/steps : 0);
+  printf("rules evaluated  %.2f per step of %d\n",steps ? (double)state.stats.rules_evaluated/steps : 0,NUMBER_OF_RULE);
+  printf("mismatches       %d\n",mismatch);
+  free(trace);
+  free(full);
+  free(incremental);
+  return mismatch ? 1 : 0;
+}
+
+/* "bench": throughput of evaluate_batch() against the one-at-a-time path */
+int benchmark_batch(const model_type *model){
+  const int count = 1 << 20;
+  int *samples = malloc((size_t)count*NUMBER_OF_INPUT*sizeof(int));
+  int *single = malloc((size_t)count*NUMBER_OF_OUTPUT*sizeof(int));
+  int *batch = malloc((size_t)count*NUMBER_OF_OUTPUT*sizeof(int));
+  const int *input[NUMBER_OF_INPUT];
+  int sample[NUMBER_OF_INPUT];
+  unsigned int seed = 12345;
+  double t0, t1, t2, single_rate;
+  int mismatch = 0;
+  if(!samples || !single || !batch){
+    printf("ERROR- Out of memory for benchmark.\n");
+    return 1;
+  }
+  /* evaluate_batch() wants one array per input, samples[i*count + s] */
+  for(int s = 0; s < count; s++){
+    random_inputs(&seed,sample);
+    for(int i = 0; i < NUMBER_OF_INPUT; i++)samples[i*count + s] = sample[i];
+  }
+  for(int i = 0; i < NUMBER_OF_INPUT; i++)input[i] = samples + i*count;
+  t0 = now_seconds();
+  for(int s = 0; s < count; s++){
+    for(int i = 0; i < NUMBER_OF_INPUT; i++)sample[i] = input[i][s];
+    evaluate(model,sample,&single[s*NUMBER_OF_OUTPUT]);
+  }
+  t1 = now_seconds();
+  printf("samples          %d\n",count);
+  single_rate = count/(t1-t0);
+  printf("one-at-a-time    %.0f samples/sec\n",single_rate);
+  for(int kernel = 0; kernel < NUMBER_OF_KERNEL; kernel++){
+    int mismatch_kernel = 0;
+    if(!kernel_supported(kernel))continue;
+    t1 = now_seconds();
+    evaluate_batch_kernel(model,kernel,input,batch,count);
+    t2 = now_seconds();
+    for(int s = 0; s < count*NUMBER_OF_OUTPUT; s++)if(single[s] != batch[s])mismatch_kernel++;
+    printf("batch %-10s %.0f samples/sec (x%.2f), %d mismatches%s\n",kernelName[kernel],
+           count/(t2-t1),count/(t2-t1)/single_rate,mismatch_kernel,
+           kernel == model->kernel ? " [selected]" : "");
+    mismatch += mismatch_kernel;
+  }
+  free(samples);
+  free(single);
+  free(batch);
+  return mismatch ? 1 : 0;
+}                                        /* END BENCHMARK BATCH */
+#endif
+
+int max(int a, int b){
+  int max;
   if(a > b){
     max = a;
   }
@@ -310,8 +5392,8 @@ float max(float a, float b){
   return max;
 }
 
-float min(float a, float b){
-  float min;
+int min(int a, int b){
+  int min;
   if(a > b){
     min = b;
   }
@@ -0,0 +1,465 @@
+/* Per-stage micro-benchmarks of both engines, a program of its own:
+     make bench
+   builds and runs it (cc -O2 -pthread -o FuzzyLogicBenchmark FuzzyLogicBenchmark.c).
+   FuzzyLogic.c (static arrays, model compiled in) and
+   RunningVersionWithInputFilesFuzzyLogic.c (linked lists in an arena, model
+   read from text files) are built into this one translation unit, the list
+   engine with every global name prefixed by list_. Both run the same model:
+   the one compiled into FuzzyLogic.c, written out as text files for the
+   list engine. Other rule base sizes are synthetic models:
+     ./FuzzyLogicBenchmark generate 10000 > model10000.h
+     cc -O2 -DFUZZY_MODEL_FILE=\"model10000.h\" -o bench10000 FuzzyLogicBenchmark.c -lpthread
+   Every stage is timed on its own over batches of 1 to BENCH_MAX_BATCH
+   samples. Output is CSV, one line per measurement:
+     engine,rules,inputs,stage,batch,samples,ns_per_sample,cycles_per_sample,
+     instructions_per_sample,cache_misses_per_sample
+   init lines are per model load instead of per sample. Counters that perf
+   cannot give are -1, cycles then come from the time stamp counter. Exits
+   1 when the two engines disagree on an output */
+/* the feature macros of FuzzyLogic.c, needed before the first #include:
+   mkdtemp() and strdup() here, st_mtim and syscall() there */
+#define _POSIX_C_SOURCE             200809L
+#define _DEFAULT_SOURCE
+#ifdef __APPLE__
+#define _DARWIN_C_SOURCE
+#endif
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* messages of the list engine: "NO MATCHING RULES FOUND!" and the like
+   are counted, not printed, while it is being timed */
+int List_Quiet;
+long long List_Messages;
+int list_message(const char *format, ...){
+  va_list arguments;
+  int n;
+  if(List_Quiet){
+    List_Messages++;
+    return 0;
+  }
+  va_start(arguments, format);
+  n = vprintf(format, arguments);
+  va_end(arguments);
+  return n;
+}
+
+/* every name the list engine shares with FuzzyLogic.c is renamed, a new
+   one needs a line here and in the #undef list: "make bench" fails on a
+   missing one as a redefinition */
+#define main list_main
+#define printf list_message
+#define max list_max
+#define min list_min
+#define fuzzification list_fuzzification
+#define rule_evaluation list_rule_evaluation
+#define defuzzification list_defuzzification
+#define tsk_defuzzification list_tsk_defuzzification
+#define compute_degree_of_membership list_compute_degree_of_membership
+#define compute_area_of_trapezoid list_compute_area_of_trapezoid
+#define initialize_system list_initialize_system
+#define free_system list_free_system
+#define write_system list_write_system
+#define map_system list_map_system
+#define check_list list_check_list
+#define validate_system list_validate_system
+#define arena_alloc list_arena_alloc
+#define read_fuzzy_set list_read_fuzzy_set
+#define hash_name list_hash_name
+#define insert_name list_insert_name
+#define find_name list_find_name
+#define put_system_outputs list_put_system_outputs
+#define append_element list_append_element
+#define read_consequent list_read_consequent
+#define get_system_inputs list_get_system_inputs
+#define model_type list_model_type
+#define io_type list_io_type
+#define mf_type list_mf_type
+#define rule_type list_rule_type
+#define rule_element_type list_rule_element_type
+#define consequent_type list_consequent_type
+#define term_type list_term_type
+#define Model list_Model
+#define Model_Allocated list_Model_Allocated
+#define Model_Mapped list_Model_Mapped
+#define Values list_Values
+#define Names list_Names
+#define Names_Size list_Names_Size
+#define Names_Used list_Names_Used
+#include "RunningVersionWithInputFilesFuzzyLogic.c"
+#undef AT
+#undef HEADER
+#undef main
+#undef printf
+#undef max
+#undef min
+#undef fuzzification
+#undef rule_evaluation
+#undef defuzzification
+#undef tsk_defuzzification
+#undef compute_degree_of_membership
+#undef compute_area_of_trapezoid
+#undef initialize_system
+#undef free_system
+#undef write_system
+#undef map_system
+#undef check_list
+#undef validate_system
+#undef arena_alloc
+#undef read_fuzzy_set
+#undef hash_name
+#undef insert_name
+#undef find_name
+#undef put_system_outputs
+#undef append_element
+#undef read_consequent
+#undef get_system_inputs
+#undef model_type
+#undef io_type
+#undef mf_type
+#undef rule_type
+#undef rule_element_type
+#undef consequent_type
+#undef term_type
+#undef Model
+#undef Model_Allocated
+#undef Model_Mapped
+#undef Values
+#undef Names
+#undef Names_Size
+#undef Names_Used
+
+#define main fuzzy_main
+#include "FuzzyLogic.c"
+#undef main
+
+#ifndef FUZZY_HOSTED
+#error "the benchmark needs a hosted build (timers, perf counters, files)"
+#endif
+
+#define BENCH_SECONDS               0.05               // least time per measurement, repeats are calibrated to it
+#define BENCH_MAX_BATCH             16384              // largest batch of samples
+#define NUMBER_OF_BATCH             4
+#define NUMBER_OF_STAGE             4                  // the three stages, then all three per sample
+#define GENERATE_MF                 7                  // mfs per input/output of a generated model
+
+int batchSize[NUMBER_OF_BATCH] = {1, 64, 1024, BENCH_MAX_BATCH};
+char *benchStageName[NUMBER_OF_STAGE] = {"fuzzification", "rule_evaluation", "defuzzification", "total"};
+/* the list engine's copy of the model, files in a scratch directory */
+char *listFile[NUMBER_OF_INPUT_OUTPUT + 3];
+char listDirectory[] = "/tmp/fuzzybenchXXXXXX";
+
+int generate_model(int rules);
+int write_list_model();
+void remove_list_model();
+int list_output(int o);
+void report(const char *engine, const char *stage, int batch, long long samples, double seconds,
+            long long cycles, long long instructions, long long misses);
+int repeats_for(double seconds);
+void benchmark_init(const model_type *model);
+int benchmark_static(const model_type *model, int batch, int *output);
+int benchmark_list(int batch, const int *output);
+
+int main(int argc, char *argv[]){
+  static model_type model;
+  int *output = malloc((size_t)BENCH_MAX_BATCH*NUMBER_OF_OUTPUT*sizeof(int));
+  int mismatch = 0;
+  if(argc > 2 && strcmp(argv[1],"generate")==0)return generate_model(atoi(argv[2]));
+  if(argc > 1){
+    fprintf(stderr,"usage: FuzzyLogicBenchmark [generate rules]\n");
+    return 1;
+  }
+  if(output == NULL || write_list_model() != 0){
+    fprintf(stderr,"ERROR- Unable to set up the benchmark.\n");
+    return 1;
+  }
+  initialize_system(&model);
+  printf("engine,rules,inputs,stage,batch,samples,ns_per_sample,cycles_per_sample,"
+         "instructions_per_sample,cache_misses_per_sample\n");
+  benchmark_init(&model);
+  list_initialize_system();
+  for(int b = 0; b < NUMBER_OF_BATCH; b++){
+    benchmark_static(&model,batchSize[b],output);
+    mismatch += benchmark_list(batchSize[b],output);
+  }
+  list_free_system();
+  remove_list_model();
+  if(mismatch)fprintf(stderr,"ERROR- The list engine differs from the static engine on %d outputs.\n",mismatch);
+  free(output);
+  return mismatch ? 1 : 0;
+}
+
+/* "generate rules": a model header for -DFUZZY_MODEL_FILE with the given
+   number of distinct rules over as few inputs as hold them, GENERATE_MF
+   mfs each, one output, random consequents */
+int generate_model(int rules){
+  char *mfName[GENERATE_MF] = {"NL", "NM", "NS", "ZE", "PS", "PM", "PL"};
+  unsigned int seed = 12345;
+  long long cells = GENERATE_MF*GENERATE_MF;
+  int inputs = 2;
+  int *cell;
+  if(rules < 1 || rules > 1000000){
+    fprintf(stderr,"ERROR- generate takes 1 to 1000000 rules.\n");
+    return 1;
+  }
+  while(cells < rules){
+    cells *= GENERATE_MF;
+    inputs++;
+  }
+  cell = malloc((size_t)cells*sizeof(int));
+  if(cell == NULL){
+    fprintf(stderr,"ERROR- Out of memory generating the model.\n");
+    return 1;
+  }
+  for(int c = 0; c < cells; c++)cell[c] = c;
+  for(int r = 0; r < rules; r++){                /* the first rules cells of a shuffle */
+    int pick, swap;
+    seed = seed*1103515245u + 12345u;
+    pick = r + (int)((seed >> 8) % (unsigned int)(cells - r));
+    swap = cell[r];
+    cell[r] = cell[pick];
+    cell[pick] = swap;
+  }
+  printf("#define NUMBER_OF_INPUT_OUTPUT      %d\n",inputs + 1);
+  printf("#define TOTAL_NUMBER_OF_MF          %d\n",(inputs + 1)*GENERATE_MF);
+  printf("#define NUMBER_OF_RULE              %d\n",rules);
+  printf("#define NUMBER_OF_INPUT             %d\n",inputs);
+  printf("#define NUMBER_OF_OUTPUT            1\n");
+  printf("#define NUMBER_OF_MF                %d\n",GENERATE_MF);
+  printf("#define NUMBER_OF_IF_SIDE           %d\n",inputs);
+  printf("#define NUMBER_OF_THEN_SIDE         1\n");
+  printf("#define TOTAL_NUMBER_OF_IF_SIDE     %d\n",rules*inputs);
+  printf("#define TOTAL_NUMBER_OF_THEN_SIDE   %d\n",rules);
+  printf("char *ioName[NUMBER_OF_INPUT_OUTPUT] = {");
+  for(int i = 0; i < inputs; i++)printf("\"In%d\", ",i + 1);
+  printf("\"Out\"};\n");
+  printf("char *rule[NUMBER_OF_RULE][NUMBER_OF_INPUT_OUTPUT] = {\n");
+  for(int r = 0; r < rules; r++){
+    int c = cell[r];
+    printf("  {");
+    for(int i = 0; i < inputs; i++, c /= GENERATE_MF)printf("\"%s\", ",mfName[c % GENERATE_MF]);
+    seed = seed*1103515245u + 12345u;
+    printf("\"%s\"}%s\n",mfName[(seed >> 16) % GENERATE_MF],r + 1 < rules ? "," : "};");
+  }
+  printf("char *name[NUMBER_OF_MF] = {");
+  for(int j = 0; j < GENERATE_MF; j++)printf("\"%s\"%s",mfName[j],j + 1 < GENERATE_MF ? ", " : "};\n");
+  printf("int point[NUMBER_OF_MF][4] = {");
+  for(int j = 0; j < GENERATE_MF; j++){
+    int left = j*UPPER_LIMIT/(GENERATE_MF + 1);
+    int peak = (j + 1)*UPPER_LIMIT/(GENERATE_MF + 1);
+    int right = (j + 2)*UPPER_LIMIT/(GENERATE_MF + 1);
+    printf("{%d, %d, %d, %d}%s",left,peak,peak,right,j + 1 < GENERATE_MF ? ", " : "};\n");
+  }
+  free(cell);
+  return 0;
+}
+
+/* the compiled-in model as system.txt, one set file per input/output and
+   rules.txt, plus its binary form model.bin, in a scratch directory that
+   becomes the working directory (the list engine opens fixed names) */
+int write_list_model(){
+  FILE *fp;
+  char file[32];
+  int n = 0;
+  if(mkdtemp(listDirectory) == NULL || chdir(listDirectory) != 0)return -1;
+  if((fp = fopen("system.txt","w")) == NULL)return -1;
+  listFile[n++] = "system.txt";
+  for(int i = 0; i < NUMBER_OF_INPUT_OUTPUT; i++)
+    fprintf(fp,"%s io%d.txt\n",i < NUMBER_OF_INPUT ? "input" : "output",i);
+  fclose(fp);
+  for(int i = 0; i < NUMBER_OF_INPUT_OUTPUT; i++){
+    sprintf(file,"io%d.txt",i);
+    if((fp = fopen(file,"w")) == NULL)return -1;
+    listFile[n++] = strdup(file);
+    fprintf(fp,"%s\n",ioName[i]);
+    for(int j = 0; j < NUMBER_OF_MF; j++)
+      fprintf(fp,"%s %d %d %d %d\n",name[j],point[j][0],point[j][1],point[j][2],point[j][3]);
+    fclose(fp);
+  }
+  if((fp = fopen("rules.txt","w")) == NULL)return -1;
+  listFile[n++] = "rules.txt";
+  for(int r = 0; r < NUMBER_OF_RULE; r++)
+    for(int j = 0; j < NUMBER_OF_INPUT_OUTPUT; j++)
+      fprintf(fp,"%s%s",rule[r][j],j + 1 < NUMBER_OF_INPUT_OUTPUT ? " " : "\n");
+  fclose(fp);
+  list_initialize_system();
+  list_write_system("model.bin");
+  list_free_system();
+  listFile[n++] = "model.bin";
+  return 0;
+}
+
+void remove_list_model(){
+  for(int n = 0; n < NUMBER_OF_INPUT_OUTPUT + 3; n++)
+    if(listFile[n] != NULL)unlink(listFile[n]);
+  if(chdir("/") == 0)rmdir(listDirectory);
+}
+
+/* Values[] index of output o of the list engine */
+int list_output(int o){
+  int so = ((struct list_model_type *)list_Model)->System_Output;
+  for(; o > 0; o--)so = ((struct list_io_type *)(list_Model + so))->next;
+  return ((struct list_io_type *)(list_Model + so))->value;
+}
+
+void report(const char *engine, const char *stage, int batch, long long samples, double seconds,
+            long long cycles, long long instructions, long long misses){
+  printf("%s,%d,%d,%s,%d,%lld,%.2f,%.1f,%.1f,%.3f\n",engine,NUMBER_OF_RULE,NUMBER_OF_INPUT,stage,batch,samples,
+         seconds*1e9/samples,(double)cycles/samples,
+         instructions >= 0 ? (double)instructions/samples : -1.0,
+         misses >= 0 ? (double)misses/samples : -1.0);
+}
+
+/* repeats of a pass that took seconds to fill BENCH_SECONDS */
+int repeats_for(double seconds){
+  double repeats = seconds > 0 ? BENCH_SECONDS/seconds : 1e6;
+  return repeats < 1 ? 1 : (repeats > 1e6 ? 1000000 : (int)repeats);
+}
+
+/* model load: compiling the static tables, parsing the text files, and
+   mapping the binary model */
+void benchmark_init(const model_type *model){
+  static model_type scratch;
+  counter_type counter;
+  counter_open(&counter);
+  for(int kind = 0; kind < 3; kind++){
+    long long cycles, instructions, misses;
+    int repeats = 0;
+    double t0, t1;
+    counter_start(&counter);
+    t0 = t1 = now_seconds();
+    while(repeats < 3 || t1 - t0 < BENCH_SECONDS){
+      if(kind == 0)initialize_system(&scratch);
+      if(kind == 1)list_initialize_system();
+      if(kind == 2)list_map_system("model.bin");
+      if(kind > 0)list_free_system();
+      repeats++;
+      t1 = now_seconds();
+    }
+    counter_stop(&counter,&cycles,&instructions,&misses);
+    report(kind == 0 ? "static" : "list",kind == 2 ? "init-mapped" : "init",1,repeats,t1-t0,
+           cycles,instructions,misses);
+  }
+  if(memcmp(&scratch, model, sizeof(scratch)) != 0)fprintf(stderr,"ERROR- initialize_system() is not repeatable.\n");
+  counter_close(&counter);
+}
+
+/* the three stages of the static engine over batch contexts, each on its
+   own and chained, then evaluate_batch(); output gets the chained outputs */
+int benchmark_static(const model_type *model, int batch, int *output){
+  context_type *context = malloc((size_t)batch*sizeof(context_type));
+  int *samples = malloc((size_t)batch*NUMBER_OF_INPUT*sizeof(int));
+  const int *column[NUMBER_OF_INPUT];
+  int *batch_output = malloc((size_t)batch*NUMBER_OF_OUTPUT*sizeof(int));
+  unsigned int seed = 12345;
+  counter_type counter;
+  int repeats;
+  double t0;
+  if(context == NULL || samples == NULL || batch_output == NULL){
+    fprintf(stderr,"ERROR- Out of memory for benchmark.\n");
+    exit(1);
+  }
+  for(int s = 0; s < batch; s++){
+    int input[NUMBER_OF_INPUT];
+    random_inputs(&seed,input);
+    get_system_inputs(&context[s],input);
+    for(int i = 0; i < NUMBER_OF_INPUT; i++)samples[i*batch + s] = input[i];
+  }
+  for(int i = 0; i < NUMBER_OF_INPUT; i++)column[i] = samples + i*batch;
+  t0 = now_seconds();
+  for(int s = 0; s < batch; s++){                /* calibration, also warms the caches */
+    fuzzification(model,&context[s]);
+    rule_evaluation(model,&context[s]);
+    defuzzification(model,&context[s]);
+  }
+  repeats = repeats_for(now_seconds() - t0);
+  counter_open(&counter);
+  for(int stage = 0; stage < NUMBER_OF_STAGE + 1; stage++){
+    long long cycles, instructions, misses;
+    double t1;
+    counter_start(&counter);
+    t1 = now_seconds();
+    for(int r = 0; r < repeats; r++){
+      if(stage == NUMBER_OF_STAGE){
+        evaluate_batch(model,column,batch_output,batch);
+        continue;
+      }
+      for(int s = 0; s < batch; s++){
+        if(stage == 0 || stage == 3)fuzzification(model,&context[s]);
+        if(stage == 1 || stage == 3)rule_evaluation(model,&context[s]);
+        if(stage == 2 || stage == 3)defuzzification(model,&context[s]);
+      }
+    }
+    t1 = now_seconds() - t1;
+    counter_stop(&counter,&cycles,&instructions,&misses);
+    report("static",stage == NUMBER_OF_STAGE ? "evaluate_batch" : benchStageName[stage],batch,
+           (long long)repeats*batch,t1,cycles,instructions,misses);
+  }
+  counter_close(&counter);
+  for(int s = 0; s < batch; s++)
+    for(int o = 0; o < NUMBER_OF_OUTPUT; o++)output[s*NUMBER_OF_OUTPUT + o] = context[s].value[NUMBER_OF_INPUT + o];
+  free(context);
+  free(samples);
+  free(batch_output);
+  return 0;
+}
+
+/* the same for the list engine: one Values[] per sample, swapped in
+   before each call. Returns the outputs that differ from the static
+   engine's */
+int benchmark_list(int batch, const int *output){
+  int number_of_values = ((struct list_model_type *)list_Model)->number_of_values;
+  int *values = calloc((size_t)batch*number_of_values, sizeof(int));
+  int *own = list_Values;
+  unsigned int seed = 12345;
+  counter_type counter;
+  int repeats;
+  int mismatch = 0;
+  double t0;
+  if(values == NULL){
+    fprintf(stderr,"ERROR- Out of memory for benchmark.\n");
+    exit(1);
+  }
+  for(int s = 0; s < batch; s++){
+    int input[NUMBER_OF_INPUT];
+    random_inputs(&seed,input);
+    list_Values = values + (size_t)s*number_of_values;
+    list_get_system_inputs(NUMBER_OF_INPUT,input);
+  }
+  List_Quiet = 1;
+  t0 = now_seconds();
+  for(int s = 0; s < batch; s++){
+    list_Values = values + (size_t)s*number_of_values;
+    list_fuzzification();
+    list_rule_evaluation();
+    list_defuzzification();
+  }
+  repeats = repeats_for(now_seconds() - t0);
+  counter_open(&counter);
+  for(int stage = 0; stage < NUMBER_OF_STAGE; stage++){
+    long long cycles, instructions, misses;
+    double t1;
+    counter_start(&counter);
+    t1 = now_seconds();
+    for(int r = 0; r < repeats; r++)
+      for(int s = 0; s < batch; s++){
+        list_Values = values + (size_t)s*number_of_values;
+        if(stage == 0 || stage == 3)list_fuzzification();
+        if(stage == 1 || stage == 3)list_rule_evaluation();
+        if(stage == 2 || stage == 3)list_defuzzification();
+      }
+    t1 = now_seconds() - t1;
+    counter_stop(&counter,&cycles,&instructions,&misses);
+    report("list",benchStageName[stage],batch,(long long)repeats*batch,t1,cycles,instructions,misses);
+  }
+  counter_close(&counter);
+  List_Quiet = 0;
+  for(int s = 0; s < batch; s++)
+    for(int o = 0; o < NUMBER_OF_OUTPUT; o++)
+      if(values[(size_t)s*number_of_values + list_output(o)] != output[s*NUMBER_OF_OUTPUT + o])mismatch++;
+  list_Values = own;
+  free(values);
+  return mismatch;
+}
@@ -9,74 +9,205 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-struct io_type *System_Inputs;           /* anchor inputs NEW */
-struct io_type *System_Output;           /* anchor output NEW */
+#if defined(__unix__) || defined(__APPLE__)
+#define MAP_MODEL                         /* binary models are mmap()ed, not read */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #define MAXNAME 10
+#define MAXTOKEN 64                       /* longest token read from a file, longer names are an error */
+#define TOKEN "%63s"                      /* fscanf format bounded to MAXTOKEN-1 */
 #define UPPER_LIMIT 255
+#define ARENA_START 4096                  /* first arena size in bytes, doubled as needed */
+#define MODEL_MAGIC 0x4d5a5546            /* "FUZM" read as a little-endian int */
+#define MODEL_VERSION 3                   /* bump whenever a record layout changes */
+#define MODEL_BYTE_ORDER 0x01020304       /* reads back differently on a foreign byte order */
+#define DONT_CARE "-"                     /* rules file: input not tested, output not concluded */
+#define TSK_MARK '='                      /* rules file: "=c0+c1*in1-c2*in2" is a TSK consequent */
+#define TSK_FRACTION_BITS 16              /* TSK coefficients are fixed point */
+#define TSK_COEFFICIENT_LIMIT 32767
+/* The whole model lives in one arena, Model. Every link is the byte offset
+   of a record in the arena, 0 ends a list (offset 0 is the model_type
+   header, no record lives there), so the arena can grow with realloc and
+   is freed with one call. Every value field is an index into Values[],
+   the arena itself is never written while evaluating.
+   The arena is also the binary model format: "-c file" writes it out as is
+   (slopes and rule indices already resolved) and "-m file" maps it back
+   read-only and evaluates in place, no parsing or copies, only Values[] is
+   allocated. */
+struct model_type{
+  int magic;                              /* MODEL_MAGIC */
+  int version;                            /* MODEL_VERSION */
+  int byte_order;                         /* MODEL_BYTE_ORDER as written */
+  int size;                               /* bytes of arena in use */
+  int number_of_values;                   /* entries needed in Values[] */
+  int System_Inputs;                      /* anchor inputs */
+  int System_Output;                      /* anchor output */
+  int Rule_Base;
+  int Tsk;                                /* 1: Takagi-Sugeno, rules conclude consequent_type lists */
+};
 struct io_type{
   char name[MAXNAME];
   int value;
-  struct mf_type *membership_functions;
-  struct io_type *next;
+  int membership_functions;
+  int next;
 };
 struct mf_type{
   char name[MAXNAME];
   int value;
   int point1;
   int point2;
-  float slope1;
-  float slope2;
-  struct mf_type *next;
+  int slope1;
+  int slope2;
+  int next;
 };
+/* A rule has any number of antecedents (ANDed) and consequents, one per
+   input/output at most. The common two antecedents, one consequent shape
+   is also kept inline in pair/then_value so rule_evaluation() skips the
+   list walk; the lists stay complete for everything else. A TSK rule
+   concludes tsk_side instead of then_side and keeps its firing strength
+   in Values[strength] */
 struct rule_type{
-  struct rule_element_type *if_side;
-  struct rule_element_type *then_side;
-  struct rule_type *next;
+  int if_side;
+  int then_side;
+  int pair;                               /* 1: exactly if_value[2] => then_value */
+  int if_value[2];
+  int then_value;
+  int tsk_side;
+  int strength;
+  int next;
 };
 struct rule_element_type{
-  int *value;
-  struct rule_element_type *next;
+  int value;
+  int next;
 };
-struct rule_type *Rule_Base;
-struct rule_type *Rule_Base;
-float max(float a, float b);
-float min(float a, float b);
+/* TSK consequent: output value is coefficient plus every term's
+   coefficient times its input, TSK_FRACTION_BITS fraction */
+struct consequent_type{
+  int value;                              /* the output */
+  int coefficient;
+  int terms;
+  int next;
+};
+struct term_type{
+  int value;                              /* the input */
+  int coefficient;
+  int next;
+};
+#define AT(type,offset) ((struct type *)(Model+(offset)))
+#define HEADER AT(model_type,0)
+char *Model;                              /* the arena, model_type header first */
+int Model_Allocated;                      /* bytes allocated for the arena, 0 when mapped */
+int Model_Mapped;                         /* bytes mapped by map_system() */
+int *Values;                              /* system inputs/outputs and degrees of membership */
+int *Names;                               /* load time only: (io, mf) pairs hashed by name */
+int Names_Size;                           /* slots in Names, a power of two */
+int Names_Used;
+int max(int a, int b);
+int min(int a, int b);
 void fuzzification();
 void rule_evaluation();
 void defuzzification();
+void tsk_defuzzification();
 void compute_degree_of_membership(struct mf_type *mf,int input);
 int compute_area_of_trapezoid(struct mf_type *mf);
 void initialize_system();
+void free_system();
+void write_system(char *filename);
+void map_system(char *filename);
+int check_list(int offset, int record, int count);
+void validate_system(char *filename, int file_size);
+int arena_alloc(int size);
+int read_fuzzy_set(char *filename);
+unsigned int hash_name(int io, const char *name);
+void insert_name(int io, int mf);
+int find_name(int io, const char *name);
 void put_system_outputs();
-void get_system_inputs(int input1,int input2);
-int main(){
+int append_element(int last, int mf);
+int read_consequent(int last, int ioptr, const char *text);
+void get_system_inputs(int count, const int *input);
+/* usage: program [-c model | -m model] [input values...]
+   with no input values the inputs are 60 and 125 */
+int main(int argc, char *argv[]){
+  int first=1;
+  int input[argc+2];
+  int count=0;
+  if(argc>2&&strcmp(argv[1],"-c")==0){  /* compile text files into a binary model */
+    initialize_system();
+    write_system(argv[2]);
+    free_system();
+    return 0;
+  }
+  if(argc>2&&strcmp(argv[1],"-m")==0)first=3;
+  for(int i=first;i<argc;i++)input[count++]=atoi(argv[i]);
+  if(count==0){                         // provide input here
+    input[count++]=60;
+    input[count++]=125;
+  }
+  if(first==3){                         /* evaluate straight from a binary model */
+    map_system(argv[2]);
+    Values=calloc(HEADER->number_of_values,sizeof(int));
+    if(Values==NULL){
+      printf("ERROR- Out of memory reading the model.\n");
+      exit(1);
+    }
+    get_system_inputs(count,input);
+    fuzzification();
+    rule_evaluation();
+    defuzzification();
+    put_system_outputs();
+    free_system();
+    return 0;
+  }
   initialize_system();                  /* Read input files, NEW */
-  get_system_inputs(60,125);            // provide input here
+  get_system_inputs(count,input);
   fuzzification();
   rule_evaluation();
   defuzzification();
   put_system_outputs();                 /* print all data, NEW */
+  free_system();
+  return 0;
 }                                        /* END MAIN */
 void fuzzification(){
-  struct io_type *si;
-  struct mf_type *mf;
-  for(si=System_Inputs;si!=NULL;si=si->next)
-  for(mf=si->membership_functions;mf!=NULL;mf=mf->next)
-  compute_degree_of_membership(mf,si->value);
+  int si;
+  int mf;
+  for(si=HEADER->System_Inputs;si!=0;si=AT(io_type,si)->next)
+  for(mf=AT(io_type,si)->membership_functions;mf!=0;mf=AT(mf_type,mf)->next)
+  compute_degree_of_membership(AT(mf_type,mf),Values[AT(io_type,si)->value]);
 }                                        /* END FUZZIFICATION */
 void rule_evaluation(){
-  struct rule_type *rule;
-  struct rule_element_type *ip;    /* if ptr */
-  struct rule_element_type *tp;    /* then ptr */
+  int rule;
+  int ip;    /* if ptr */
+  int tp;    /* then ptr */
+  int so;
+  int mf;
   int strength;
   int nomatch=0;                   /* NEW, test some rules */
-  for(rule=Rule_Base;rule!=NULL;rule=rule->next){
+  for(so=HEADER->System_Output;so!=0;so=AT(io_type,so)->next)  /* consequents aggregate per call */
+  for(mf=AT(io_type,so)->membership_functions;mf!=0;mf=AT(mf_type,mf)->next)
+  Values[AT(mf_type,mf)->value]=0;
+  for(rule=HEADER->Rule_Base;rule!=0;rule=AT(rule_type,rule)->next){
+    if(AT(rule_type,rule)->pair){      /* fast path, no list walk */
+      int *then=&Values[AT(rule_type,rule)->then_value];
+      strength=min(Values[AT(rule_type,rule)->if_value[0]],Values[AT(rule_type,rule)->if_value[1]]);
+      *then=max(strength,*then);
+      if(strength>0)nomatch=1;
+      continue;
+    }
     strength=UPPER_LIMIT;
-    for(ip=rule->if_side;ip!=NULL;ip=ip->next){
-      strength=min(strength,*(ip->value));
+    for(ip=AT(rule_type,rule)->if_side;ip!=0;ip=AT(rule_element_type,ip)->next){
+      strength=min(strength,Values[AT(rule_element_type,ip)->value]);
+    }
+    if(AT(rule_type,rule)->tsk_side){     /* averaged by tsk_defuzzification() */
+      Values[AT(rule_type,rule)->strength]=strength;
+      if(strength>0)nomatch=1;
+      continue;
     }
-    for(tp=rule->then_side;tp!=NULL;tp=tp->next){
-      {  *(tp->value)=max(strength,*(tp->value));      /* NEW */
+    for(tp=AT(rule_type,rule)->then_side;tp!=0;tp=AT(rule_element_type,tp)->next){
+      {  int *then=&Values[AT(rule_element_type,tp)->value];
+        *then=max(strength,*then);                     /* NEW */
         if(strength>0)nomatch=1;                      /* NEW */
       }
     }                                            /* NEW */
@@ -84,269 +215,537 @@ void rule_evaluation(){
   if(nomatch==0)printf("NO MATCHING RULES FOUND!\n"); /* NEW */
 }                                        /* END RULE EVALUATION */
 void defuzzification(){
-  struct io_type *so;
-  struct mf_type *mf;
+  int so;
+  int mf;
   int sum_of_products;
   int sum_of_areas;
   int area, centroid;
-  for(so=System_Output;so!=NULL;so=so->next){
+  if(HEADER->Tsk){
+    tsk_defuzzification();
+    return;
+  }
+  for(so=HEADER->System_Output;so!=0;so=AT(io_type,so)->next){
     sum_of_products=0;
     sum_of_areas=0;
-    for(mf=so->membership_functions;mf!=NULL;mf=mf->next){
-      area=compute_area_of_trapezoid(mf);
-      centroid=mf->point1+(mf->point2-mf->point1)/2;
+    for(mf=AT(io_type,so)->membership_functions;mf!=0;mf=AT(mf_type,mf)->next){
+      area=compute_area_of_trapezoid(AT(mf_type,mf));
+      centroid=AT(mf_type,mf)->point1+(AT(mf_type,mf)->point2-AT(mf_type,mf)->point1)/2;
       sum_of_products+=area*centroid;
       sum_of_areas+=area;
     }
     if(sum_of_areas==0){                                    /* NEW */
       printf("Sum of Areas = 0, will cause div error\n"); /* NEW */
       printf("Sum of Products= %d\n",sum_of_products);    /* NEW */
-      so->value=0;                                        /* NEW */
-      return;                                             /* NEW */
+      Values[AT(io_type,so)->value]=0;                    /* NEW */
+      continue;                                           /* NEW, other outputs still defuzzify */
     }                                                      /* NEW */
-    so->value=sum_of_products/sum_of_areas;
+    Values[AT(io_type,so)->value]=sum_of_products/sum_of_areas;
   }
 }                                        /* END DEFUZZIFICATION */
+/* Takagi-Sugeno: each output is the strength-weighted average of the
+   consequents concluding it, no areas */
+void tsk_defuzzification(){
+  int so;
+  int rule;
+  int cp;    /* consequent ptr */
+  int tp;    /* term ptr */
+  long long sum_of_products;
+  int sum_of_strengths;
+  for(so=HEADER->System_Output;so!=0;so=AT(io_type,so)->next){
+    sum_of_products=0;
+    sum_of_strengths=0;
+    for(rule=HEADER->Rule_Base;rule!=0;rule=AT(rule_type,rule)->next){
+      int strength=Values[AT(rule_type,rule)->strength];
+      if(strength==0)continue;
+      for(cp=AT(rule_type,rule)->tsk_side;cp!=0;cp=AT(consequent_type,cp)->next){
+        long long z=AT(consequent_type,cp)->coefficient;
+        if(AT(consequent_type,cp)->value!=AT(io_type,so)->value)continue;
+        for(tp=AT(consequent_type,cp)->terms;tp!=0;tp=AT(term_type,tp)->next)
+          z+=(long long)AT(term_type,tp)->coefficient*Values[AT(term_type,tp)->value];
+        sum_of_products+=strength*z;
+        sum_of_strengths+=strength;
+      }
+    }
+    if(sum_of_strengths==0){
+      printf("Sum of Strengths = 0, will cause div error\n");
+      Values[AT(io_type,so)->value]=0;
+      continue;
+    }
+    Values[AT(io_type,so)->value]=(int)(sum_of_products/((long long)sum_of_strengths*(1<<TSK_FRACTION_BITS)));
+  }
+}                                        /* END TSK DEFUZZIFICATION */
 void compute_degree_of_membership(struct mf_type *mf, int input){
   int delta_1, delta_2;
   delta_1=input - mf->point1;
   delta_2=mf->point2 - input;
-  if((delta_1<=0)||(delta_2<=0))mf->value=0;
+  if((delta_1<=0)||(delta_2<=0))Values[mf->value]=0;
   else{
-    mf->value=min((mf->slope1*delta_1),(mf->slope2*delta_2));
-    mf->value=min(mf->value,UPPER_LIMIT);
+    Values[mf->value]=min((mf->slope1*delta_1),(mf->slope2*delta_2));
+    Values[mf->value]=min(Values[mf->value],UPPER_LIMIT);
   }
 }                                        /* END DEGREE OF MEMBERSHIP */
 int compute_area_of_trapezoid(struct mf_type *mf){
   int run_1,run_2,area,top;
   int base;
+  int value=Values[mf->value];
   base=mf->point2 - mf->point1;
-  run_1=mf->value / mf->slope1;
-  run_2=mf->value / mf->slope2;
+  run_1=value / mf->slope1;
+  run_2=value / mf->slope2;
   top=base - run_1 - run_2;
-  area=mf->value*(base+top)/2;
+  area=value*(base+top)/2;
   return area;
 }                                        /* END AREA OF TRAPEZOID */
-void initialize_system(){                      /* NEW FUNCTION INITIALIZE */
-  int a, b, c, d, x;
-  char buff[10],buff1[4],buff2[4];
-  static char filename1[]="in1.txt";  /* "angles" filename */
-  static char filename2[]="in2.txt";  /* "velocities" filename */
-  static char filename3[]="out1.txt"; /* "forces" filename */
-  FILE *fp;
-  struct io_type *outptr;
-  struct mf_type *top_mf;
-  struct mf_type *mfptr;
-  struct io_type *ioptr;
-  struct rule_type *ruleptr;
-  struct rule_element_type *ifptr;
-  struct rule_element_type *thenptr;
-  ioptr=NULL;
-  ruleptr=NULL;
-  ifptr=NULL;
-  thenptr=NULL;
-  /* READ THE FIRST FUZZY SET (ANTECEDENT); INITIALIZE STRUCTURES */
-  if((fp=fopen(filename1,"r"))==NULL){   /* open "angles" file */
-
-  printf("ERROR- Unable to open data file named %s.\n",filename1);
-  exit(0);
+/* zeroed record of size bytes at the end of the arena, returns its offset.
+   Pointers into the arena are stale after this call, offsets are not */
+int arena_alloc(int size){
+  int offset;
+  size=(size+7)&~7;                       /* keep every record 8-byte aligned */
+  while(HEADER->size+size>Model_Allocated){
+    char *grown=realloc(Model,2*Model_Allocated);
+    if(grown==NULL){
+      printf("ERROR- Out of memory reading the model.\n");
+      exit(1);
+    }
+    memset(grown+Model_Allocated,0,Model_Allocated);
+    Model=grown;
+    Model_Allocated*=2;
+  }
+  offset=HEADER->size;
+  HEADER->size+=size;
+  return offset;
+}                                        /* END ARENA ALLOC */
+unsigned int hash_name(int io, const char *name){  /* FNV-1a over io and name */
+  unsigned int h=2166136261u^(unsigned int)io;
+  for(;*name;name++)h=(h^(unsigned char)*name)*16777619u;
+  return h;
 }
-ioptr=(struct io_type *)calloc(1,sizeof(struct io_type));
-System_Inputs=ioptr;                  /* Anchor to top of inputs */
-x=fscanf(fp,"%s",buff);               /* from 1st line, get set's name */
-sprintf(ioptr->name,"%s",buff);       /* into struct io_type.name */
-mfptr=NULL;
-while((x=fscanf(fp,"%s %d %d %d %d",buff,&a,&b,&c,&d))!=EOF){/* get line */
-
-  if(mfptr==NULL){                    /* first time thru only */
-    mfptr=(struct mf_type *)calloc(1,sizeof(struct mf_type));
-    top_mf=mfptr;
-    ioptr->membership_functions=mfptr;
+/* first definition of a name in a set wins, like the original strcmp scan */
+void insert_name(int io, int mf){
+  unsigned int slot;
+  if(find_name(io,AT(mf_type,mf)->name)!=0)return;
+  if(2*(Names_Used+1)>Names_Size){        /* keep the table at most half full */
+    int *old=Names;
+    int oldSize=Names_Size;
+    Names_Size=Names_Size?2*Names_Size:64;
+    Names=calloc(2*Names_Size,sizeof(int));
+    if(Names==NULL){
+      printf("ERROR- Out of memory reading the model.\n");
+      exit(1);
+    }
+    Names_Used=0;
+    for(int i=0;i<oldSize;i++)if(old[2*i+1]!=0)insert_name(old[2*i],old[2*i+1]);
+    free(old);
   }
-  else{
-    for(mfptr=top_mf;mfptr->next;mfptr=mfptr->next); /* spin to last */
-    mfptr->next=(struct mf_type *)calloc(1,sizeof(struct mf_type));
-    mfptr=mfptr->next;
-  }
-  sprintf(mfptr->name,"%s",buff);    /* membership name, NL, ZE, etc */
-  mfptr->point1=a;                   /* left x axis value */
-  mfptr->point2=d;                   /* right x axis value */
-  printf("a = %d\n", a);
-  printf("b = %d\n", b);
-  printf("c = %d\n", c);
-  printf("d = %d\n", d);
-    mfptr->slope1=UPPER_LIMIT/(b-a);     /* left slope */
-    mfptr->slope2=UPPER_LIMIT/(d-c);     /* right slope */
+  slot=hash_name(io,AT(mf_type,mf)->name)&(Names_Size-1);
+  while(Names[2*slot+1]!=0)slot=(slot+1)&(Names_Size-1);
+  Names[2*slot]=io;
+  Names[2*slot+1]=mf;
+  Names_Used++;
 }
-close(fp);                            /* close "angles" file */
-/* READ THE SECOND FUZZY SET (ANTECEDENT); INITIALIZE STRUCTURES */
-if((fp=fopen(filename2,"r"))==NULL){   /* open "velocity" file */
-
-printf("ERROR- Unable to open data file named %s.\n",filename2);
-
-exit(0);
+int find_name(int io, const char *name){  /* offset of the mf, 0 if not found */
+  unsigned int slot;
+  if(Names_Size==0)return 0;
+  slot=hash_name(io,name)&(Names_Size-1);
+  for(;Names[2*slot+1]!=0;slot=(slot+1)&(Names_Size-1))
+    if(Names[2*slot]==io&&strcmp(AT(mf_type,Names[2*slot+1])->name,name)==0)return Names[2*slot+1];
+  return 0;
 }
-ioptr->next=(struct io_type *)calloc(1,sizeof(struct io_type));
-ioptr=ioptr->next;
-x=fscanf(fp,"%s",buff);               /* from 1st line, get set's name */
-sprintf(ioptr->name,"%s",buff);       /* into struct io_type.name */
-mfptr=NULL;
-while((x=fscanf(fp,"%s %d %d %d %d",buff,&a,&b,&c,&d))!=EOF){/* get line */
-  if(mfptr==NULL){                    /* first time thru only */
-    mfptr=(struct mf_type *)calloc(1,sizeof(struct mf_type));
-    top_mf=mfptr;
-    ioptr->membership_functions=mfptr;
+/* read one fuzzy set file: its name, then one "name a b c d" line per
+   membership function. Returns the offset of its io_type */
+int read_fuzzy_set(char *filename){
+  int a, b, c, d, x;
+  char buff[MAXTOKEN];
+  FILE *fp;
+  int ioptr, mfptr, last_mf;
+  if((fp=fopen(filename,"r"))==NULL){
+    printf("ERROR- Unable to open data file named %s.\n",filename);
+    exit(0);
   }
-  else{
-    for(mfptr=top_mf;mfptr->next;mfptr=mfptr->next); /* spin to last */
-    mfptr->next=(struct mf_type *)calloc(1,sizeof(struct mf_type));
-    mfptr=mfptr->next;
-  }
-  sprintf(mfptr->name,"%s",buff);    /* membership name, NL, ZE, etc */
-  mfptr->point1=a;                   /* left x axis value */
-  mfptr->point2=d;                   /* right x axis value */
-  if(b-a>0) mfptr->slope1=UPPER_LIMIT/(b-a);     /* left slope */
-  else{
-    printf("Error in input file %s, membership element %s.\n",
-    filename2,buff);
+  if(fscanf(fp,TOKEN,buff)!=1||strlen(buff)>=MAXNAME){  /* from 1st line, get set's name */
+    printf("Error in input file %s, bad set name.\n",filename);
     exit(1);
   }
-  if(d-c>0) mfptr->slope2=UPPER_LIMIT/(d-c);     /* right slope */
-  else{
-    printf("Error in input file %s, membership element %s.\n",
-    filename2,buff);
-    exit(1);
+  ioptr=arena_alloc(sizeof(struct io_type));
+  sprintf(AT(io_type,ioptr)->name,"%s",buff);    /* into struct io_type.name */
+  AT(io_type,ioptr)->value=HEADER->number_of_values++;
+  last_mf=0;
+  while((x=fscanf(fp,TOKEN" %d %d %d %d",buff,&a,&b,&c,&d))!=EOF){/* get line */
+    if(x!=5||strlen(buff)>=MAXNAME||b-a<=0||d-c<=0){
+      printf("Error in input file %s, membership element %s.\n",filename,buff);
+      exit(1);
+    }
+    mfptr=arena_alloc(sizeof(struct mf_type));
+    if(last_mf==0)AT(io_type,ioptr)->membership_functions=mfptr;
+    else AT(mf_type,last_mf)->next=mfptr;       /* append, no spin to last */
+    last_mf=mfptr;
+    sprintf(AT(mf_type,mfptr)->name,"%s",buff);  /* membership name, NL, ZE, etc */
+    AT(mf_type,mfptr)->value=HEADER->number_of_values++;
+    AT(mf_type,mfptr)->point1=a;                 /* left x axis value */
+    AT(mf_type,mfptr)->point2=d;                 /* right x axis value */
+    AT(mf_type,mfptr)->slope1=UPPER_LIMIT/(b-a); /* left slope */
+    AT(mf_type,mfptr)->slope2=UPPER_LIMIT/(d-c); /* right slope */
+    insert_name(ioptr,mfptr);
   }
+  fclose(fp);
+  return ioptr;
+}                                        /* END READ FUZZY SET */
+/* new rule element after last (0 starts a list), returns its offset */
+int append_element(int last, int mf){
+  int elementptr=arena_alloc(sizeof(struct rule_element_type));
+  AT(rule_element_type,elementptr)->value=AT(mf_type,mf)->value;  /* needs index here */
+  if(last!=0)AT(rule_element_type,last)->next=elementptr;
+  return elementptr;
 }
-close(fp);                            /* close "velocity" file */
-/* READ THE THIRD FUZZY SET (CONSEQUENCE); INITIALIZE STRUCTURES */
-if((fp=fopen(filename3,"r"))==NULL)   /* open "force" file */
-{
-  printf("ERROR- Unable to open data file named %s.\n",filename3);
-  exit(0);
+/* TSK consequent "=c0+c1*in1-c2*in2" of output ioptr after last (0 starts
+   a list): a constant and signed coefficient*input terms, inputs by name,
+   a term may repeat and is summed into one. Returns its offset, 0 on a
+   syntax error or a coefficient, summed, NaN or beyond TSK_COEFFICIENT_LIMIT */
+int read_consequent(int last, int ioptr, const char *text){
+  const long long limit=(long long)TSK_COEFFICIENT_LIMIT<<TSK_FRACTION_BITS;
+  const char *p=text+1;
+  int consequentptr, termptr, inputptr;
+  int coefficient;
+  long long sum;
+  if(*p==0)return 0;
+  consequentptr=arena_alloc(sizeof(struct consequent_type));
+  AT(consequent_type,consequentptr)->value=AT(io_type,ioptr)->value;
+  while(*p){
+    char *end;
+    double value=strtod(p,&end);
+    if(end==p||!(value<=TSK_COEFFICIENT_LIMIT&&value>=-TSK_COEFFICIENT_LIMIT))return 0;
+    coefficient=(int)(value*(1<<TSK_FRACTION_BITS)+(value<0?-0.5:0.5));
+    p=end;
+    inputptr=0;
+    if(*p=='*'){                          /* coefficient of an input */
+      size_t length=strcspn(++p,"+-");
+      if(length>=MAXNAME)return 0;
+      for(inputptr=HEADER->System_Inputs;inputptr!=0;inputptr=AT(io_type,inputptr)->next)
+        if(strncmp(AT(io_type,inputptr)->name,p,length)==0&&AT(io_type,inputptr)->name[length]==0)break;
+      if(inputptr==0)return 0;
+      p+=length;
+    }
+    if(*p!=0&&*p!='+'&&*p!='-')return 0;
+    if(inputptr==0){
+      sum=(long long)AT(consequent_type,consequentptr)->coefficient+coefficient;
+      if(sum>limit||sum<-limit)return 0;
+      AT(consequent_type,consequentptr)->coefficient=(int)sum;
+      continue;
+    }
+    for(termptr=AT(consequent_type,consequentptr)->terms;termptr!=0;termptr=AT(term_type,termptr)->next)
+      if(AT(term_type,termptr)->value==AT(io_type,inputptr)->value)break;
+    if(termptr==0){
+      termptr=arena_alloc(sizeof(struct term_type));
+      AT(term_type,termptr)->value=AT(io_type,inputptr)->value;
+      AT(term_type,termptr)->next=AT(consequent_type,consequentptr)->terms;  /* order does not matter */
+      AT(consequent_type,consequentptr)->terms=termptr;
+    }
+    sum=(long long)AT(term_type,termptr)->coefficient+coefficient;
+    if(sum>limit||sum<-limit)return 0;
+    AT(term_type,termptr)->coefficient=(int)sum;
+  }
+  if(last!=0)AT(consequent_type,last)->next=consequentptr;
+  return consequentptr;
 }
-ioptr=(struct io_type *)calloc(1,sizeof(struct io_type));
-System_Output=ioptr;                  /* Anchor output structure */
-x=fscanf(fp,"%s",buff);               /* from 1st line, get set's name */
-sprintf(ioptr->name,"%s",buff);       /* into struct io_type.name */
-mfptr=NULL;
-while((x=fscanf(fp,"%s %d %d %d %d",buff,&a,&b,&c,&d))!=EOF){/* get line */
-  if(mfptr==NULL){                    /* first time thru */
-    mfptr=(struct mf_type *)calloc(1,sizeof(struct mf_type));
-    top_mf=mfptr;
-    ioptr->membership_functions=mfptr;
+/* The fuzzy set files come from system.txt, one "input file" or
+   "output file" line each, in rule column order. Without system.txt the
+   model is in1.txt, in2.txt => out1.txt as before. rules.txt then has one
+   mf name per input followed by one per output, DONT_CARE skips one. An
+   output column of TSK_MARK and a linear form makes a TSK rule, then all
+   rules must be */
+void initialize_system(){                      /* NEW FUNCTION INITIALIZE */
+  int x;
+  char buff[MAXTOKEN];
+  char kind[MAXTOKEN];
+  static char filename1[]="in1.txt";  /* "angles" filename */
+  static char filename2[]="in2.txt";  /* "velocities" filename */
+  static char filename3[]="out1.txt"; /* "forces" filename */
+  FILE *fp;
+  int ioptr, mfptr, ruleptr;
+  int last_rule, last_if, last_then, last_tsk;
+  int last_input=0, last_output=0;
+  int ifs, thens, tsks, ios;
+  int tsk_rules=0;
+  int cnt=0;
+  Model_Allocated=ARENA_START;
+  Model=calloc(1,Model_Allocated);
+  if(Model==NULL){
+    printf("ERROR- Out of memory reading the model.\n");
+    exit(1);
+  }
+  HEADER->magic=MODEL_MAGIC;
+  HEADER->version=MODEL_VERSION;
+  HEADER->byte_order=MODEL_BYTE_ORDER;
+  HEADER->size=(sizeof(struct model_type)+7)&~7;
+  /* READ THE FUZZY SETS (ANTECEDENTS, CONSEQUENCE); INITIALIZE STRUCTURES,
+     reading moves the arena so results go through a local first */
+  if((fp=fopen("system.txt","r"))==NULL){
+    ioptr=read_fuzzy_set(filename1);
+    HEADER->System_Inputs=ioptr;                                /* Anchor to top of inputs */
+    ioptr=read_fuzzy_set(filename2);
+    AT(io_type,HEADER->System_Inputs)->next=ioptr;
+    ioptr=read_fuzzy_set(filename3);
+    HEADER->System_Output=ioptr;                                /* Anchor output structure */
   }
   else{
-    for(mfptr=top_mf;mfptr->next;mfptr=mfptr->next);
-    mfptr->next=(struct mf_type *)calloc(1,sizeof(struct mf_type));
-    mfptr=mfptr->next;
-  }
-  sprintf(mfptr->name,"%s",buff);    /* membership name, NL, ZE, etc */
-  mfptr->point1=a;                   /* left x axis value */
-  mfptr->point2=d;                   /* right x axis value */
-  if(b-a>0) mfptr->slope1=UPPER_LIMIT/(b-a);     /* left slope */
-  else{
-    printf("Error in input file %s, membership element %s.\n",
-    filename3,buff);
+    while((x=fscanf(fp,TOKEN" "TOKEN,kind,buff))!=EOF){
+      if(x!=2||(strcmp(kind,"input")!=0&&strcmp(kind,"output")!=0)){
+        printf("Error in system file, line %s.\n",kind);
+        exit(1);
+      }
+      ioptr=read_fuzzy_set(buff);
+      if(strcmp(kind,"input")==0){
+        if(last_input==0)HEADER->System_Inputs=ioptr;
+        else AT(io_type,last_input)->next=ioptr;
+        last_input=ioptr;
+      }
+      else{
+        if(last_output==0)HEADER->System_Output=ioptr;
+        else AT(io_type,last_output)->next=ioptr;
+        last_output=ioptr;
+      }
+    }
+    fclose(fp);
+    if(HEADER->System_Inputs==0||HEADER->System_Output==0){
+      printf("Error in system file, needs at least one input and one output.\n");
+      exit(1);
+    }
+  }
+  /* READ RULES FILE; INITIALIZE STRUCTURES */
+  if((fp=fopen("rules.txt","r"))==NULL){     /* open rules file */
+    printf("ERROR- Unable to open data file named %s.\n","rules");
+    exit(0);
+  }
+  last_rule=0;
+  while((x=fscanf(fp,TOKEN,buff))!=EOF){ /* get a line, one name per input and output */
+    ruleptr=arena_alloc(sizeof(struct rule_type));
+    if(last_rule==0)HEADER->Rule_Base=ruleptr;   /* first time thru, anchor */
+    else AT(rule_type,last_rule)->next=ruleptr;
+    last_rule=ruleptr;
+    cnt++;
+    last_if=last_then=last_tsk=0;
+    ifs=thens=tsks=ios=0;
+    /* inputs then outputs, the two lists walked as one column sequence */
+    for(ioptr=HEADER->System_Inputs;ioptr!=0;){
+      if(ios++>0&&fscanf(fp,TOKEN,buff)!=1)buff[0]=0;
+      if(last_if<0&&buff[0]==TSK_MARK){   /* TSK consequent */
+        if((last_tsk=read_consequent(last_tsk,ioptr,buff))==0){
+          printf("Error in rules file, consequent %s.\n",buff);
+          exit(1);
+        }
+        if(tsks++==0)AT(rule_type,ruleptr)->tsk_side=last_tsk;
+      }
+      else if(strcmp(buff,DONT_CARE)!=0){
+        if((mfptr=find_name(ioptr,buff))==0){
+          printf("Error in rules file, membership element %s.\n",buff);
+          exit(1);
+        }
+        if(last_if>=0){                  /* still reading antecedents */
+          last_if=append_element(last_if,mfptr);
+          if(ifs<2)AT(rule_type,ruleptr)->if_value[ifs]=AT(mf_type,mfptr)->value;
+          if(ifs++==0)AT(rule_type,ruleptr)->if_side=last_if;
+        }
+        else{
+          last_then=append_element(last_then,mfptr);
+          AT(rule_type,ruleptr)->then_value=AT(mf_type,mfptr)->value;
+          if(thens++==0)AT(rule_type,ruleptr)->then_side=last_then;
+        }
+      }
+      ioptr=AT(io_type,ioptr)->next;
+      if(ioptr==0&&last_if>=0){          /* point then stuff to outputs */
+        ioptr=HEADER->System_Output;
+        last_if=-1;
+      }
+    }
+    if(ifs==0||thens+tsks==0){
+      printf("Error in rules file, rule #%d needs an antecedent and a consequent.\n",cnt);
+      exit(1);
+    }
+    if((tsks>0&&thens>0)||(cnt>1&&(tsks>0)!=(tsk_rules>0))){
+      printf("Error in rules file, rule #%d mixes TSK and mf consequents.\n",cnt);
+      exit(1);
+    }
+    if(tsks>0){
+      AT(rule_type,ruleptr)->strength=HEADER->number_of_values++;
+      tsk_rules++;
+    }
+    AT(rule_type,ruleptr)->pair=(ifs==2&&thens==1);
+  }                                     /* END WHILE READING RULES FILE */
+  fclose(fp);                           /* close "rules" file */
+  HEADER->Tsk=(tsk_rules>0);
+  free(Names);                          /* names are resolved, only offsets remain */
+  Names=NULL;
+  Names_Size=Names_Used=0;
+  Values=calloc(HEADER->number_of_values,sizeof(int));
+  if(Values==NULL){
+    printf("ERROR- Out of memory reading the model.\n");
     exit(1);
   }
-  if(d-c>0) mfptr->slope2=UPPER_LIMIT/(d-c);     /* right slope */
-  else{
-    printf("Error in input file %s, membership element %s.\n",
-    filename3,buff);
+}                                        /* END INITIALIZE */
+void free_system(){                      /* the whole model is one allocation */
+#ifdef MAP_MODEL
+  if(Model_Mapped)munmap(Model,Model_Mapped);
+  else
+#endif
+  free(Model);
+  free(Values);
+  Model=NULL;
+  Values=NULL;
+  Model_Allocated=Model_Mapped=0;
+}                                        /* END FREE SYSTEM */
+void write_system(char *filename){        /* the arena is the file format */
+  FILE *fp;
+  if((fp=fopen(filename,"wb"))==NULL){
+    printf("ERROR- Unable to open data file named %s.\n",filename);
+    exit(0);
+  }
+  if(fwrite(Model,1,HEADER->size,fp)!=(size_t)HEADER->size||fclose(fp)!=0){
+    printf("ERROR- Unable to write data file named %s.\n",filename);
     exit(1);
   }
+}                                        /* END WRITE SYSTEM */
+/* a list must stay inside the arena, on record boundaries, and end within
+   as many steps as records could fit, so a damaged file cannot loop */
+int check_list(int offset, int record, int count){
+  int steps=0;
+  for(;offset!=0;offset=*(int *)(Model+offset+record-sizeof(int))){
+    if(offset<(int)sizeof(struct model_type)||offset%8!=0||
+       offset>HEADER->size-record||++steps>count)return -1;
+  }
+  return steps;
 }
-close(fp);                            /* close "force" file */
-/* READ RULES FILE; INITIALIZE STRUCTURES */
-ioptr=NULL;
-outptr=NULL;
-if((fp=fopen("rules.txt","r"))==NULL){     /* open rules file */
-  printf("ERROR- Unable to open data file named %s.\n","rules");
-  exit(0);
-}
-ruleptr=(struct rule_type *)calloc(1,sizeof(struct rule_type));
-if(ioptr==NULL)Rule_Base=ruleptr;     /* first time thru, anchor */
-while((x=fscanf(fp,"%s %s %s",buff,buff1,buff2))!=EOF){ /* get a line */
-  ioptr=System_Inputs;               /* points to angle */
-  for(mfptr=ioptr->membership_functions;mfptr!=NULL;mfptr=mfptr->next){
-    if((strcmp(mfptr->name,buff))==0){
-      ifptr=(struct rule_element_type *)
-      calloc(1,sizeof(struct rule_element_type));
-      ruleptr->if_side=ifptr;      /* points to angle */
-      ifptr->value=&mfptr->value;  /* needs address here */
-      ifptr->next=(struct rule_element_type *)
-      calloc(1,sizeof(struct rule_element_type));
-      ifptr=ifptr->next;
-      break;                       /* match found */
-    }
+void validate_system(char *filename, int file_size){
+  int count=file_size/8;
+  int io, mf, rule, element;
+  int slots=0;                          /* Values[] entries the records own */
+  if(file_size<(int)sizeof(struct model_type)||HEADER->magic!=MODEL_MAGIC||
+     HEADER->version!=MODEL_VERSION||HEADER->byte_order!=MODEL_BYTE_ORDER||
+     HEADER->size!=file_size||HEADER->number_of_values<=0||HEADER->number_of_values>count||(HEADER->Tsk!=0&&HEADER->Tsk!=1)){
+    printf("Error in model file %s, not a version %d model for this machine.\n",filename,MODEL_VERSION);
+    exit(1);
   }
-  ioptr=ioptr->next;                 /* points to velocity */
-  for(mfptr=ioptr->membership_functions;mfptr!=NULL;mfptr=mfptr->next){
-    if((strcmp(mfptr->name,buff1))==0){
-      ifptr->value=&mfptr->value;  /* needs address here */
-      break;                       /* match found */
-    }
+  if(check_list(HEADER->System_Inputs,sizeof(struct io_type),count)<0||
+     check_list(HEADER->System_Output,sizeof(struct io_type),count)<0||
+     check_list(HEADER->Rule_Base,sizeof(struct rule_type),count)<0)goto bad;
+  for(int anchor=0;anchor<2;anchor++)
+  for(io=anchor?HEADER->System_Output:HEADER->System_Inputs;io!=0;io=AT(io_type,io)->next){
+    if((unsigned)AT(io_type,io)->value>=(unsigned)HEADER->number_of_values||
+       check_list(AT(io_type,io)->membership_functions,sizeof(struct mf_type),count)<0)goto bad;
+    slots++;
+    for(mf=AT(io_type,io)->membership_functions;mf!=0;mf=AT(mf_type,mf)->next,slots++)
+      if((unsigned)AT(mf_type,mf)->value>=(unsigned)HEADER->number_of_values||
+         AT(mf_type,mf)->slope1<=0||AT(mf_type,mf)->slope2<=0)goto bad;
   }
-  if(outptr==NULL)outptr=System_Output;/* point then stuff to output */
-  for(mfptr=outptr->membership_functions;mfptr!=NULL;mfptr=mfptr->next){
-    if((strcmp(mfptr->name,buff2))==0){
-      thenptr=(struct rule_element_type *)
-      calloc(1,sizeof(struct rule_element_type));
-      ruleptr->then_side=thenptr;
-      thenptr->value=&mfptr->value; /* needs address here */
-      break;                        /* match found */
+  for(rule=HEADER->Rule_Base;rule!=0;rule=AT(rule_type,rule)->next){
+    if(check_list(AT(rule_type,rule)->if_side,sizeof(struct rule_element_type),count)<0||
+       check_list(AT(rule_type,rule)->then_side,sizeof(struct rule_element_type),count)<0)goto bad;
+    for(element=AT(rule_type,rule)->if_side;element!=0;element=AT(rule_element_type,element)->next)
+      if((unsigned)AT(rule_element_type,element)->value>=(unsigned)HEADER->number_of_values)goto bad;
+    for(element=AT(rule_type,rule)->then_side;element!=0;element=AT(rule_element_type,element)->next)
+      if((unsigned)AT(rule_element_type,element)->value>=(unsigned)HEADER->number_of_values)goto bad;
+    if((AT(rule_type,rule)->tsk_side!=0)!=HEADER->Tsk||
+       check_list(AT(rule_type,rule)->tsk_side,sizeof(struct consequent_type),count)<0)goto bad;
+    if(HEADER->Tsk&&(unsigned)AT(rule_type,rule)->strength>=(unsigned)HEADER->number_of_values)goto bad;
+    slots+=HEADER->Tsk;
+    for(element=AT(rule_type,rule)->tsk_side;element!=0;element=AT(consequent_type,element)->next){
+      int term;
+      if((unsigned)AT(consequent_type,element)->value>=(unsigned)HEADER->number_of_values||
+         check_list(AT(consequent_type,element)->terms,sizeof(struct term_type),count)<0)goto bad;
+      for(term=AT(consequent_type,element)->terms;term!=0;term=AT(term_type,term)->next)
+        if((unsigned)AT(term_type,term)->value>=(unsigned)HEADER->number_of_values)goto bad;
     }
+    if(AT(rule_type,rule)->pair&&
+       ((unsigned)AT(rule_type,rule)->if_value[0]>=(unsigned)HEADER->number_of_values||
+        (unsigned)AT(rule_type,rule)->if_value[1]>=(unsigned)HEADER->number_of_values||
+        (unsigned)AT(rule_type,rule)->then_value>=(unsigned)HEADER->number_of_values))goto bad;
   }
-  ruleptr->next=(struct rule_type *)calloc(1,sizeof(struct rule_type));
-  ruleptr=ruleptr->next;
-}                                     /* END WHILE READING RULES FILE */
-close(fp);                            /* close "rules" file */
-}                                        /* END INITIALIZE */
+  if(HEADER->number_of_values!=slots)goto bad;  /* as many as initialize_system() gave out */
+  return;
+bad:
+  printf("Error in model file %s, damaged record links.\n",filename);
+  exit(1);
+}                                        /* END VALIDATE SYSTEM */
+/* Map a binary model read-only and shared: every process using the same
+   file shares its page cache copy. Values[] is left to the caller. */
+void map_system(char *filename){
+  int size;
+#ifdef MAP_MODEL
+  struct stat st;
+  int fd=open(filename,O_RDONLY);
+  if(fd<0||fstat(fd,&st)!=0){
+    printf("ERROR- Unable to open data file named %s.\n",filename);
+    exit(0);
+  }
+  size=(int)st.st_size;
+  Model=mmap(NULL,size>0?size:1,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);                            /* the mapping keeps the file */
+  if(Model==MAP_FAILED){
+    printf("ERROR- Unable to map data file named %s.\n",filename);
+    exit(1);
+  }
+  Model_Mapped=size>0?size:1;
+#else
+  FILE *fp;
+  if((fp=fopen(filename,"rb"))==NULL){
+    printf("ERROR- Unable to open data file named %s.\n",filename);
+    exit(0);
+  }
+  fseek(fp,0,SEEK_END);
+  size=(int)ftell(fp);
+  fseek(fp,0,SEEK_SET);
+  Model=malloc(size>0?size:1);
+  if(Model==NULL||fread(Model,1,size,fp)!=(size_t)size){
+    printf("ERROR- Unable to read data file named %s.\n",filename);
+    exit(1);
+  }
+  fclose(fp);
+  Model_Allocated=size;
+#endif
+  validate_system(filename,size);
+}                                        /* END MAP SYSTEM */
 void put_system_outputs(){                     /* NEW */
-  struct io_type *ioptr;
-  struct mf_type *mfptr;
-  struct rule_type *ruleptr;
-  struct rule_element_type *ifptr;
-  struct rule_element_type *thenptr;
+  int ioptr;
+  int mfptr;
+  int ruleptr;
+  int ifptr;
+  int thenptr;
   int cnt=1;
-  for(ioptr=System_Inputs;ioptr!=NULL;ioptr=ioptr->next){
-    printf("%s: Value= %d\n",ioptr->name,ioptr->value);
-    for(mfptr=ioptr->membership_functions;mfptr!=NULL;mfptr=mfptr->next){
+  for(ioptr=HEADER->System_Inputs;ioptr!=0;ioptr=AT(io_type,ioptr)->next){
+    printf("%s: Value= %d\n",AT(io_type,ioptr)->name,Values[AT(io_type,ioptr)->value]);
+    for(mfptr=AT(io_type,ioptr)->membership_functions;mfptr!=0;mfptr=AT(mf_type,mfptr)->next){
       printf("  %s: Value %d Left %d Right %d\n",
-      mfptr->name,mfptr->value,mfptr->point1,mfptr->point2);
+      AT(mf_type,mfptr)->name,Values[AT(mf_type,mfptr)->value],AT(mf_type,mfptr)->point1,AT(mf_type,mfptr)->point2);
     }
     printf("\n");
   }
-  for(ioptr=System_Output;ioptr!=NULL;ioptr=ioptr->next){
-    printf("%s: Value= %d\n",ioptr->name,ioptr->value);
-    for(mfptr=ioptr->membership_functions;mfptr!=NULL;mfptr=mfptr->next){
+  for(ioptr=HEADER->System_Output;ioptr!=0;ioptr=AT(io_type,ioptr)->next){
+    printf("%s: Value= %d\n",AT(io_type,ioptr)->name,Values[AT(io_type,ioptr)->value]);
+    for(mfptr=AT(io_type,ioptr)->membership_functions;mfptr!=0;mfptr=AT(mf_type,mfptr)->next){
       printf("  %s: Value %d Left %d Right %d\n",
-      mfptr->name,mfptr->value,mfptr->point1,mfptr->point2);
+      AT(mf_type,mfptr)->name,Values[AT(mf_type,mfptr)->value],AT(mf_type,mfptr)->point1,AT(mf_type,mfptr)->point2);
     }
   }
   /* print values pointed to by rule_type (if & then) */
   printf("\n");
-  for(ruleptr=Rule_Base;ruleptr->next!=NULL;ruleptr=ruleptr->next){
+  for(ruleptr=HEADER->Rule_Base;ruleptr!=0;ruleptr=AT(rule_type,ruleptr)->next){
     printf("Rule #%d:",cnt++);
-    for(ifptr=ruleptr->if_side;ifptr!=NULL;ifptr=ifptr->next)
-    printf("  %d",*(ifptr->value));
-    for(thenptr=ruleptr->then_side;thenptr!=NULL;thenptr=thenptr->next)
-    printf("  %d\n",*(thenptr->value));
+    for(ifptr=AT(rule_type,ruleptr)->if_side;ifptr!=0;ifptr=AT(rule_element_type,ifptr)->next)
+    printf("  %d",Values[AT(rule_element_type,ifptr)->value]);
+    for(thenptr=AT(rule_type,ruleptr)->then_side;thenptr!=0;thenptr=AT(rule_element_type,thenptr)->next)
+    printf("  %d",Values[AT(rule_element_type,thenptr)->value]);
+    if(AT(rule_type,ruleptr)->tsk_side)printf("  %d",Values[AT(rule_type,ruleptr)->strength]);  /* TSK strength */
+    printf("\n");
   }
   printf("\n");
 }                                        /* END PUT SYSTEM OUTPUTS */
-void get_system_inputs(int input1,int input2){         /* NEW */
-
-  struct io_type *ioptr;
-  ioptr=System_Inputs;
-  ioptr->value=input1;
-  ioptr=ioptr->next;
-  ioptr->value=input2;
+void get_system_inputs(int count, const int *input){   /* NEW, inputs in system order, missing ones are 0 */
+  int ioptr;
+  int i=0;
+  for(ioptr=HEADER->System_Inputs;ioptr!=0;ioptr=AT(io_type,ioptr)->next,i++)
+    Values[AT(io_type,ioptr)->value]=i<count?input[i]:0;
 }                                        /* END GET SYSTEM INPUTS */
 
-float max(float a, float b){
-  float max;
+int max(int a, int b){
+  int max;
   if(a > b){
     max = a;
   }
@@ -356,8 +755,8 @@ float max(float a, float b){
   return max;
 }
 
-float min(float a, float b){
-  float min;
+int min(int a, int b){
+  int min;
   if(a > b){
     min = b;
   }